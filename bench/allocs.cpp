@@ -0,0 +1,130 @@
+// Counts heap allocations per request on the serving thread, for requests
+// served end to end by a session over a socketpair. Run from the repository
+// root (it serves www/). Prints one JSON object per case.
+// Usage: bench_allocs [--requests=N]
+#include "bench.hpp"
+#include <http/session.hpp>
+#include <http/log.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+
+namespace {
+    // Only the serving thread counts, so the drainer and logger don't show up
+    thread_local bool counting = false;
+    thread_local std::uint64_t allocations = 0;
+    thread_local std::uint64_t allocated_bytes = 0;
+
+    void* allocate(std::size_t size) {
+        if(counting) {
+            allocations++;
+            allocated_bytes += size;
+        }
+        if(void* p = std::malloc(size ? size : 1)) return p;
+        throw std::bad_alloc();
+    }
+
+    // Serves requests written to the other end of a socketpair, with a thread
+    // discarding the responses
+    class loopback_session : public http::session {
+        int peer;
+        std::thread drainer;
+
+        public:
+        loopback_session() {
+            int fds[2];
+            if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) throw std::runtime_error("socketpair failed");
+            attach(fds[0]);
+            peer = fds[1];
+            drainer = std::thread([this](){
+                char discard[64 * 1024];
+                while(::read(peer, discard, sizeof(discard)) > 0);
+            });
+        }
+
+        ~loopback_session() {
+            ::shutdown(sockfd, SHUT_RDWR);
+            drainer.join();
+            ::close(sockfd);
+            ::close(peer);
+        }
+
+        bool serve(const std::string& request) {
+            if(::write(peer, request.data(), request.size()) != static_cast<ssize_t>(request.size())) return false;
+            // As the blocking loop does, once nothing more is pipelined
+            bool persistent = serve_one();
+            if(!request_buffered()) flush_corked();
+            return persistent;
+        }
+    };
+
+    std::string request_for(const std::string& path, const std::string& extra = "") {
+        return "GET " + path + " HTTP/1.1\r\n"
+               "Host: localhost:9999\r\n"
+               "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+               "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+               "Accept-Language: en-GB,en;q=0.5\r\n"
+               "Connection: keep-alive\r\n" + extra + "\r\n";
+    }
+
+    void measure(const std::string& name, const std::string& request, int requests) {
+        loopback_session session;
+        // Warm up caches and buffers first
+        for(int i = 0; i < 16; i++) session.serve(request);
+        allocations = allocated_bytes = 0;
+        counting = true;
+        for(int i = 0; i < requests; i++) session.serve(request);
+        counting = false;
+        fmt::print("{{\"benchmark\": \"allocs_{}\", \"requests\": {}, \"allocations_per_request\": {:.2f}, \"bytes_per_request\": {:.1f}}}\n",
+            name, requests, static_cast<double>(allocations) / requests, static_cast<double>(allocated_bytes) / requests);
+        std::fflush(stdout);
+    }
+}
+
+void* operator new(std::size_t size) {
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size) {
+    return allocate(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+int main(int argc, char** argv) {
+    int requests = 10000;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg.rfind("--requests=", 0) == 0) requests = std::max(1, std::stoi(arg.substr(11)));
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    http::runtime_log_level.store(http::log_level::off);
+
+    measure("static_cached", request_for("/test.html"), requests);
+    measure("static_gzip_cached", request_for("/test.html", "Accept-Encoding: gzip, deflate, br\r\n"), requests);
+    measure("static_cached_80KiB", request_for("/introduction.pdf"), requests);
+    measure("not_modified", request_for("/test.css", "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT\r\n"), requests);
+    measure("not_found", request_for("/nope"), requests);
+    measure("index_cached", request_for("/delicious_fruit/"), requests);
+}
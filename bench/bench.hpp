@@ -0,0 +1,58 @@
+#ifndef COMP4621_BENCH_HPP_INCLUDED
+#define COMP4621_BENCH_HPP_INCLUDED
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fmt/format.h>
+
+namespace bench {
+    // Keeps the optimiser from discarding a result
+    template<typename T>
+    inline void keep(const T& value) {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    struct options {
+        std::chrono::milliseconds min_time{200}; // per sample
+        int samples = 5;
+        std::string filter;                       // run only benchmarks whose name contains this
+    };
+
+    // Runs body repeatedly, doubling the batch until a batch takes min_time,
+    // then takes `samples` batches of that size. Prints one JSON object per
+    // line, so runs can be diffed and tracked between commits.
+    template<typename Body>
+    void run(const options& opts, const std::string& name, Body body) {
+        if(name.find(opts.filter) == std::string::npos) return;
+        using clock = std::chrono::steady_clock;
+        auto time_batch = [&](std::uint64_t n) {
+            auto start = clock::now();
+            for(std::uint64_t i = 0; i < n; i++) body();
+            return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        };
+        std::uint64_t batch = 1;
+        while(time_batch(batch) < std::chrono::duration<double, std::nano>(opts.min_time).count() && batch < (1ull << 40)) {
+            batch *= 2;
+        }
+        std::vector<double> per_op;
+        for(int i = 0; i < opts.samples; i++) {
+            per_op.push_back(time_batch(batch) / batch);
+        }
+        std::sort(per_op.begin(), per_op.end());
+        fmt::print("{{\"benchmark\": \"{}\", \"iterations\": {}, \"samples\": {}, \"ns_per_op\": {:.1f}, \"min_ns_per_op\": {:.1f}, \"max_ns_per_op\": {:.1f}}}\n",
+            name, batch, per_op.size(), per_op[per_op.size() / 2], per_op.front(), per_op.back());
+        std::fflush(stdout);
+    }
+
+    // For benchmarks timed as whole runs rather than per op: prints the median
+    // and range of the samples, measured in unit, as a JSON line like run()'s.
+    inline void report(const std::string& name, const std::string& unit, std::vector<double> samples) {
+        std::sort(samples.begin(), samples.end());
+        fmt::print("{{\"benchmark\": \"{}\", \"samples\": {}, \"{}\": {:.1f}, \"min_{}\": {:.1f}, \"max_{}\": {:.1f}}}\n",
+            name, samples.size(), unit, samples[samples.size() / 2], unit, samples.front(), unit, samples.back());
+        std::fflush(stdout);
+    }
+}
+#endif
\ No newline at end of file
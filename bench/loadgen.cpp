@@ -0,0 +1,292 @@
+// HTTP load generator for a server on this machine. Closed loop by default:
+// every connection sends its next request as soon as the last response is
+// complete. With --rate, requests are instead scheduled at a fixed rate
+// regardless of how fast responses come back, and latency is measured from
+// when each request was due, so a stalled server can't hide its queueing.
+// Prints one JSON object with throughput and latency percentiles.
+// Usage: loadgen [--host=127.0.0.1] [--port=9999] [--path=/test.html] [--connections=N]
+//                [--duration=SECONDS] [--rate=REQUESTS_PER_SECOND] [--keep-alive=FRACTION]
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    struct options {
+        std::string host = "127.0.0.1";
+        unsigned short port = 9999;
+        std::string path = "/test.html";
+        int connections = 16;
+        double duration = 5;
+        double rate = 0;        // requests per second over all connections; 0 for closed loop
+        double keep_alive = 1;  // fraction of responses after which the connection is reused
+    };
+
+    struct connection {
+        int fd = -1;
+        bool connected = false;
+        bool busy = false;       // a request is outstanding
+        bool closing = false;    // asked the server to close after this response
+        std::string out;
+        std::size_t sent = 0;
+        std::string in;
+        clock::time_point started;
+    };
+
+    struct results {
+        std::uint64_t completed = 0;
+        std::uint64_t errors = 0;
+        std::uint64_t connects = 0;
+        std::uint64_t bytes = 0;
+        std::uint64_t late = 0; // open loop only: requests that never found a free connection in time
+        std::vector<double> latencies_us;
+    };
+
+    // Length of a complete response at the front of buf, if it's all there.
+    // Knows Content-Length and chunked framing; anything else reads to EOF.
+    std::optional<std::size_t> response_length(std::string_view buf, bool& until_close) {
+        until_close = false;
+        std::size_t head_end = buf.find("\r\n\r\n");
+        if(head_end == std::string_view::npos) return std::nullopt;
+        std::string_view head = buf.substr(0, head_end + 2);
+        std::size_t body_start = head_end + 4;
+        auto header = [&](std::string_view name) -> std::optional<std::string_view> {
+            for(std::size_t line = head.find("\r\n") + 2; line < head.size();) {
+                std::size_t end = head.find("\r\n", line);
+                std::string_view field = head.substr(line, end - line);
+                if(field.size() > name.size() && field[name.size()] == ':' &&
+                   std::equal(name.begin(), name.end(), field.begin(), [](char a, char b){ return std::tolower(a) == std::tolower(b); })) {
+                    std::string_view value = field.substr(name.size() + 1);
+                    while(!value.empty() && value.front() == ' ') value.remove_prefix(1);
+                    return value;
+                }
+                line = end + 2;
+            }
+            return std::nullopt;
+        };
+        if(head.substr(9, 3) == "304" || head.substr(9, 3) == "204") return body_start;
+        if(auto length = header("Content-Length")) {
+            std::size_t total = body_start + std::stoul(std::string{*length});
+            if(buf.size() < total) return std::nullopt;
+            return total;
+        }
+        if(auto coding = header("Transfer-Encoding"); coding && *coding == "chunked") {
+            std::size_t pos = body_start;
+            while(true) {
+                std::size_t line_end = buf.find("\r\n", pos);
+                if(line_end == std::string_view::npos) return std::nullopt;
+                std::size_t size = std::stoul(std::string{buf.substr(pos, line_end - pos)}, nullptr, 16);
+                pos = line_end + 2 + size + 2;
+                if(pos > buf.size()) return std::nullopt;
+                if(size == 0) return pos;
+            }
+        }
+        until_close = true;
+        return std::nullopt;
+    }
+
+    class generator {
+        options opts;
+        int epollfd;
+        sockaddr_in address{};
+        std::vector<connection> conns;
+        std::deque<clock::time_point> due; // open loop: requests waiting for a free connection
+        std::mt19937 random{4621};
+        results r;
+
+        void open(connection& c) {
+            c = connection{};
+            c.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int one = 1;
+            ::setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if(::connect(c.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 && errno != EINPROGRESS) {
+                throw std::runtime_error(fmt::format("connect: {}", std::strerror(errno)));
+            }
+            r.connects++;
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            event.data.u64 = &c - conns.data();
+            ::epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &event);
+        }
+
+        void reopen(connection& c) {
+            ::close(c.fd);
+            open(c);
+        }
+
+        void start(connection& c, clock::time_point when) {
+            c.closing = std::uniform_real_distribution<double>(0, 1)(random) >= opts.keep_alive;
+            c.out = fmt::format("GET {} HTTP/1.1\r\nHost: {}:{}\r\n{}\r\n", opts.path, opts.host, opts.port,
+                                c.closing ? "Connection: close\r\n" : "");
+            c.sent = 0;
+            c.busy = true;
+            c.started = when;
+            write_some(c);
+        }
+
+        void write_some(connection& c) {
+            while(c.busy && c.sent < c.out.size()) {
+                ssize_t n = ::send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+                if(n < 0) {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN) fail(c);
+                    return;
+                }
+                c.sent += n;
+            }
+        }
+
+        void fail(connection& c) {
+            r.errors++;
+            bool was_busy = c.busy;
+            auto when = c.started;
+            reopen(c);
+            // Open loop: the request still counts, retried on the fresh connection
+            if(was_busy && opts.rate > 0) due.push_front(when);
+        }
+
+        void complete(connection& c, std::size_t length, clock::time_point now) {
+            r.completed++;
+            r.bytes += length;
+            r.latencies_us.push_back(std::chrono::duration<double, std::micro>(now - c.started).count());
+            c.in.erase(0, length);
+            c.busy = false;
+            if(c.closing) reopen(c);
+        }
+
+        void read_some(connection& c, clock::time_point now) {
+            char chunk[64 * 1024];
+            while(true) {
+                ssize_t n = ::recv(c.fd, chunk, sizeof(chunk), 0);
+                if(n > 0) {
+                    c.in.append(chunk, n);
+                    bool until_close;
+                    if(auto length = response_length(c.in, until_close)) complete(c, *length, now);
+                    if(!c.busy) return;
+                    continue;
+                }
+                if(n == 0) {
+                    bool until_close;
+                    response_length(c.in, until_close);
+                    if(c.busy && until_close) complete(c, c.in.size(), now);
+                    else if(c.busy) { fail(c); return; }
+                    reopen(c);
+                    return;
+                }
+                if(errno != EAGAIN && errno != EWOULDBLOCK) fail(c);
+                return;
+            }
+        }
+
+        void dispatch(clock::time_point now, bool issuing) {
+            if(!issuing) return;
+            for(auto& c : conns) {
+                if(c.busy || !c.connected) continue;
+                if(opts.rate > 0) {
+                    if(due.empty()) return;
+                    start(c, due.front());
+                    due.pop_front();
+                } else {
+                    start(c, now);
+                }
+            }
+        }
+
+        public:
+        explicit generator(options o) : opts(std::move(o)), epollfd(::epoll_create1(EPOLL_CLOEXEC)), conns(opts.connections) {
+            address.sin_family = AF_INET;
+            address.sin_port = htons(opts.port);
+            if(::inet_pton(AF_INET, opts.host.c_str(), &address.sin_addr) != 1) throw std::runtime_error("bad --host, expected an IPv4 address");
+            for(auto& c : conns) open(c);
+        }
+
+        results run() {
+            const auto begin = clock::now();
+            const auto end = begin + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(opts.duration));
+            const auto interval = opts.rate > 0 ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / opts.rate)) : clock::duration{};
+            auto next_due = begin;
+            std::vector<epoll_event> events(256);
+            while(true) {
+                auto now = clock::now();
+                if(now >= end) break;
+                if(opts.rate > 0) {
+                    for(; next_due <= now; next_due += interval) due.push_back(next_due);
+                }
+                dispatch(now, true);
+                auto wait_until = opts.rate > 0 ? std::min(next_due, end) : end;
+                // Rounded down, then polled for the remainder, so open-loop requests aren't sent late
+                int timeout = static_cast<int>(std::chrono::floor<std::chrono::milliseconds>(wait_until - now).count());
+                int n = ::epoll_wait(epollfd, events.data(), events.size(), std::max(0, std::min(timeout, 100)));
+                now = clock::now();
+                for(int i = 0; i < n; i++) {
+                    connection& c = conns[events[i].data.u64];
+                    if(events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                        fail(c);
+                        continue;
+                    }
+                    if(events[i].events & EPOLLOUT) {
+                        c.connected = true;
+                        write_some(c);
+                    }
+                    if(events[i].events & EPOLLIN) read_some(c, now);
+                }
+            }
+            if(opts.rate > 0) r.late = due.size();
+            for(auto& c : conns) ::close(c.fd);
+            return r;
+        }
+    };
+
+    double percentile(const std::vector<double>& sorted, double q) {
+        if(sorted.empty()) return 0;
+        return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(q * sorted.size()))];
+    }
+}
+
+int main(int argc, char** argv) {
+    options opts;
+    try {
+        for(int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            std::string name = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            if(name == "--host") opts.host = value;
+            else if(name == "--port") opts.port = static_cast<unsigned short>(std::stoul(value));
+            else if(name == "--path") opts.path = value;
+            else if(name == "--connections") opts.connections = std::max(1, std::stoi(value));
+            else if(name == "--duration") opts.duration = std::stod(value);
+            else if(name == "--rate") opts.rate = std::stod(value);
+            else if(name == "--keep-alive") opts.keep_alive = std::stod(value);
+            else throw std::invalid_argument("Bad option " + arg);
+        }
+        results r = generator{opts}.run();
+        std::sort(r.latencies_us.begin(), r.latencies_us.end());
+        fmt::print("{{\"mode\": \"{}\", \"path\": \"{}\", \"connections\": {}, \"keep_alive\": {}, \"target_rate\": {}, "
+                   "\"duration_s\": {}, \"requests\": {}, \"errors\": {}, \"connects\": {}, \"late\": {}, \"bytes\": {}, "
+                   "\"throughput_rps\": {:.1f}, \"latency_us\": {{\"p50\": {:.1f}, \"p90\": {:.1f}, \"p99\": {:.1f}, \"p999\": {:.1f}, \"max\": {:.1f}}}}}\n",
+            opts.rate > 0 ? "open" : "closed", opts.path, opts.connections, opts.keep_alive, opts.rate,
+            opts.duration, r.completed, r.errors, r.connects, r.late, r.bytes,
+            r.completed / opts.duration,
+            percentile(r.latencies_us, 0.5), percentile(r.latencies_us, 0.9), percentile(r.latencies_us, 0.99),
+            percentile(r.latencies_us, 0.999), r.latencies_us.empty() ? 0.0 : r.latencies_us.back());
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,184 @@
+// Microbenchmarks for the request hot path. Run from the repository root
+// (serve_index reads www/). Prints one JSON object per benchmark.
+// Usage: bench_micro [--filter=SUBSTRING] [--min-time-ms=N] [--samples=N]
+#include "bench.hpp"
+#include <http/parser.hpp>
+#include <http/request.hpp>
+#include <http/response.hpp>
+#include <http/session.hpp>
+#include <http/index.hpp>
+#include <http/compression.hpp>
+#include <http/mime.hpp>
+#include <http/path_cache.hpp>
+#include <http/log.hpp>
+#include <http/worker_pool.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <iostream>
+#include <thread>
+
+namespace {
+    const std::string typical_request =
+        "GET /delicious_fruit/index.html HTTP/1.1\r\n"
+        "Host: localhost:9999\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+        "Accept-Language: en-GB,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "\r\n";
+
+    std::string html_body(std::size_t size) {
+        std::string body;
+        for(int i = 0; body.size() < size; i++) {
+            body += fmt::format("<tr><td><a href='item{0}.html'>item {0}</a></td><td>{1}</td></tr>\n", i, i * 37 % 1000);
+        }
+        body.resize(size);
+        return body;
+    }
+
+    // A session whose socket is one end of a socketpair, with a thread
+    // discarding whatever arrives at the other end
+    class sink_session : public http::session {
+        int peer;
+        std::thread drainer;
+
+        public:
+        sink_session() {
+            int fds[2];
+            if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) throw std::runtime_error("socketpair failed");
+            attach(fds[0]);
+            peer = fds[1];
+            drainer = std::thread([this](){
+                char discard[64 * 1024];
+                while(::read(peer, discard, sizeof(discard)) > 0);
+            });
+        }
+
+        ~sink_session() {
+            ::shutdown(sockfd, SHUT_RDWR);
+            drainer.join();
+            ::close(sockfd);
+            ::close(peer);
+        }
+
+        void send(http::response r) {
+            send_response(std::move(r));
+        }
+    };
+
+    struct noop_worker {
+        void operator()(int n) {
+            bench::keep(n);
+        }
+    };
+}
+
+int main(int argc, char** argv) {
+    bench::options opts;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg.rfind("--filter=", 0) == 0) opts.filter = arg.substr(9);
+        else if(arg.rfind("--min-time-ms=", 0) == 0) opts.min_time = std::chrono::milliseconds(std::stoi(arg.substr(14)));
+        else if(arg.rfind("--samples=", 0) == 0) opts.samples = std::max(1, std::stoi(arg.substr(10)));
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    http::runtime_log_level.store(http::log_level::off);
+
+    bench::run(opts, "parse_request", [&](){
+        http::request_parser parser;
+        http::request req;
+        bench::keep(parser.parse(typical_request, req));
+    });
+
+    bench::run(opts, "parse_request_split_in_8", [&](){
+        // The head arriving in pieces, each parse picking up where the last stopped
+        http::request_parser parser;
+        http::request req;
+        std::size_t step = typical_request.size() / 8 + 1;
+        for(std::size_t end = step; ; end += step) {
+            if(parser.parse(std::string_view{typical_request}.substr(0, std::min(end, typical_request.size())), req)) break;
+        }
+        bench::keep(req);
+    });
+
+    {
+        http::request_parser parser;
+        http::request req;
+        parser.parse(typical_request, req);
+        bench::run(opts, "request_header_lookup", [&](){
+            // What the session asks of every request, plus one header it doesn't intern
+            bench::keep(req.header(http::field::connection));
+            bench::keep(req.header(http::field::accept_encoding));
+            bench::keep(req.header(http::field::range));
+            bench::keep(req.header(http::field::if_none_match));
+            bench::keep(req.header("sec-fetch-mode"));
+        });
+    }
+
+    {
+        sink_session session;
+        const std::string small = html_body(400);
+        const std::string large = html_body(256 * 1024);
+        bench::run(opts, "transfer_id_400B", [&](){
+            session.send({200, "OK", {{"Content-Type", "text/html"}}, small});
+        });
+        bench::run(opts, "transfer_id_256KiB", [&](){
+            session.send({200, "OK", {{"Content-Type", "text/html"}}, large});
+        });
+        bench::run(opts, "transfer_chunked_256KiB", [&](){
+            std::size_t sent = 0;
+            http::response r{200, "OK", {{"Content-Type", "text/html"}}, {}};
+            r.source = http::generator_source([&]() -> std::string {
+                if(sent == large.size()) return {};
+                std::size_t n = std::min<std::size_t>(16 * 1024, large.size() - sent);
+                sent += n;
+                return large.substr(sent - n, n);
+            });
+            session.send(std::move(r));
+        });
+    }
+
+    for(std::size_t size : {std::size_t{4 * 1024}, std::size_t{256 * 1024}}) {
+        const std::string body = html_body(size);
+        std::vector<char> out(64 * 1024);
+        for(int level : {1, 6, 9}) {
+            bench::run(opts, fmt::format("encode_gzip_{}KiB_level{}", size / 1024, level), [&](){
+                auto gzipped = http::gzip_source(http::memory_source(body), level);
+                std::size_t total = 0;
+                while(std::size_t n = gzipped->read(out.data(), out.size())) total += n;
+                bench::keep(total);
+            });
+        }
+    }
+
+    {
+        const char* names[] = {"index.html", "style.css", "photo.jpg", "paper.pdf", "font.woff2", "archive.tar", "deck.pptx", "icon.svg"};
+        std::size_t i = 0;
+        bench::run(opts, "get_content_type", [&](){
+            bench::keep(http::get_content_type(names[i++ % 8]));
+        });
+    }
+
+    bench::run(opts, "resolve_path_cached", [&](){
+        bench::keep(http::resolved_paths().resolve("/delicious_fruit/index.html"));
+    });
+
+    bench::run(opts, "serve_index_cached", [&](){
+        bench::keep(http::serve_index("/delicious_fruit", "www/delicious_fruit"));
+    });
+
+    {
+        http::worker_pool<noop_worker> pool(2);
+        bench::run(opts, "worker_pool_dispatch_x1000", [&](){
+            for(int i = 0; i < 1000; i++) pool.post_task(i);
+            pool.finish_all();
+        });
+    }
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Builds and runs the benchmarks, printing JSON lines tagged with the commit,
+# e.g. bench/run.sh > results-$(git rev-parse --short HEAD).jsonl
+# Needs the port (default 9999) free; the server is started and stopped here.
+set -e
+cd "$(dirname "$0")/.."
+ninja a.out bench >&2
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+port=${PORT:-9999}
+tag() {
+    sed "s/^{/{\"commit\": \"$commit\", /"
+}
+
+./bench_micro | tag
+./bench_allocs | tag
+./bench_worker_pool | tag
+
+./a.out --mode=${MODE:-reactor} --port=$port --access-log=off --log-level=warning >&2 &
+server=$!
+trap 'kill $server' EXIT
+sleep 0.5
+for connections in 1 16 64; do
+    ./loadgen --port=$port --connections=$connections --duration=5 | tag
+done
+./loadgen --port=$port --connections=16 --duration=5 --keep-alive=0 | tag
+./loadgen --port=$port --connections=64 --duration=5 --rate=5000 | tag
+./loadgen --port=$port --connections=16 --duration=5 --path=/introduction.pdf | tag
@@ -0,0 +1,119 @@
+// Dispatch throughput of http::worker_pool against the mutex-and-deque pool it replaced.
+// Usage: bench_worker_pool [threads] [tasks]
+#include "bench.hpp"
+#include <http/worker_pool.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <tuple>
+#include <vector>
+#include <fmt/format.h>
+
+namespace {
+    // The previous worker_pool, kept as the baseline. Only change: threads
+    // are told to stop and joined on destruction, so the benchmark exits cleanly.
+    template<typename T>
+    class mutex_pool {
+        std::vector<T> workers;
+        std::vector<std::thread> threads;
+        bool stopping = false;
+
+        std::deque<std::packaged_task<void(T&)>> tasks;
+        std::condition_variable task_available;
+        std::mutex task_mutex;
+
+        std::atomic<int> tasks_left;
+        std::condition_variable finished;
+        std::mutex finish_mutex;
+
+        public:
+        mutex_pool(int n_threads) : workers(n_threads), tasks_left(0) {
+            threads.reserve(n_threads);
+            for(int i = 0; i < n_threads; i++) {
+                threads.emplace_back([i, this](){
+                    while(true) {
+                        std::packaged_task<void(T&)> current_task;
+                        {
+                            std::unique_lock<std::mutex> lock(task_mutex);
+                            task_available.wait(lock, [&](){ return stopping || tasks.size() > 0; });
+                            if(tasks.empty()) return;
+                            current_task = std::move(tasks.front());
+                            tasks.pop_front();
+                        }
+                        current_task(workers[i]);
+                        if(--tasks_left == 0) {
+                            std::lock_guard<std::mutex> lock(finish_mutex);
+                            finished.notify_all();
+                        }
+                    }
+                });
+            }
+        }
+
+        ~mutex_pool() {
+            finish_all();
+            {
+                std::lock_guard<std::mutex> lock(task_mutex);
+                stopping = true;
+            }
+            task_available.notify_all();
+            for(auto& t : threads) {
+                t.join();
+            }
+        }
+
+        void finish_all() {
+            std::unique_lock<std::mutex> lock(finish_mutex);
+            finished.wait(lock, [&](){ return tasks_left.load() == 0; });
+        }
+
+        template<typename... ArgTs>
+        void post_task(ArgTs&&... args) {
+            std::lock_guard<std::mutex> lock(task_mutex);
+            tasks.emplace_back([args = std::make_tuple(std::forward<ArgTs>(args)...)](T& worker){
+                std::apply(worker, std::move(args));
+            });
+            tasks_left++;
+            task_available.notify_one();
+        }
+    };
+
+    std::atomic<long> checksum{0};
+
+    // Stands in for a session: a little work per task, shaped like operator()(int sockfd)
+    struct counting_worker {
+        long total = 0;
+        void operator()(int n) {
+            for(int i = 0; i < 64; i++) total += n ^ i;
+            checksum.fetch_add(total & 1, std::memory_order_relaxed);
+        }
+    };
+
+    template<typename Pool>
+    double tasks_per_second(int n_threads, int n_tasks) {
+        Pool pool(n_threads);
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < n_tasks; i++) {
+            pool.post_task(i);
+        }
+        pool.finish_all();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return n_tasks / elapsed.count();
+    }
+}
+
+int main(int argc, char** argv) {
+    int n_threads = argc > 1 ? std::atoi(argv[1]) : std::max(2u, std::thread::hardware_concurrency());
+    int n_tasks = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    fmt::print(stderr, "{} threads, {} tasks\n", n_threads, n_tasks);
+    // Interleaved, so that both see the same machine conditions
+    std::vector<double> baseline, current;
+    for(int round = 0; round < 5; round++) {
+        baseline.push_back(tasks_per_second<mutex_pool<counting_worker>>(n_threads, n_tasks));
+        current.push_back(tasks_per_second<http::worker_pool<counting_worker>>(n_threads, n_tasks));
+    }
+    bench::report("dispatch_mutex_pool", "tasks_per_s", baseline);
+    bench::report("dispatch_worker_pool", "tasks_per_s", current);
+}
@@ -0,0 +1,15 @@
+#ifndef COMP4621_ADMISSION_HPP_INCLUDED
+#define COMP4621_ADMISSION_HPP_INCLUDED
+#include <cstddef>
+namespace http {
+    // Takes one of settings().max_connections; false when they are all in use
+    bool admit_connection();
+    // Gives back what admit_connection took, once the connection is closed
+    void release_connection();
+    std::size_t open_connections();
+
+    // Answers a just-accepted socket with a canned 503 and Retry-After, without
+    // blocking or reading its request, and closes it
+    void turn_away(int clientfd);
+}
+#endif
\ No newline at end of file
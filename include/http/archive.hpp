@@ -0,0 +1,84 @@
+#ifndef COMP4621_ARCHIVE_HPP_INCLUDED
+#define COMP4621_ARCHIVE_HPP_INCLUDED
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <http/response.hpp>
+#include <http/util.hpp>
+namespace http {
+    // Layout of a document root packed by the pack tool. Offsets are from the
+    // start of the file, and integers are in host byte order, since an archive
+    // is packed for the machine that serves it.
+    struct archive_span {
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+
+    struct archive_header {
+        char magic[8]; // archive_magic
+        std::uint32_t version;
+        std::uint32_t entry_count;
+        // Open-addressed by archive_hash(path) & (slot_count - 1), probing linearly;
+        // each slot holds 1 + an entry's index, or 0 if empty. slot_count is a power of two.
+        std::uint64_t slot_count;
+        std::uint64_t slots_offset;
+        std::uint64_t entries_offset;
+    };
+
+    struct archive_entry {
+        enum kind : std::uint32_t { file, directory };
+        archive_span path; // as requested: "/", "/dir", "/dir/name"
+        kind type;
+        std::uint32_t reserved;
+        std::int64_t modified;
+        archive_span content_type;
+        // Empty for directories, which are served without validators
+        archive_span etag;
+        archive_span gzip_etag;
+        archive_span last_modified;
+        // The file itself, or a directory's listing page
+        archive_span identity;
+        // Only when gzip made it smaller
+        archive_span gzip;
+    };
+
+    inline constexpr char archive_magic[8] = {'C', 'O', 'M', 'P', '4', '6', '2', '1'};
+    inline constexpr std::uint32_t archive_version = 1;
+
+    // FNV-1a over the request path
+    std::uint64_t archive_hash(std::string_view path);
+
+    // A packed document root, mapped read-only and shared so every process
+    // serving it uses the same page cache pages. Opening only checks the
+    // header and tables; spans are checked as they are used.
+    class archive {
+        std::shared_ptr<const unique_fd> fd;
+        const char* base;
+        std::size_t size;
+        const archive_header* header;
+        const std::uint32_t* slots;
+        const archive_entry* entries;
+
+        public:
+        // Throws std::system_error if the file can't be mapped, std::runtime_error if it isn't an archive
+        explicit archive(const std::string& path);
+        ~archive();
+        archive(const archive&) = delete;
+        archive& operator=(const archive&) = delete;
+
+        // The entry for a lexically normal request path, or null
+        const archive_entry* find(std::string_view path) const;
+        // Throw std::runtime_error if the span runs past the end of the file
+        std::string_view bytes(const archive_span& span) const;
+        // The span as a region of the archive file, to be sent with sendfile
+        http::file_body file(const archive_span& span) const;
+        std::size_t entry_count() const { return header->entry_count; }
+    };
+
+    // The archive named by settings().archive, mapped by the first call; null
+    // when serving straight from the document root. main makes the first call.
+    const archive* packed_site();
+}
+#endif
\ No newline at end of file
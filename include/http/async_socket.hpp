@@ -0,0 +1,62 @@
+#ifndef COMP4621_ASYNC_SOCKET_HPP_INCLUDED
+#define COMP4621_ASYNC_SOCKET_HPP_INCLUDED
+#include <coroutine>
+#include <cstddef>
+#include <utility>
+#include <sys/uio.h>
+#include <http/task.hpp>
+#include <http/response.hpp>
+namespace http {
+    // A non-blocking socket (not owned) for coroutines on an edge-triggered
+    // event loop. Every operation tries the call first and only suspends once
+    // the socket would block, until the loop reports it ready again, so no
+    // readiness edge is ever missed. A wait the loop gives up on (see time_out)
+    // resumes with std::system_error(ETIMEDOUT); other socket errors throw too.
+    class async_socket {
+        int fd;
+        std::coroutine_handle<> waiting;
+        unsigned wanted = 0;
+        bool expired = false;
+        bool sent_some = false;
+
+        public:
+        class readiness {
+            async_socket& socket;
+            unsigned events;
+
+            public:
+            readiness(async_socket& socket, unsigned events) : socket(socket), events(events) {}
+            // Only awaited once the socket has said it would block, so always suspends
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> awaiting) noexcept;
+            void await_resume();
+        };
+
+        explicit async_socket(int fd) : fd(fd) {}
+        async_socket(const async_socket&) = delete;
+        async_socket& operator=(const async_socket&) = delete;
+
+        int get() const { return fd; }
+
+        readiness readable();
+        readiness writable();
+
+        // Up to max bytes, or 0 once the peer has closed its side
+        http::task<std::size_t> read_some(char* into, std::size_t max);
+        // All of iov (which is used up on the way), with MSG_NOSIGNAL and flags
+        http::task<void> write(iovec* iov, int count, int flags = 0);
+        // All of a file region, with sendfile
+        http::task<void> send_file(const http::file_body& file);
+        // The next connection on a listening socket, non-blocking
+        http::task<int> accept();
+
+        // For the loop: resumes whoever waits for any of the (epoll) events
+        void wake(unsigned events);
+        // For the loop: resumes whoever waits, with a timeout error
+        void time_out();
+        bool suspended() const { return static_cast<bool>(waiting); }
+        // Whether anything was sent since the last call, for write deadlines
+        bool progressed() { return std::exchange(sent_some, false); }
+    };
+}
+#endif
\ No newline at end of file
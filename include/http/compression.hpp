@@ -0,0 +1,28 @@
+#ifndef COMP4621_COMPRESSION_HPP_INCLUDED
+#define COMP4621_COMPRESSION_HPP_INCLUDED
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <http/response.hpp>
+namespace http {
+    // Whether deflate gains anything on this type. Images, video, audio,
+    // archives, PDFs and woff fonts are compressed already.
+    bool compressible(std::string_view content_type);
+
+    // Whether a body of this type and size (when known up front) goes out
+    // gzipped under the configured level and minimum size
+    bool worth_compressing(std::string_view content_type, std::optional<std::size_t> size);
+
+    // The q-value Accept-Encoding gives a content coding, in thousandths:
+    // its own entry if listed, else that of "*", else 0
+    int coding_quality(std::string_view accept_encoding, std::string_view coding);
+
+    // Whether gzip is acceptable, and not ranked below an explicit identity
+    bool accepts_gzip(std::string_view accept_encoding);
+
+    // Deflates inner into the gzip format as it is pulled, at the given zlib
+    // level. The zlib state comes from (and goes back to) a few kept per thread.
+    std::shared_ptr<body_source> gzip_source(std::shared_ptr<body_source> inner, int level);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef COMP4621_CONFIG_HPP_INCLUDED
+#define COMP4621_CONFIG_HPP_INCLUDED
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <http/log.hpp>
+namespace http {
+    enum class server_mode {
+        blocking, // one pool thread per connection for its whole lifetime
+        reactor,  // non-blocking connections multiplexed over a few epoll loops
+        sharded,  // like reactor, but each loop accepts on its own SO_REUSEPORT listener
+        uring,    // like sharded, with io_uring loops instead of epoll; falls back to sharded without it
+        coroutine // like sharded, with every connection a coroutine over an awaitable socket
+    };
+
+    // Requests for paths under prefix are forwarded to the upstream at host:port
+    struct proxy_route {
+        std::string prefix;
+        std::string host;
+        unsigned short port;
+    };
+
+    // Runtime settings. Filled in from the command line before the server
+    // starts, and read-only once any thread is serving.
+    struct config {
+        unsigned short port = 9999;
+        std::string root = "www"; // document root, canonicalized once at startup
+        std::string archive; // a packed document root (from the pack tool) to serve instead, if set
+        server_mode mode = server_mode::blocking;
+        int threads = 0; // 0 picks a default for the mode
+        bool pin_threads = false; // pin each worker or event loop thread to its own CPU
+        int backlog = 1024; // listen() backlog, per listener
+        int defer_accept = 0; // TCP_DEFER_ACCEPT timeout in seconds, 0 to accept as soon as the handshake completes
+        std::size_t chunk_size = 64 * 1024; // bytes pulled from a body source per write
+        // Timeouts in seconds: for the next request on an idle connection, for the rest
+        // of a request head once it has started, and for the client to take queued responses
+        int idle_timeout = 5;
+        int header_timeout = 10;
+        int write_timeout = 10;
+        int body_timeout = 10; // between pieces of a request body arriving
+        // PUT stores the request body under the document root when enabled
+        bool uploads = false;
+        std::uint64_t max_upload_size = std::uint64_t{16} << 30;
+        // Bodies of other requests are read into memory, so they have a much lower limit
+        std::size_t max_body_size = 1024 * 1024;
+        // Reverse proxying, by path prefix; the first matching route wins
+        std::vector<proxy_route> proxies;
+        int upstream_timeout = 10; // seconds, for connecting and for each wait on the upstream after that
+        int upstream_retries = 1; // further attempts when an upstream can't be reached, or drops a reused connection
+        std::size_t upstream_idle = 32; // idle connections kept per upstream, each for up to idle_timeout
+        int upstream_threads = 16; // event loops hand connections waiting on an upstream to these
+        // Admission control: past either limit, new connections get a 503 straight away
+        int max_connections = 10000; // open at once, 0 for no limit
+        int max_queued = 256; // waiting for a free worker in blocking mode, 0 for no limit
+        int retry_after = 1; // seconds, sent with the 503
+        int gzip_level = 6; // zlib level from 1 (fastest) to 9 (smallest), 0 to never compress
+        std::size_t gzip_min_size = 256; // bodies known to be smaller go out unencoded
+        log_level log_threshold = log_level::info;
+        std::string access_log = "-"; // path, "-" for stdout or "off"
+        // Cache-Control values for static files, as (glob over the request path, value); first match wins
+        std::vector<std::pair<std::string, std::string>> cache_control;
+    };
+
+    config& settings();
+
+    // The Cache-Control value configured for a request path, or empty if none applies
+    std::string_view cache_control_for(const std::string& path);
+
+    // Parses --name=value flags into settings(), throwing std::invalid_argument on anything unknown
+    void parse_args(int argc, char** argv);
+}
+#endif
\ No newline at end of file
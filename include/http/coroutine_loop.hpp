@@ -0,0 +1,71 @@
+#ifndef COMP4621_COROUTINE_LOOP_HPP_INCLUDED
+#define COMP4621_COROUTINE_LOOP_HPP_INCLUDED
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <http/timer_wheel.hpp>
+#include <http/async_socket.hpp>
+#include <http/task.hpp>
+namespace http {
+    class coroutine_connection;
+
+    // An epoll loop that accepts on its own SO_REUSEPORT listener, like a
+    // sharded reactor, but where each connection is a coroutine that reads,
+    // serves and writes in straight-line code over an async_socket, and the
+    // loop only resumes whichever coroutine an event (or deadline) is for.
+    // Coroutine frames come from the loop thread's frame_pool. A connection
+    // whose request goes upstream awaits an upstream worker getting its
+    // response, then the upstream's fd whenever the response body runs dry.
+    class coroutine_loop {
+        int epollfd;
+        int wakefd;
+        std::atomic<bool> stopping;
+
+        // Connections back from upstream workers
+        std::vector<coroutine_connection*> returned;
+        std::mutex returned_mutex;
+        std::condition_variable all_returned;
+
+        // Owned and touched only by the loop thread
+        http::async_socket listener;
+        http::task<void> acceptor;
+        http::timer_wheel timers;
+        std::unordered_map<int, std::unique_ptr<coroutine_connection>> connections;
+        // Connections out on an upstream worker, which the loop leaves alone until they come back
+        std::size_t out_on_workers = 0;
+        // Upstream fds watched for the connections awaiting more of a response body from them
+        std::unordered_map<int, coroutine_connection*> upstreams;
+
+        std::thread thread;
+
+        void run();
+        http::task<void> accept_connections();
+        void watch(int clientfd);
+        void on_event(coroutine_connection& conn, unsigned events);
+        // Hangs up on a connection whose deadline passed, after a 408 if it was sending a request head
+        void expire(coroutine_connection& conn);
+        // Hangs up once a connection's coroutine has finished, otherwise moves its deadline on.
+        // Leaves alone one that is out on an upstream worker.
+        void settle(coroutine_connection& conn);
+        void close(coroutine_connection& conn);
+        void resume_returned();
+        void unwatch_upstream(coroutine_connection& conn);
+
+        public:
+        // listenfd (non-blocking, not owned) is the socket the loop accepts from
+        explicit coroutine_loop(int listenfd);
+        ~coroutine_loop();
+        void pin_to_cpu(unsigned cpu);
+        // Sends a connection whose next request goes upstream to an upstream worker
+        void hand_off(coroutine_connection& conn);
+        // Thread-safe: takes back a connection from an upstream worker
+        void take_back(coroutine_connection& conn);
+        // Resumes the connection once the upstream fd its response waits on is readable
+        void watch_upstream(coroutine_connection& conn, int fd);
+    };
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,105 @@
+#ifndef COMP4621_HEADERS_HPP_INCLUDED
+#define COMP4621_HEADERS_HPP_INCLUDED
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+namespace http {
+    // Header fields the server itself looks at. Request headers are interned
+    // to these when parsed, so finding one is an index rather than a search.
+    enum class field : std::uint8_t {
+        host, connection, keep_alive, te, upgrade, via, forwarded, x_forwarded_for,
+        accept, accept_encoding, accept_language, user_agent, authorization, cookie, referer,
+        content_length, content_type, content_encoding, transfer_encoding, expect,
+        range, if_range, if_match, if_none_match, if_modified_since, if_unmodified_since, cache_control,
+        other // any header not listed, and the number that are
+    };
+    constexpr std::size_t field_count = static_cast<std::size_t>(field::other);
+
+    // The canonical spelling of a well-known field, e.g. "Accept-Encoding"
+    std::string_view field_name(field f);
+    // The well-known field with this name, matched case-insensitively, or field::other
+    field find_field(std::string_view name);
+    // ASCII case-insensitive comparison, as for header names and most tokens
+    bool iequals(std::string_view lhs, std::string_view rhs);
+    // Takes the next element off the front of a comma separated header value, without the
+    // whitespace around it. Empty elements (as in "a, ,b") come out empty. False once list is used up.
+    bool next_element(std::string_view& list, std::string_view& element);
+    // Whether a comma separated header value lists the given token, in any case
+    bool has_token(std::string_view list, std::string_view token);
+
+    // A request's headers, viewing into the receive buffer like the rest of
+    // the request. Every header is kept in arrival order; the first of each
+    // well-known field also has a slot of its own.
+    class request_headers {
+        public:
+        struct entry {
+            std::string_view name;
+            std::string_view value;
+        };
+
+        private:
+        std::vector<entry> entries;
+        // 1 + the index in entries of each well-known field, or 0 if it wasn't sent
+        std::array<std::uint16_t, field_count> slots;
+
+        public:
+        request_headers() { clear(); }
+        void clear();
+        // known is the field the name was interned to
+        void add(std::string_view name, std::string_view value, field known);
+
+        // The value of the first header of the field, or an empty view
+        std::string_view get(field f) const {
+            std::uint16_t slot = slots[static_cast<std::size_t>(f)];
+            return slot ? entries[slot - 1].value : std::string_view{};
+        }
+        std::string_view get(std::string_view name) const;
+
+        std::size_t size() const { return entries.size(); }
+        std::vector<entry>::const_iterator begin() const { return entries.begin(); }
+        std::vector<entry>::const_iterator end() const { return entries.end(); }
+    };
+
+    // A response's headers in the order they were first set, held in the
+    // memory resource the table was made with. Names are compared
+    // case-insensitively, and each appears at most once, unless it was add()ed.
+    class response_headers {
+        public:
+        struct entry {
+            std::pmr::string name;
+            std::pmr::string value;
+        };
+
+        private:
+        std::pmr::vector<entry> entries;
+
+        std::pmr::vector<entry>::iterator find(std::string_view name);
+
+        public:
+        explicit response_headers(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) : entries(memory) {}
+        response_headers(std::initializer_list<std::pair<std::string_view, std::string_view>> headers,
+                         std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+
+        // The value of the header, or an empty view
+        std::string_view get(std::string_view name) const;
+        // Adds the header, or replaces its value
+        void set(std::string_view name, std::string_view value);
+        // Adds the header unless it is already there; returns whether it was added
+        bool insert(std::string_view name, std::string_view value);
+        // Adds the header even if it is already there, for headers passed along
+        // from elsewhere that can't be folded into one line (e.g. Set-Cookie)
+        void add(std::string_view name, std::string_view value);
+        bool erase(std::string_view name);
+
+        std::size_t size() const { return entries.size(); }
+        std::pmr::vector<entry>::const_iterator begin() const { return entries.begin(); }
+        std::pmr::vector<entry>::const_iterator end() const { return entries.end(); }
+    };
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef COMP4621_HTTP_DATE_HPP_INCLUDED
+#define COMP4621_HTTP_DATE_HPP_INCLUDED
+#include <ctime>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+namespace http {
+    // IMF-fixdate, as in "Sun, 06 Nov 1994 08:49:37 GMT"
+    std::pmr::string format_http_date(std::time_t time, std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+    // Accepts IMF-fixdate and the obsolete RFC 850 and asctime forms
+    std::optional<std::time_t> parse_http_date(std::string_view date);
+}
+#endif
\ No newline at end of file
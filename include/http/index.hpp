@@ -1,11 +1,15 @@
 #ifndef COMP4621_INDEX_HPP_INCLUDED
 #define COMP4621_INDEX_HPP_INCLUDED
 #include <http/response.hpp>
+#include <http/util.hpp>
 #include <boost/filesystem.hpp>
+#include <sys/stat.h>
 namespace http {
-    http::response serve_file(boost::filesystem::path p, std::fstream& stream);
-    http::response serve_index(boost::filesystem::path requested_path, boost::filesystem::path mapped_path);
-    http::response serve_404(boost::filesystem::path);
+    http::response serve_file(const boost::filesystem::path& p, http::unique_fd file, const struct stat& info);
+    http::response serve_index(const boost::filesystem::path& requested_path, const std::string& mapped_path);
+    // The listing page for a directory, rendered afresh rather than taken from the listing cache
+    std::string render_index(const boost::filesystem::path& requested_path, const boost::filesystem::path& mapped_path);
+    http::response serve_404(const boost::filesystem::path&);
 }
 
 #endif
\ No newline at end of file
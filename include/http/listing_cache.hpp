@@ -0,0 +1,46 @@
+#ifndef COMP4621_LISTING_CACHE_HPP_INCLUDED
+#define COMP4621_LISTING_CACHE_HPP_INCLUDED
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+namespace http {
+    // Rendered directory listings, each kept until inotify reports a change
+    // to its directory (an entry created, removed, renamed or modified).
+    // Without inotify every call simply renders afresh.
+    class listing_cache {
+        public:
+        using entry = std::shared_ptr<const std::string>;
+
+        private:
+        struct node {
+            int wd;
+            entry html;
+        };
+
+        int inotifyfd;
+        std::mutex mutex;
+        std::unordered_map<std::string, node> listings;
+        // Bumped by every invalidation, so a render that raced with one isn't cached
+        std::uint64_t epoch;
+
+        void drain_events();
+        void invalidate(int wd);
+
+        public:
+        listing_cache();
+        ~listing_cache();
+        listing_cache(const listing_cache&) = delete;
+        listing_cache& operator=(const listing_cache&) = delete;
+
+        // Returns the cached listing for key, or calls render and caches its
+        // result against the directory's watch.
+        entry find_or_render(const std::string& key, const std::string& directory, const std::function<std::string()>& render);
+    };
+
+    // The cache shared by every session
+    listing_cache& directory_listings();
+}
+#endif
\ No newline at end of file
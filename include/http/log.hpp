@@ -0,0 +1,78 @@
+#ifndef COMP4621_LOG_HPP_INCLUDED
+#define COMP4621_LOG_HPP_INCLUDED
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+// Records below this level are compiled out entirely; build with e.g.
+// -DHTTP_LOG_MIN_LEVEL=debug to keep the per-syscall tracing.
+#ifndef HTTP_LOG_MIN_LEVEL
+#define HTTP_LOG_MIN_LEVEL info
+#endif
+
+namespace http {
+    enum class log_level : std::uint8_t {trace, debug, info, warning, error, fatal, off};
+
+    constexpr log_level compiled_log_level = log_level::HTTP_LOG_MIN_LEVEL;
+
+    // Runtime threshold, on top of the compile-time one
+    extern std::atomic<log_level> runtime_log_level;
+
+    std::string_view log_level_name(log_level level);
+
+    // One log line, formatted on the calling thread into a small inline buffer
+    // and handed to the background writer when it goes out of scope. Nothing
+    // here blocks or takes a lock: if the thread's queue is full the record is
+    // dropped and counted.
+    class log_record {
+        fmt::basic_memory_buffer<char, 256> text;
+        log_level level;
+        bool access;
+
+        public:
+        explicit log_record(log_level level, bool access = false) : level(level), access(access) {}
+        log_record(const log_record&) = delete;
+        log_record& operator=(const log_record&) = delete;
+        ~log_record();
+
+        template<typename T>
+        log_record& operator<<(const T& value) {
+            if constexpr(std::is_convertible_v<const T&, std::string_view>) {
+                std::string_view s = value;
+                text.append(s.data(), s.data() + s.size());
+            } else if constexpr(std::is_arithmetic_v<T>) {
+                fmt::format_to(std::back_inserter(text), "{}", value);
+            } else {
+                fmt::format_to(std::back_inserter(text), "{}", fmt::streamed(value));
+            }
+            return *this;
+        }
+    };
+
+    struct log_stats {
+        std::uint64_t written;
+        std::uint64_t dropped;
+    };
+    log_stats log_counters();
+
+    // Where access log lines go: a path, "-" for stdout, or "off"
+    void open_access_log(const std::string& destination);
+    bool access_log_enabled();
+    // Writes out everything queued so far; for shutdown
+    void flush_log();
+}
+
+#define HTTP_LOG(lvl) \
+    if(!(http::log_level::lvl >= http::compiled_log_level && \
+         http::log_level::lvl >= http::runtime_log_level.load(std::memory_order_relaxed))) {} \
+    else http::log_record(http::log_level::lvl)
+
+// One line per request, in its own file, regardless of the log level
+#define HTTP_ACCESS_LOG() \
+    if(!http::access_log_enabled()) {} \
+    else http::log_record(http::log_level::info, true)
+#endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef COMP4621_METRICS_HPP_INCLUDED
+#define COMP4621_METRICS_HPP_INCLUDED
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+namespace http {
+    enum class counter {
+        connections_accepted,
+        connections_closed,
+        connections_rejected,
+        timeouts,
+        requests,
+        responses_2xx,
+        responses_3xx,
+        responses_4xx,
+        responses_5xx,
+        bytes_received,
+        bytes_sent,
+        upstream_connects,
+        upstream_reuses,
+        upstream_retries,
+        count_
+    };
+
+    // Where a request's time goes
+    enum class phase {
+        parse,    // turning buffered bytes into a request
+        resolve,  // mapping the URI onto the root and stat'ing it
+        file,     // response cache lookup, open and fstat
+        encode,   // gzipping a body that is materialised up front
+        send,     // handing the response to the socket (or the outbox)
+        request,  // all of the above, for one request
+        count_
+    };
+
+    // Both go to the calling thread's own slots, with no atomic read-modify-writes
+    void count(counter c, std::uint64_t n = 1);
+    void record(phase p, std::chrono::nanoseconds elapsed);
+
+    // Adds the time until it goes out of scope to a phase
+    class phase_timer {
+        phase p;
+        std::chrono::steady_clock::time_point started;
+
+        public:
+        explicit phase_timer(phase p) : p(p), started(std::chrono::steady_clock::now()) {}
+        phase_timer(const phase_timer&) = delete;
+        phase_timer& operator=(const phase_timer&) = delete;
+        ~phase_timer() { record(p, std::chrono::steady_clock::now() - started); }
+    };
+
+    // Values read only when metrics are exported, e.g. a queue's depth
+    void register_gauge(const std::string& name, const std::string& help, std::function<double()> read);
+    void unregister_gauge(const std::string& name);
+
+    // Everything, in the Prometheus text exposition format
+    std::string metrics_text();
+
+    // Blocks SIGUSR1 and starts a thread that dumps metrics_text() to stderr
+    // whenever it arrives. Call before any other thread is started, so they
+    // all inherit the mask.
+    void dump_metrics_on_sigusr1();
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef COMP4621_MIME_HPP_INCLUDED
+#define COMP4621_MIME_HPP_INCLUDED
+#include <string_view>
+namespace http {
+    // The MIME type for a file name or path, going by its extension
+    // (case-insensitively); application/octet-stream if it isn't known.
+    std::string_view get_content_type(std::string_view path);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef COMP4621_OUTBOX_HPP_INCLUDED
+#define COMP4621_OUTBOX_HPP_INCLUDED
+#include <array>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <http/response.hpp>
+namespace http {
+    // Responses queued on a non-blocking connection, in order: each one's
+    // serialized head, then its body. Bodies in memory are gathered straight
+    // from the source, file bodies are left for the caller to send (with
+    // sendfile, or by reading them in), and anything else is pulled a chunk at
+    // a time into `bytes` (with chunked framing, if asked for) as the socket drains.
+    // A body that has nothing more yet (an upstream's) holds everything behind
+    // it until the fd it waits on is readable.
+    class outbox {
+        struct segment {
+            std::string bytes;
+            std::size_t sent;
+            std::shared_ptr<http::body_source> body;
+            bool chunked;
+            bool body_done;
+
+            bool bytes_done() const { return sent == bytes.size(); }
+            bool done() const { return bytes_done() && body_done; }
+            bool file_body() const { return !body_done && !chunked && body->file(); }
+            std::string_view body_in_memory() const { return body_done || chunked ? std::string_view{} : body->peek(); }
+        };
+
+        // Room left in front of a staged chunk for its size line
+        static const std::size_t size_line_room = 24;
+
+        std::deque<segment> segments;
+        int stalled = -1;
+
+        // False if the body has nothing more yet, with stalled set
+        bool stage(segment& seg);
+
+        public:
+        static const int max_iov = 64;
+
+        void push(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked);
+        // Drops the responses that have been sent in full; true if nothing is left
+        bool empty();
+        // The file region to send next, once the front response has got as far as its file body
+        const http::file_body* front_file() const;
+        // Marks n bytes of the front file body as sent
+        void file_sent(std::size_t n);
+        // Gathers as much as possible into one iovec batch. more is set when a
+        // file body comes next, so the batch can be corked to share its segment.
+        int gather(std::array<iovec, max_iov>& iov, bool& more);
+        // Marks n bytes of a gathered batch as sent
+        void advance(std::size_t n);
+        // The fd the last gather found a body waiting on, or -1 if it didn't stop for one
+        int stalled_on() const { return stalled; }
+    };
+}
+#endif
\ No newline at end of file
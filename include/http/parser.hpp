@@ -0,0 +1,73 @@
+#ifndef COMP4621_PARSER_HPP_INCLUDED
+#define COMP4621_PARSER_HPP_INCLUDED
+#include <cstddef>
+#include <string_view>
+#include <vector>
+#include <http/request.hpp>
+namespace http {
+    // Growable connection receive buffer. Views into data() stay valid until
+    // the next prepare() or consume().
+    class recv_buffer {
+        std::vector<char> storage;
+        std::size_t data_begin = 0;
+        std::size_t data_end = 0;
+
+        public:
+        std::string_view data() const;
+        // Returns at least min_space writable bytes after the data, compacting or growing as needed
+        char* prepare(std::size_t min_space);
+        std::size_t writable() const;
+        // Marks n bytes written at prepare() as data
+        void commit(std::size_t n);
+        // Drops n bytes from the front of the data
+        void consume(std::size_t n);
+        // Drops n bytes from offset bytes into the data, moving up what follows
+        void erase(std::size_t offset, std::size_t n);
+    };
+
+    struct parse_limits {
+        std::size_t max_line = 8 * 1024;
+        std::size_t max_head = 64 * 1024;
+        std::size_t max_headers = 100;
+    };
+
+    // Incremental request head parser. Call parse() with everything buffered
+    // so far (always starting at the first byte of the request) each time more
+    // arrives; it picks up scanning where it left off. The finished request
+    // holds views into that input. Malformed or oversized input is rejected by
+    // throwing the http::response to answer with.
+    class request_parser {
+        enum class state { request_line, headers, done };
+
+        struct span {
+            std::size_t offset;
+            std::size_t length;
+        };
+
+        struct header_span {
+            span name;
+            span value;
+            // Interned as the line is parsed
+            http::field known;
+        };
+
+        parse_limits limits;
+        state current;
+        std::size_t scanned;  // end of the last complete line
+        std::size_t searched; // how far the current line has been searched for its end
+        span method, uri, version;
+        std::vector<header_span> header_spans;
+
+        void parse_request_line(std::string_view input, std::size_t begin, std::size_t end);
+        void parse_header_line(std::string_view input, std::size_t begin, std::size_t end);
+
+        public:
+        explicit request_parser(parse_limits limits = {});
+        // Returns true once the head is complete and req has been filled in
+        bool parse(std::string_view input, request& req);
+        // The size of the completed head, including its terminating blank line
+        std::size_t head_size() const { return scanned; }
+        void reset();
+    };
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+#ifndef COMP4621_PATH_CACHE_HPP_INCLUDED
+#define COMP4621_PATH_CACHE_HPP_INCLUDED
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+namespace http {
+    // What a request path turned out to be under the document root
+    struct resolved_path {
+        enum kind { file, directory, missing, forbidden };
+        kind type;
+        // The path to open: the canonical root followed by the request path
+        std::string mapped;
+        // Only for files
+        struct stat info;
+        std::string_view content_type;
+    };
+
+    // Request paths (already lexically normal) mapped to what they resolve to,
+    // so the common case costs a hash lookup rather than a canonicalization
+    // and a stat. Each entry is dropped as soon as inotify reports a change in
+    // any directory between the root and it, so a file being edited, or a
+    // symlink swapped on the way to it, is seen on the next request. Only
+    // directories inside the root are ever watched, so missing and forbidden
+    // paths are never cached. Without inotify every call resolves afresh.
+    class path_cache {
+        public:
+        using entry = std::shared_ptr<const resolved_path>;
+
+        private:
+        struct node {
+            std::vector<int> wds;
+            entry target;
+        };
+
+        std::string root; // canonical, without a trailing slash
+        int inotifyfd;
+        std::shared_mutex mutex;
+        std::unordered_map<std::string, node> entries;
+        // Bumped by every invalidation, so a resolution that raced with one isn't cached
+        std::uint64_t epoch;
+
+        resolved_path lookup(const std::string& request_path) const;
+        std::vector<int> watch(const std::string& request_path);
+        void watch_events();
+
+        public:
+        // Canonicalizes root, throwing std::system_error if it doesn't exist
+        explicit path_cache(const std::string& root);
+        path_cache(const path_cache&) = delete;
+        path_cache& operator=(const path_cache&) = delete;
+
+        entry resolve(const std::string& request_path);
+    };
+
+    // The cache for settings().root, shared by every session. The first call
+    // canonicalizes the root, so main makes it before serving.
+    path_cache& resolved_paths();
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,97 @@
+#ifndef COMP4621_PROXY_HPP_INCLUDED
+#define COMP4621_PROXY_HPP_INCLUDED
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include <sys/socket.h>
+#include <http/config.hpp>
+#include <http/request.hpp>
+#include <http/response.hpp>
+#include <http/util.hpp>
+namespace http {
+    // Persistent connections to one upstream server, kept open between the
+    // requests forwarded to it so that each doesn't pay for a TCP handshake.
+    // Shared by every thread.
+    class upstream_pool {
+        struct idle_connection {
+            http::unique_fd fd;
+            std::chrono::steady_clock::time_point since;
+        };
+
+        sockaddr_storage address;
+        socklen_t address_length;
+        std::mutex lock;
+        std::vector<idle_connection> idle;
+
+        public:
+        // The upstream's own name for itself, "host:port", sent as Host when a client gave none
+        const std::string name;
+
+        // Resolves the host straight away, throwing if it can't be
+        upstream_pool(const std::string& host, unsigned short port);
+
+        // An idle connection that still looks open, or else a new one; reused says which.
+        // Throws std::system_error if the upstream can't be reached within the upstream timeout.
+        http::unique_fd acquire(bool& reused);
+        // Takes back a connection whose last response was read in full, for the next request
+        void release(http::unique_fd fd);
+    };
+
+    // The pool for the upstream a request path is forwarded to, if it falls
+    // under one of the configured prefixes. Every upstream is resolved on the first call.
+    upstream_pool* find_upstream(std::string_view path);
+
+    // Work that waits on an upstream. Every wait blocks (for up to the upstream
+    // timeout), so event loops don't do it on their own threads, where it would
+    // hold up every other connection, but hand it to a few threads set aside
+    // for it (--upstream-threads) with post_upstream. That covers a request
+    // as far as its response head; the loop reads the response body itself.
+    class upstream_task {
+        public:
+        virtual void run_upstream() = 0;
+
+        protected:
+        ~upstream_task() = default;
+    };
+    void post_upstream(upstream_task& task);
+
+    // One request forwarded upstream and its response coming back. The request
+    // head goes out as soon as the exchange is made, and the body (if any) as it
+    // arrives, framed as the client framed it; the response body is read from the
+    // upstream only as the client takes it. Failures are thrown as the 502 or
+    // 504 response to answer with.
+    class upstream_exchange {
+        upstream_pool& pool;
+        http::unique_fd fd;
+        bool reused;
+        // Kept to send again on a fresh connection, if a pooled one turns out to have closed
+        std::string head;
+        bool idempotent;
+        bool head_request;
+        bool chunked = false;
+        bool body_sent = false;
+        int retries_left;
+        std::optional<std::uint64_t> declared_length;
+
+        bool retry_after(const std::system_error& err);
+        // Gets a connection and sends the head on it, trying again as configured
+        void start();
+        void send(std::string_view bytes, int flags = 0);
+
+        public:
+        upstream_exchange(upstream_pool& pool, const http::request& req, std::string_view client_address);
+        void send_body(std::string_view data);
+        // Finishes the request and reads the response head; its body follows as the response's source
+        http::response response();
+        // What the response's Content-Length said, for a HEAD request's answer
+        std::optional<std::uint64_t> content_length() const { return declared_length; }
+    };
+}
+#endif
\ No newline at end of file
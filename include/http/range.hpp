@@ -0,0 +1,29 @@
+#ifndef COMP4621_RANGE_HPP_INCLUDED
+#define COMP4621_RANGE_HPP_INCLUDED
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <http/response.hpp>
+#include <http/util.hpp>
+namespace http {
+    // An inclusive span of byte offsets, as written in Range and Content-Range
+    struct byte_range {
+        std::size_t first;
+        std::size_t last;
+        std::size_t length() const { return last - first + 1; }
+    };
+
+    // Resolves a Range header against a representation of `size` bytes, merging
+    // overlapping ranges. Returns nullopt if the header isn't a byte range set
+    // (so it should be ignored), or no ranges if none of them can be satisfied.
+    std::optional<std::vector<byte_range>> parse_range(std::string_view header, std::size_t size);
+
+    // 206 Partial Content for some ranges of a file region (a whole file, or a
+    // blob in an archive): the bare range when there is one, multipart/byteranges
+    // otherwise. Ranges count from the start of the region. File contents are never buffered.
+    http::response serve_ranges(const std::string& content_type, const http::file_body& whole, const std::vector<byte_range>& ranges);
+    http::response serve_416(std::size_t size);
+}
+#endif
\ No newline at end of file
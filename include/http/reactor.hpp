@@ -0,0 +1,64 @@
+#ifndef COMP4621_REACTOR_HPP_INCLUDED
+#define COMP4621_REACTOR_HPP_INCLUDED
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <http/timer_wheel.hpp>
+namespace http {
+    class connection;
+
+    // One epoll loop on its own thread, driving many non-blocking connections.
+    class reactor {
+        int epollfd;
+        int wakefd;
+        // Not owned; -1 unless this loop accepts its own connections
+        int listenfd;
+        std::atomic<bool> stopping;
+
+        // Accepted fds handed over by the acceptor thread, and connections back from upstream workers
+        std::vector<int> incoming;
+        std::vector<connection*> returned;
+        std::mutex incoming_mutex;
+        std::condition_variable all_returned;
+
+        // Owned and touched only by the reactor thread
+        http::timer_wheel timers;
+        std::unordered_map<int, std::unique_ptr<connection>> connections;
+        // Connections out on an upstream worker, which the loop leaves alone until they come back
+        std::size_t out_on_workers = 0;
+        // Upstream fds watched for the connections whose responses wait on them
+        std::unordered_map<int, connection*> upstreams;
+
+        std::thread thread;
+
+        void run();
+        void adopt_incoming();
+        void accept_incoming();
+        void watch(int clientfd);
+        void on_event(connection& conn, unsigned events);
+        // Watches the upstream fd the connection's response now waits on, if any, in place of the
+        // one it waited on before. Returns false if it had to close the connection.
+        bool watch_upstream(connection& conn, int fd);
+        // Sends a connection whose next request goes upstream to an upstream worker
+        void hand_off(connection& conn);
+        // Closes a connection whose deadline passed, after a 408 if it was sending a request head
+        void expire(connection& conn);
+        void close(connection& conn);
+
+        public:
+        // With a listening socket (non-blocking), the loop accepts from it itself,
+        // so its connections never leave this thread.
+        explicit reactor(int listenfd = -1);
+        ~reactor();
+        // Thread-safe: hands a connected socket over to this reactor.
+        void adopt(int clientfd);
+        // Thread-safe: takes back a connection from an upstream worker
+        void take_back(connection& conn);
+        void pin_to_cpu(unsigned cpu);
+    };
+}
+#endif
\ No newline at end of file
@@ -1,14 +1,26 @@
 #ifndef COMP4621_REQUEST_HPP_INCLUDED
 #define COMP4621_REQUEST_HPP_INCLUDED
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <http/headers.hpp>
 namespace http {
+    // The views point into the session's receive buffer, so a request is only
+    // valid until the session moves on to the next one.
     struct request {
-        std::string method;
-        std::string uri;
-        std::string version;
-        std::unordered_map<std::string, std::string> headers;
+        std::string_view method;
+        std::string_view uri;
+        std::string_view version;
+        http::request_headers headers;
         std::string body;
+
+        // The value of the first header of this field, or an empty view
+        std::string_view header(http::field f) const {
+            return headers.get(f);
+        }
+        // Likewise for any header, matching the name case-insensitively
+        std::string_view header(std::string_view name) const {
+            return headers.get(name);
+        }
     };
 }
 #endif
\ No newline at end of file
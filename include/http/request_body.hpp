@@ -0,0 +1,80 @@
+#ifndef COMP4621_REQUEST_BODY_HPP_INCLUDED
+#define COMP4621_REQUEST_BODY_HPP_INCLUDED
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <http/util.hpp>
+#include <http/headers.hpp>
+namespace http {
+    // Incremental decoder for the framing of a request body, Content-Length
+    // or chunked. Feed it whatever has arrived; it hands back the body data
+    // as views into that input, so nothing is copied. Malformed framing is
+    // rejected by throwing the http::response to answer with.
+    class body_decoder {
+        enum class state { data, size, size_line, data_end, trailers, done };
+
+        state current;
+        bool chunked;
+        std::uint64_t remaining; // in the body, or the current chunk
+        std::uint64_t total = 0;
+        std::size_t size_digits = 0;
+        std::size_t line_length = 0; // of the chunk size line or trailer being skipped
+        std::size_t trailer_bytes = 0;
+
+        void data_consumed(std::uint64_t n);
+
+        public:
+        static body_decoder with_length(std::uint64_t length);
+        static body_decoder chunks();
+
+        // Consumes framing from the front of input and at most one piece of
+        // data, which is left in data (empty if there was none). Returns the
+        // number of bytes consumed; call again with the rest until it returns 0.
+        std::size_t decode(std::string_view input, std::string_view& data);
+        // How many of the next bytes are certainly body data, for a caller that
+        // would rather read them itself (e.g. splice them), then skip() them
+        std::uint64_t raw_remaining() const { return current == state::data ? remaining : 0; }
+        void skip(std::uint64_t n);
+        // Body bytes decoded so far
+        std::uint64_t received() const { return total; }
+        bool done() const { return current == state::done; }
+
+        private:
+        body_decoder(state initial, bool chunked, std::uint64_t remaining);
+    };
+
+    // How a request's body is framed, going by every Content-Length and
+    // Transfer-Encoding header it has (RFC 9112 section 6.3). Framing that
+    // can't be trusted (Content-Length values that differ, both kinds at once,
+    // or codings that don't end in a single chunked) throws a 400 response.
+    struct request_framing {
+        enum kind { none, sized, chunked, unsupported };
+        kind type = none;
+        std::uint64_t length = 0;
+    };
+    request_framing body_framing(const http::request_headers& headers);
+
+    // An upload, written to a temporary file alongside its target and only
+    // renamed over it once complete, so readers never see part of one. The
+    // temporary file is removed if the upload is abandoned.
+    class upload_file {
+        std::string target;
+        std::string temporary;
+        http::unique_fd fd;
+        bool committed = false;
+
+        public:
+        // Throws std::system_error if the temporary file can't be created
+        explicit upload_file(std::string target);
+        ~upload_file();
+        upload_file(const upload_file&) = delete;
+        upload_file& operator=(const upload_file&) = delete;
+
+        int get() const { return fd.get(); }
+        void write(std::string_view bytes);
+        // Moves the finished file into place; true if it replaced one already there
+        bool commit();
+    };
+}
+#endif
\ No newline at end of file
@@ -1,13 +1,93 @@
 #ifndef COMP4621_RESPONSE_HPP_INCLUDED
 #define COMP4621_RESPONSE_HPP_INCLUDED
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include <http/headers.hpp>
+#include <http/util.hpp>
 namespace http {
+    // A region of an open file, which can be sent with sendfile(2) instead of being read
+    struct file_body {
+        std::shared_ptr<const unique_fd> fd;
+        off_t offset;
+        std::size_t length;
+    };
+
+    // Pull-based producer of response body bytes, so bodies never have to sit fully in memory
+    class body_source {
+        public:
+        virtual ~body_source() = default;
+        // Copies up to max bytes into out; returns 0 once the body is exhausted
+        virtual std::size_t read(char* out, std::size_t max) = 0;
+        // As read(), for an event loop, which mustn't wait: a body still arriving
+        // from elsewhere returns 0 with wait_fd set to the fd to wait on for more.
+        // Otherwise wait_fd is -1, and 0 means the body is exhausted.
+        virtual std::size_t read_ready(char* out, std::size_t max, int& wait_fd) {
+            wait_fd = -1;
+            return read(out, max);
+        }
+        // The number of bytes left, when known up front
+        virtual std::optional<std::size_t> size() const { return std::nullopt; }
+        // The unread remainder as a file region, for sources that can be sent with sendfile
+        virtual const file_body* file() const { return nullptr; }
+        // The unread remainder, for sources that already hold it all in memory
+        virtual std::string_view peek() const { return {}; }
+        // Marks n bytes as sent straight from peek() or file() rather than read()
+        virtual void skip(std::size_t) {}
+    };
+
+    std::shared_ptr<body_source> memory_source(std::string bytes);
+    // Shares bytes that are already held elsewhere (e.g. in a cache) instead of copying them,
+    // from the given offset on
+    std::shared_ptr<body_source> memory_source(std::shared_ptr<const std::string> bytes, std::size_t from = 0);
+    // Bytes that outlive any response (e.g. in a mapped archive), sent without being copied
+    std::shared_ptr<body_source> view_source(std::string_view bytes);
+    std::shared_ptr<body_source> file_source(file_body file);
+    // Calls next() for successive pieces of the body until it returns an empty string
+    std::shared_ptr<body_source> generator_source(std::function<std::string()> next);
+    // Each of parts in turn, as one body
+    std::shared_ptr<body_source> concat_source(std::vector<std::shared_ptr<body_source>> parts);
+
+    // Where responses built on this thread keep their headers: the arena of the
+    // request being handled, while an arena_scope is open, otherwise the heap
+    std::pmr::memory_resource* response_memory();
+
+    // Points response_memory() at a connection's arena for the length of one
+    // request, and empties the arena again once the request is done with it.
+    // Bodies don't go in the arena, as they can outlive the request in a send queue.
+    class arena_scope {
+        std::pmr::monotonic_buffer_resource& arena;
+        std::pmr::memory_resource* previous;
+
+        public:
+        explicit arena_scope(std::pmr::monotonic_buffer_resource& arena);
+        ~arena_scope();
+        arena_scope(const arena_scope&) = delete;
+        arena_scope& operator=(const arena_scope&) = delete;
+    };
+
     struct response {
         int code;
-        std::string reason;
-        std::unordered_map<std::string, std::string> headers;
+        // Always a string literal
+        std::string_view reason;
+        http::response_headers headers;
         std::string body;
+        // When set, the body is streamed from here and `body` is ignored
+        std::shared_ptr<body_source> source;
+
+        response(int code, std::string_view reason,
+                 std::initializer_list<std::pair<std::string_view, std::string_view>> headers = {},
+                 std::string body = {}, std::shared_ptr<body_source> source = nullptr);
     };
+
+    // The response body as a source, wrapping (and emptying) `body` if no source is set
+    std::shared_ptr<body_source> take_body(response& r);
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef COMP4621_RESPONSE_CACHE_HPP_INCLUDED
+#define COMP4621_RESPONSE_CACHE_HPP_INCLUDED
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+namespace http {
+    // Size-bounded, sharded LRU of fully serialized responses (status line,
+    // headers and body) for small static files. Entries are keyed by mapped
+    // path and content encoding, and only returned while the file's inode,
+    // size and mtime still match, so edits under the root are picked up on
+    // the next request.
+    class response_cache {
+        public:
+        using entry = std::shared_ptr<const std::string>;
+
+        struct stats {
+            std::uint64_t hits;
+            std::uint64_t misses;
+            std::uint64_t evictions;
+            std::size_t entries;
+            std::size_t bytes;
+        };
+
+        private:
+        struct validator {
+            ino_t inode;
+            off_t size;
+            timespec mtime;
+            bool operator==(const validator& other) const;
+        };
+
+        struct node {
+            std::string key;
+            validator valid;
+            entry bytes;
+        };
+
+        struct shard {
+            std::mutex mutex;
+            std::list<node> lru; // most recently used first
+            std::unordered_map<std::string_view, std::list<node>::iterator> index;
+            std::size_t bytes = 0;
+        };
+
+        std::vector<shard> shards;
+        std::size_t shard_capacity;
+        std::size_t max_entry;
+        std::atomic<std::uint64_t> hits;
+        std::atomic<std::uint64_t> misses;
+        std::atomic<std::uint64_t> evictions;
+
+        static std::string make_key(std::string_view path, std::string_view encoding);
+        static validator make_validator(const struct stat& info);
+        shard& shard_for(const std::string& key);
+        void erase(shard& s, std::list<node>::iterator it);
+
+        public:
+        response_cache(std::size_t capacity, std::size_t max_entry_size, std::size_t n_shards = 16);
+        entry find(std::string_view path, std::string_view encoding, const struct stat& info);
+        void insert(std::string_view path, std::string_view encoding, const struct stat& info, entry serialized);
+        std::size_t max_entry_size() const { return max_entry; }
+        stats counters();
+    };
+
+    // The cache shared by every session
+    response_cache& file_cache();
+}
+#endif
\ No newline at end of file
@@ -1,15 +1,34 @@
 #ifndef COMP4621_SERVER_HPP_INCLUDED
 #define COMP4621_SERVER_HPP_INCLUDED
+#include <memory>
+#include <optional>
+#include <vector>
 #include <http/worker_pool.hpp>
 #include <http/session.hpp>
+#include <http/reactor.hpp>
+#include <http/uring.hpp>
+#include <http/coroutine_loop.hpp>
+#include <http/config.hpp>
 namespace http {
     struct socket;
+
     class server {
         int sockfd;
-        worker_pool<session> workers;
+        // One SO_REUSEPORT listener per event loop in sharded, uring and coroutine modes; sockfd is the first
+        std::vector<int> shard_listeners;
+        server_mode mode;
+        std::optional<worker_pool<session>> workers;
+        std::vector<std::unique_ptr<reactor>> reactors;
+        std::vector<std::unique_ptr<uring_loop>> rings;
+        std::vector<std::unique_ptr<coroutine_loop>> coroutine_loops;
+        std::size_t next_reactor;
+
+        void serve_blocking();
+        void serve_reactor();
+        void serve_sharded();
 
         public:
-        server(short port, int n_threads = 4);
+        server(short port, int n_threads = 4, server_mode mode = server_mode::blocking);
         ~server();
         void serve_forever();
     };
@@ -1,35 +1,146 @@
 #ifndef COMP4621_SESSION_HPP_INCLUDED
 #define COMP4621_SESSION_HPP_INCLUDED
 #include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fmt/format.h>
+#include <boost/filesystem/path.hpp>
 #include <http/request.hpp>
+#include <http/parser.hpp>
 #include <http/response.hpp>
+#include <http/path_cache.hpp>
+#include <http/archive.hpp>
+#include <http/request_body.hpp>
+#include <http/proxy.hpp>
 namespace http {
     class session {
-        static const int buffer_size = 2048;
-        using byte_buf = std::array<char, buffer_size>;
-
-        int sockfd;
-        byte_buf buffer;
-        byte_buf::iterator data_begin;
-        byte_buf::iterator data_end;
-
+        // Response headers and other per-request scratch, emptied after every request
+        std::array<std::byte, 2048> arena_space;
+        std::pmr::monotonic_buffer_resource arena{arena_space.data(), arena_space.size()};
+        http::request_parser parser;
+        std::optional<http::response> parse_error;
         http::request current_request;
+        std::chrono::steady_clock::time_point request_started;
+        // The body of the request being served, while it is still coming in
+        struct incoming_body {
+            http::body_decoder decoder;
+            std::uint64_t limit;
+            // Where a PUT goes; other bodies are kept in current_request.body
+            std::unique_ptr<http::upload_file> upload;
+            // Uploads are spliced from the socket to their file through here
+            http::unique_fd pipe_read;
+            http::unique_fd pipe_write;
+            // Where a proxied request's body goes, straight on to the upstream
+            std::unique_ptr<http::upstream_exchange> proxied;
+        };
+        std::optional<incoming_body> body;
+        // Where the current request is forwarded to, if it is
+        http::upstream_pool* upstream = nullptr;
+        std::vector<char> stream_buffer;
+        fmt::memory_buffer head_buffer;
+        // What the last head said, for the access log
+        int response_status = 0;
+        std::optional<std::size_t> response_length;
+        // How the current request wants its connection handled
+        bool legacy_client = false;
+        bool persistent = true;
+        // A HEAD request is answered with the head it would have had, and no body
+        bool answering_head = false;
+        // Small responses held back while more pipelined requests are waiting,
+        // so that a whole batch leaves in one gather write. The heads are packed
+        // into one reused string, and each entry remembers where its head ends.
+        struct corked_response {
+            std::size_t head_end;
+            std::shared_ptr<http::body_source> body;
+        };
+        std::vector<corked_response> corked;
+        std::string corked_heads;
+        std::vector<iovec> corked_iov;
+        std::size_t corked_bytes = 0;
 
-        std::string recv_line();
-        request recv_request();
-        void send_all(const unsigned char* start, ssize_t size);
+        void recv_request();
+        void start_body(const http::request&);
+        bool receive_body();
+        void keep_body(std::string_view data);
+        ssize_t splice_body(std::uint64_t max);
+        static http::response request_timeout();
+        void write_all(iovec* iov, int count, int flags = 0);
+        void send_interim(std::string_view head);
+        void write_file(const http::file_body& file);
+        std::string_view connection_header() const;
+        std::string_view cached_head(std::string_view stored);
+        std::string_view build_head(const http::response&, std::optional<std::size_t> content_length);
+        // Sends a final response's head, and its body unless the request was HEAD
+        void respond(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked);
         void transfer_id(http::response);
-        void transfer_chunked(http::response, std::size_t chunk_size = 12);
+        void transfer_chunked(http::response);
+        void transfer(http::response);
         http::response encode_id(http::response);
         http::response encode_gzip(http::response);
+        http::response encode(http::response);
+        bool accepts_gzip();
+        bool if_range_holds(std::string_view tag, std::time_t modified);
+        bool not_modified(std::string_view tag, std::time_t modified);
+        void account_for(std::string_view method, std::string_view uri, std::chrono::steady_clock::time_point started);
+        void serve_static(const boost::filesystem::path& requested_path, const http::resolved_path& target);
+        void serve_archived(const boost::filesystem::path& requested_path, const http::archive& site);
+        void serve_proxied(const http::request&, http::upstream_pool& pool);
 
         protected:
+        int sockfd;
+        http::recv_buffer buffer;
+        // Set whenever more of a request body comes in, for the event loops' deadlines
+        bool body_progress = false;
+        // Set while an event loop's connection is out on an upstream worker, where it reads
+        // the request body blocking like a plain session; its response is still left to the loop
+        bool blocking_io = false;
+
+        // I/O hooks: blocking socket calls by default, overridden by the reactor
+        virtual std::size_t recv_some(char* into, std::size_t max);
+        // Sends a serialized head followed by the body (if any), optionally with chunked framing
+        virtual void send_message(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked);
+        // Reads more of a request body from the socket. Returns false if there is nothing more
+        // to read yet, which a blocking session never does: it waits, bounded by the body timeout.
+        virtual bool recv_body() { return pull_body(true); }
+
+        void attach(int fd);
+        // Parses what has been buffered so far; true once a request (or a parse error) is ready to serve
+        bool request_buffered();
+        // Whether a request is waiting for the rest of its body before it can be answered
+        bool body_pending() const { return body.has_value(); }
+        // Reads more of the body, spliced straight into the file for uploads where the framing
+        // allows, otherwise into the buffer. Without wait, returns false rather than block.
+        bool pull_body(bool wait);
+        // Reads, handles and answers exactly one request. Returns false once the connection should be
+        // closed. In an event loop it also returns (true) when the request's body is still arriving;
+        // calling it again picks up from there.
+        bool serve_one();
+        // Whether the request just buffered, not yet started on, is forwarded upstream. Event loops
+        // hand such requests to http::post_upstream rather than wait on the upstream themselves.
+        bool bound_upstream();
+        // On an upstream worker: serves the buffered request that is forwarded upstream, waiting on
+        // the upstream and the request body, as far as queueing the response with the upstream's
+        // body still to be read. Returns false once the connection should be closed.
+        bool serve_upstream_bound();
+        // Writes out the responses held back while pipelined requests were waiting
+        void flush_corked(int flags = 0);
         void send_response(http::response);
-        void handle_request(http::request);
+        void handle_request(const http::request&);
+        // Answers a request head that took too long to arrive with 408, closing the connection after it
+        void time_out();
 
         public:
+        virtual ~session() = default;
         void operator()(int sockfd);
     };
 }
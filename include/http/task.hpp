@@ -0,0 +1,142 @@
+#ifndef COMP4621_TASK_HPP_INCLUDED
+#define COMP4621_TASK_HPP_INCLUDED
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+namespace http {
+    // Where coroutine frames come from, instead of the global heap: a free
+    // list per size class, per thread, so a frame is a pop and freeing it a
+    // push. A frame freed on another thread just joins that thread's lists.
+    // Frames too big for any class go to the heap as usual.
+    class frame_pool {
+        static const std::size_t granularity = 64;
+        static const std::size_t classes = 64; // so frames of up to 4 KiB are pooled
+        // Past this many free frames of a size, more are given back to the heap
+        static const std::size_t max_free = 1024;
+
+        struct free_frame {
+            free_frame* next;
+        };
+        std::array<free_frame*, classes> free_lists{};
+        std::array<std::size_t, classes> free_counts{};
+
+        public:
+        frame_pool() = default;
+        frame_pool(const frame_pool&) = delete;
+        frame_pool& operator=(const frame_pool&) = delete;
+        ~frame_pool();
+
+        // The calling thread's pool
+        static frame_pool& local();
+        void* allocate(std::size_t size);
+        void deallocate(void* frame, std::size_t size);
+    };
+
+    template<typename T = void>
+    class task;
+
+    namespace detail {
+        struct promise_base {
+            // Whoever awaits the task, resumed once it finishes
+            std::coroutine_handle<> continuation;
+            std::exception_ptr error;
+
+            static void* operator new(std::size_t size) { return frame_pool::local().allocate(size); }
+            static void operator delete(void* frame, std::size_t size) { frame_pool::local().deallocate(frame, size); }
+
+            // Tasks are lazy: nothing runs until the task is awaited (or started)
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            // Hands straight over to the awaiting coroutine, so a chain of
+            // tasks finishing doesn't pile up frames on the thread's stack
+            struct final_awaiter {
+                bool await_ready() noexcept { return false; }
+                template<typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept {
+                    std::coroutine_handle<> next = finished.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            final_awaiter final_suspend() noexcept { return {}; }
+
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        template<typename T>
+        struct promise : promise_base {
+            std::optional<T> value;
+
+            task<T> get_return_object();
+            void return_value(T v) { value.emplace(std::move(v)); }
+            T result() {
+                if(error) std::rethrow_exception(error);
+                return std::move(*value);
+            }
+        };
+
+        template<>
+        struct promise<void> : promise_base {
+            task<void> get_return_object();
+            void return_void() {}
+            void result() {
+                if(error) std::rethrow_exception(error);
+            }
+        };
+    }
+
+    // A coroutine that produces a T (or throws), run when it is awaited, with
+    // the awaiting coroutine resumed once it is done. Owns its frame.
+    template<typename T>
+    class [[nodiscard]] task {
+        public:
+        using promise_type = detail::promise<T>;
+
+        private:
+        std::coroutine_handle<promise_type> handle;
+
+        public:
+        task() = default;
+        explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+        task(task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+        task& operator=(task&& other) noexcept {
+            std::swap(handle, other.handle);
+            return *this;
+        }
+        ~task() {
+            if(handle) handle.destroy();
+        }
+
+        bool done() const { return !handle || handle.done(); }
+
+        // Runs a task that nothing awaits (e.g. a connection's own coroutine) up to where it first suspends
+        void start() { handle.resume(); }
+
+        auto operator co_await() && noexcept {
+            struct awaiter {
+                std::coroutine_handle<promise_type> handle;
+
+                bool await_ready() noexcept { return handle.done(); }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                    handle.promise().continuation = awaiting;
+                    return handle;
+                }
+                T await_resume() { return handle.promise().result(); }
+            };
+            return awaiter{handle};
+        }
+    };
+
+    template<typename T>
+    task<T> detail::promise<T>::get_return_object() {
+        return task<T>{std::coroutine_handle<promise<T>>::from_promise(*this)};
+    }
+
+    inline task<void> detail::promise<void>::get_return_object() {
+        return task<void>{std::coroutine_handle<promise<void>>::from_promise(*this)};
+    }
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,109 @@
+#ifndef COMP4621_TIMER_WHEEL_HPP_INCLUDED
+#define COMP4621_TIMER_WHEEL_HPP_INCLUDED
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+namespace http {
+    // Hierarchical timing wheel, as in Varghese and Lauck: four levels of 64
+    // slots, each level's slot spanning a whole turn of the level below.
+    // Arming, re-arming and cancelling are O(1) list splices, and a timer
+    // cascades down at most three times before it fires, so an event loop can
+    // keep a deadline per connection and move it on every event. Not thread-safe.
+    class timer_wheel {
+        public:
+        using clock = std::chrono::steady_clock;
+
+        // Embedded in whatever it times; unarms itself when destroyed
+        class timer {
+            friend class timer_wheel;
+            timer* prev = this;
+            timer* next = this;
+            timer_wheel* wheel = nullptr;
+            std::uint64_t expiry = 0; // in ticks
+
+            void unlink();
+
+            public:
+            timer() = default;
+            timer(const timer&) = delete;
+            timer& operator=(const timer&) = delete;
+            ~timer();
+            bool armed() const { return wheel != nullptr; }
+        };
+
+        private:
+        static const int slot_bits = 6;
+        static const std::size_t slots = std::size_t{1} << slot_bits;
+        static const int levels = 4;
+
+        // Each slot is a circular list headed by a sentinel
+        std::array<std::array<timer, slots>, levels> wheel;
+        clock::time_point origin;
+        clock::duration tick;
+        std::uint64_t current = 0; // ticks expired so far
+        std::size_t n_armed = 0;
+
+        std::uint64_t ticks_at(clock::time_point t) const;
+        void insert(timer& t);
+        void cascade(int level);
+        // Moves on one tick and detaches the timers now due onto expired
+        void step(timer& expired);
+
+        public:
+        explicit timer_wheel(clock::duration tick = std::chrono::milliseconds(100), clock::time_point now = clock::now());
+        timer_wheel(const timer_wheel&) = delete;
+        timer_wheel& operator=(const timer_wheel&) = delete;
+        // Leaves any timers still armed unarmed
+        ~timer_wheel();
+
+        // (Re)arms t to fire at the first tick at or after when
+        void schedule(timer& t, clock::time_point when);
+        void cancel(timer& t);
+        std::size_t armed() const { return n_armed; }
+
+        // How long the loop may sleep before the next timer could be due, or
+        // nothing if none is armed. Never more than one turn of the first level.
+        std::optional<clock::duration> until_next(clock::time_point now) const;
+
+        // Fires every timer due by now, in order, calling on_expiry(timer&)
+        // with it already unarmed; that may re-arm it or destroy its owner.
+        template<typename F>
+        void advance(clock::time_point now, F&& on_expiry) {
+            const std::uint64_t target = ticks_at(now);
+            if(n_armed == 0 && current < target) current = target;
+            while(current < target) {
+                timer expired;
+                step(expired);
+                while(expired.next != &expired) {
+                    timer& t = *expired.next;
+                    t.unlink();
+                    on_expiry(t);
+                }
+            }
+        }
+    };
+
+    // The deadline of a non-blocking connection, moved on after every event.
+    // Which timeout applies depends on what the connection is waiting for:
+    // the next request (idle), the rest of a request head it has started on
+    // (header, counted from the first byte so a trickle can't extend it), more
+    // of a request body (body, counted from the last progress, as bodies can be
+    // long), or the client reading responses it has queued up (write, likewise).
+    class connection_timer : public timer_wheel::timer {
+        public:
+        enum kind { idle, header, body, write };
+
+        private:
+        kind waiting = idle;
+
+        public:
+        void update(timer_wheel& wheel, timer_wheel::clock::time_point now, bool partial_head, bool partial_body, bool backed_up, bool progressed);
+        // A request has been served, so the next one gets a header timeout of its own
+        void head_finished() { if(waiting == header || waiting == body) waiting = idle; }
+        // What the connection was waiting for when the timer fired
+        kind waiting_for() const { return waiting; }
+    };
+}
+#endif
\ No newline at end of file
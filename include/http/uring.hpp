@@ -0,0 +1,84 @@
+#ifndef COMP4621_URING_HPP_INCLUDED
+#define COMP4621_URING_HPP_INCLUDED
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <http/timer_wheel.hpp>
+namespace http {
+    class uring_connection;
+    struct uring;
+
+    // Whether this build has the io_uring engine (HTTP_WITH_IO_URING) and the
+    // running kernel supports every operation it needs.
+    bool uring_available();
+
+    // An event loop that accepts on its own SO_REUSEPORT listener and drives
+    // every connection through one io_uring on its own thread. Accept and recv
+    // are multishot where the kernel allows, sockets sit in the ring's
+    // registered file table, received bytes land in a provided buffer ring and
+    // file bodies are read into registered buffers and sent from there. All
+    // that one pass over the completions queues up goes to the kernel in a
+    // single io_uring_enter, which also waits for the next completions. A
+    // connection whose request goes upstream has its recv cancelled and is
+    // served on an upstream worker as far as the response head, then carries
+    // on here, polling the upstream whenever the response body runs dry.
+    class uring_loop {
+        std::unique_ptr<uring> ring;
+        // Not owned
+        int listenfd;
+        int wakefd;
+        std::atomic<bool> stopping;
+
+        // Connections back from upstream workers
+        std::vector<uring_connection*> returned;
+        std::mutex returned_mutex;
+        std::condition_variable all_returned;
+
+        // Owned and touched only by the loop thread
+        http::timer_wheel timers;
+        std::unordered_map<uring_connection*, std::unique_ptr<uring_connection>> connections;
+        // Connections out on an upstream worker, which the loop leaves alone until they come back
+        std::size_t out_on_workers = 0;
+
+        std::thread thread;
+
+        void run();
+        void reap();
+        void complete(std::uint64_t user_data, int res, unsigned flags);
+        void arm_accept();
+        void arm_wake();
+        void arm_timeout();
+        void arm_recv(uring_connection& conn);
+        void cancel_recv(uring_connection& conn);
+        void poll_upstream(uring_connection& conn, int fd);
+        void on_upstream(uring_connection& conn, int res);
+        void register_socket(uring_connection& conn);
+        void kick(uring_connection& conn);
+        void read_file(uring_connection& conn);
+        void on_accept(int res, unsigned flags);
+        void on_recv(uring_connection& conn, int res, unsigned flags);
+        void on_send(uring_connection& conn, int res);
+        void on_read(uring_connection& conn, int res);
+        // Hangs up on a connection whose deadline passed, after a 408 if it was sending a request head
+        void expire(uring_connection& conn);
+        // Hangs up once a connection is finished, and frees it once nothing in flight refers to it.
+        // Sends it to an upstream worker once nothing is in flight and its next request goes upstream.
+        void settle(uring_connection& conn);
+        void hand_off(uring_connection& conn);
+        void resume_returned();
+
+        public:
+        // Throws std::system_error if the ring can't be set up
+        explicit uring_loop(int listenfd);
+        ~uring_loop();
+        void pin_to_cpu(unsigned cpu);
+        // Thread-safe: takes back a connection from an upstream worker
+        void take_back(uring_connection& conn);
+    };
+}
+#endif
\ No newline at end of file
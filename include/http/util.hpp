@@ -1,4 +1,27 @@
 #ifndef COMP4621_UTIL_HPP_INCLUDED
 #define COMP4621_UTIL_HPP_INCLUDED
+#include <utility>
+#include <unistd.h>
+namespace http {
+    // Owning wrapper for a POSIX file descriptor
+    class unique_fd {
+        int fd;
 
+        public:
+        unique_fd() : fd(-1) {}
+        explicit unique_fd(int fd) : fd(fd) {}
+        unique_fd(const unique_fd&) = delete;
+        unique_fd& operator=(const unique_fd&) = delete;
+        unique_fd(unique_fd&& other) : fd(std::exchange(other.fd, -1)) {}
+        unique_fd& operator=(unique_fd&& other) {
+            std::swap(fd, other.fd);
+            return *this;
+        }
+        ~unique_fd() {
+            if(fd >= 0) ::close(fd);
+        }
+        int get() const { return fd; }
+        explicit operator bool() const { return fd >= 0; }
+    };
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,15 @@
+#ifndef COMP4621_VALIDATORS_HPP_INCLUDED
+#define COMP4621_VALIDATORS_HPP_INCLUDED
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+namespace http {
+    // Strong entity tag for a file's unencoded contents, from its inode, size and mtime
+    std::pmr::string entity_tag(const struct stat& info, std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+    // The tag of an encoded representation of the same contents, e.g. "..-gzip"
+    std::pmr::string encoded_tag(std::string_view tag, std::string_view encoding, std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+    // Weak comparison against an If-None-Match list ("*" matches anything)
+    bool tag_list_matches(std::string_view header, std::string_view tag);
+}
+#endif
\ No newline at end of file
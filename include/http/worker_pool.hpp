@@ -3,72 +3,261 @@
 #include <vector>
 #include <thread>
 #include <condition_variable>
-#include <deque>
-#include <future>
+#include <memory>
 #include <mutex>
 #include <atomic>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <pthread.h>
+#include <sched.h>
 
 namespace http {
+    // Bounded lock-free multi-producer multi-consumer ring (Vyukov's design).
+    // Any thread may push; the owning worker pops, and idle workers steal by
+    // popping from each other's rings.
+    template<typename Slot>
+    class task_ring {
+        static_assert(std::is_trivially_copyable_v<Slot>);
+
+        struct cell {
+            std::atomic<std::size_t> sequence;
+            Slot data;
+        };
+
+        std::unique_ptr<cell[]> cells;
+        std::size_t mask;
+        alignas(64) std::atomic<std::size_t> push_position;
+        alignas(64) std::atomic<std::size_t> pop_position;
+
+        public:
+        // capacity must be a power of two
+        explicit task_ring(std::size_t capacity) : cells(new cell[capacity]), mask(capacity - 1), push_position(0), pop_position(0) {
+            for(std::size_t i = 0; i < capacity; i++) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        bool try_push(const Slot& slot) {
+            std::size_t position = push_position.load(std::memory_order_relaxed);
+            cell* c;
+            while(true) {
+                c = &cells[position & mask];
+                std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+                auto lag = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+                if(lag == 0) {
+                    if(push_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+                } else if(lag < 0) {
+                    return false; // full
+                } else {
+                    position = push_position.load(std::memory_order_relaxed);
+                }
+            }
+            c->data = slot;
+            c->sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(Slot& slot) {
+            std::size_t position = pop_position.load(std::memory_order_relaxed);
+            cell* c;
+            while(true) {
+                c = &cells[position & mask];
+                std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+                auto lag = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+                if(lag == 0) {
+                    if(pop_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+                } else if(lag < 0) {
+                    return false; // empty
+                } else {
+                    position = pop_position.load(std::memory_order_relaxed);
+                }
+            }
+            slot = c->data;
+            c->sequence.store(position + mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        // May be momentarily stale, so only good as a hint
+        bool looks_empty() const {
+            return push_position.load() == pop_position.load();
+        }
+    };
+
+    // Runs tasks on a fixed set of threads, each with its own T. Tasks are the
+    // arguments to T::operator(), copied inline into fixed-size slots, so
+    // posting never allocates. Posts are spread round-robin over per-worker
+    // rings; a worker whose ring runs dry steals from the others before
+    // parking.
     template<typename T>
     class worker_pool {
+        static constexpr std::size_t ring_capacity = 1024;
+        static constexpr std::size_t max_arg_bytes = 48;
+        static constexpr int spins_before_parking = 128;
+
+        struct task {
+            void (*invoke)(T&, const unsigned char*);
+            unsigned char args[max_arg_bytes];
+        };
+
         std::vector<T> workers;
+        std::vector<std::unique_ptr<task_ring<task>>> rings;
         std::vector<std::thread> threads;
-        
-        // Tasks
-        std::deque<std::packaged_task<void(T&)>> tasks;
-        std::condition_variable task_available;
-        std::mutex task_mutex;
-        
+        std::atomic<std::size_t> next_ring;
+        std::atomic<bool> stopping;
+
+        // Idle workers park here; posters only take the lock if someone is asleep
+        std::atomic<int> sleeping;
+        std::condition_variable work_available;
+        std::mutex park_mutex;
+
         // Finished event
         std::atomic<int> tasks_left;
         std::condition_variable finished;
         std::mutex finish_mutex;
-        
+
+        template<typename... ArgTs>
+        static constexpr std::array<std::size_t, sizeof...(ArgTs) + 1> arg_offsets() {
+            std::array<std::size_t, sizeof...(ArgTs) + 1> offsets{};
+            std::size_t sizes[] = {sizeof(ArgTs)..., 0};
+            for(std::size_t i = 0; i < sizeof...(ArgTs); i++) {
+                offsets[i + 1] = offsets[i] + sizes[i];
+            }
+            return offsets;
+        }
+
+        template<typename A>
+        static A load_arg(const unsigned char* from) {
+            A arg;
+            std::memcpy(&arg, from, sizeof(A));
+            return arg;
+        }
+
+        template<typename... ArgTs, std::size_t... I>
+        static void invoke_with(T& worker, const unsigned char* args, std::index_sequence<I...>) {
+            constexpr auto offsets = arg_offsets<ArgTs...>();
+            worker(load_arg<ArgTs>(args + offsets[I])...);
+        }
+
+        bool try_take(std::size_t self, task& t) {
+            for(std::size_t i = 0; i < rings.size(); i++) {
+                if(rings[(self + i) % rings.size()]->try_pop(t)) return true;
+            }
+            return false;
+        }
+
+        bool any_work() const {
+            for(const auto& ring : rings) {
+                if(!ring->looks_empty()) return true;
+            }
+            return false;
+        }
+
+        void run(std::size_t self) {
+            int idle_spins = 0;
+            task t;
+            while(true) {
+                if(try_take(self, t)) {
+                    idle_spins = 0;
+                    t.invoke(workers[self], t.args);
+                    if(--tasks_left == 0) {
+                        std::lock_guard<std::mutex> lock(finish_mutex);
+                        finished.notify_all();
+                    }
+                    continue;
+                }
+                if(stopping.load()) return;
+                if(++idle_spins < spins_before_parking) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(park_mutex);
+                sleeping++;
+                // Pairs with the fence in post_task: either it sees us asleep, or we see its task
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                work_available.wait(lock, [&](){ return stopping.load() || any_work(); });
+                sleeping--;
+                idle_spins = 0;
+            }
+        }
+
+        void pin(std::size_t i) {
+            unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            pthread_setaffinity_np(threads[i].native_handle(), sizeof(set), &set);
+        }
+
         public:
-        worker_pool(int n_threads) : workers(n_threads) {
+        worker_pool(int n_threads, bool pin_to_cpus = false) :
+            workers(n_threads), next_ring(0), stopping(false), sleeping(0), tasks_left(0) {
+            rings.reserve(n_threads);
+            for(int i = 0; i < n_threads; i++) {
+                rings.push_back(std::make_unique<task_ring<task>>(ring_capacity));
+            }
             threads.reserve(n_threads);
             for(int i = 0; i < n_threads; i++) {
-                threads.emplace_back([i, this](){
-                    while(true) {
-                        std::packaged_task<void(T&)> current_task;
-                        {
-                            std::unique_lock<std::mutex> lock(task_mutex);
-                            task_available.wait(lock, [&](){ return tasks.size() > 0;});
-                            current_task = std::move(tasks.front());
-                            tasks.pop_front();
-                        }
-                        current_task(workers[i]);
-                        tasks_left--;
-                        if(tasks_left.load() == 0) {
-                            std::lock_guard<std::mutex> lock(finish_mutex);
-                            finished.notify_one();
-                        }
-                    }
-                });
+                threads.emplace_back([i, this](){ run(i); });
+                if(pin_to_cpus) pin(i);
             }
-            tasks_left.store(0);
         }
 
         ~worker_pool() {
-            if(tasks.size() > 0) finish_all();
+            finish_all();
+            stopping.store(true);
+            {
+                std::lock_guard<std::mutex> lock(park_mutex);
+                work_available.notify_all();
+            }
             for(auto& t : threads) {
-                t.detach();
+                t.join();
             }
         }
-        
+
+        // Blocks until every task posted so far has run to completion
         void finish_all() {
             std::unique_lock<std::mutex> lock(finish_mutex);
-            finished.wait(lock, [&](){ return tasks.size() == 0;});
+            finished.wait(lock, [&](){ return tasks_left.load() == 0; });
+        }
+
+        std::size_t size() const {
+            return threads.size();
+        }
+
+        // Tasks posted and not yet finished, running ones included
+        std::size_t pending() const {
+            return tasks_left.load(std::memory_order_relaxed);
         }
 
         template<typename... ArgTs>
         void post_task(ArgTs&&... args) {
-            std::lock_guard<std::mutex> lock(task_mutex);
-            tasks.emplace_back([args = std::make_tuple(std::forward<ArgTs>(args)...)](T& worker){
-                std::apply(worker, std::move(args));
-            });
+            static_assert((std::is_trivially_copyable_v<std::decay_t<ArgTs>> && ...),
+                          "worker_pool tasks are copied bytewise");
+            static_assert(arg_offsets<std::decay_t<ArgTs>...>().back() <= max_arg_bytes,
+                          "worker_pool task arguments are too large");
+            task t;
+            t.invoke = [](T& worker, const unsigned char* bytes){
+                invoke_with<std::decay_t<ArgTs>...>(worker, bytes, std::index_sequence_for<ArgTs...>{});
+            };
+            constexpr auto offsets = arg_offsets<std::decay_t<ArgTs>...>();
+            std::size_t i = 0;
+            ((std::memcpy(t.args + offsets[i++], &args, sizeof(std::decay_t<ArgTs>))), ...);
+
             tasks_left++;
-            task_available.notify_one();
+            // Every ring full means every worker is far behind: back off until one catches up
+            std::size_t start = next_ring.fetch_add(1, std::memory_order_relaxed);
+            for(std::size_t attempt = 0; !rings[(start + attempt) % rings.size()]->try_push(t); attempt++) {
+                if(attempt % rings.size() == rings.size() - 1) std::this_thread::yield();
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(sleeping.load() > 0) {
+                std::lock_guard<std::mutex> lock(park_mutex);
+                work_available.notify_one();
+            }
         }
     };
 }
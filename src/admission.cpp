@@ -0,0 +1,46 @@
+#include <http/admission.hpp>
+#include <http/config.hpp>
+#include <http/metrics.hpp>
+#include <http/log.hpp>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <fmt/format.h>
+
+static std::atomic<std::size_t> open_count{0};
+
+bool http::admit_connection() {
+    const int limit = http::settings().max_connections;
+    std::size_t open = open_count.load(std::memory_order_relaxed);
+    do {
+        if(limit > 0 && open >= static_cast<std::size_t>(limit)) return false;
+    } while(!open_count.compare_exchange_weak(open, open + 1, std::memory_order_relaxed));
+    return true;
+}
+
+void http::release_connection() {
+    open_count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+std::size_t http::open_connections() {
+    return open_count.load(std::memory_order_relaxed);
+}
+
+void http::turn_away(int clientfd) {
+    static const std::string reply = fmt::format(
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: {}\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n", http::settings().retry_after);
+    // A fresh socket's send buffer always has room for this, so one try is enough
+    if(::send(clientfd, reply.data(), reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        HTTP_LOG(debug) << "Could not send 503 to fd #" << clientfd;
+    }
+    ::shutdown(clientfd, SHUT_WR);
+    ::close(clientfd);
+    http::count(http::counter::connections_rejected);
+    http::count(http::counter::responses_5xx);
+}
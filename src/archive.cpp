@@ -0,0 +1,87 @@
+#include <http/archive.hpp>
+#include <http/config.hpp>
+#include <http/error.hpp>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+std::uint64_t http::archive_hash(std::string_view path) {
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for(char c : path) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static void check_within(std::uint64_t offset, std::uint64_t length, std::size_t size) {
+    if(offset > size || length > size - offset) throw std::runtime_error("Archive is truncated or corrupt");
+}
+
+http::archive::archive(const std::string& path)
+    : fd(std::make_shared<const unique_fd>(::open(path.c_str(), O_RDONLY | O_CLOEXEC))) {
+    http::check_error(fd->get());
+    struct stat info;
+    http::check_error(::fstat(fd->get(), &info));
+    size = static_cast<std::size_t>(info.st_size);
+    if(size < sizeof(archive_header)) throw std::runtime_error("Not an archive: " + path);
+    void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd->get(), 0);
+    if(mapped == MAP_FAILED) http::check_error(-1);
+    base = static_cast<const char*>(mapped);
+    header = reinterpret_cast<const archive_header*>(base);
+    try {
+        if(std::memcmp(header->magic, archive_magic, sizeof(archive_magic)) != 0) {
+            throw std::runtime_error("Not an archive: " + path);
+        }
+        if(header->version != archive_version) {
+            throw std::runtime_error("Unsupported archive version " + std::to_string(header->version) + ": " + path);
+        }
+        if(header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0
+           || header->slot_count <= header->entry_count) {
+            throw std::runtime_error("Archive is truncated or corrupt");
+        }
+        check_within(header->slots_offset, header->slot_count * sizeof(std::uint32_t), size);
+        check_within(header->entries_offset, std::uint64_t{header->entry_count} * sizeof(archive_entry), size);
+        if(header->slots_offset % alignof(std::uint32_t) != 0 || header->entries_offset % alignof(archive_entry) != 0) {
+            throw std::runtime_error("Archive is truncated or corrupt");
+        }
+    } catch (...) {
+        ::munmap(mapped, size);
+        throw;
+    }
+    slots = reinterpret_cast<const std::uint32_t*>(base + header->slots_offset);
+    entries = reinterpret_cast<const archive_entry*>(base + header->entries_offset);
+}
+
+http::archive::~archive() {
+    ::munmap(const_cast<char*>(base), size);
+}
+
+std::string_view http::archive::bytes(const archive_span& span) const {
+    check_within(span.offset, span.length, size);
+    return {base + span.offset, static_cast<std::size_t>(span.length)};
+}
+
+http::file_body http::archive::file(const archive_span& span) const {
+    check_within(span.offset, span.length, size);
+    return {fd, static_cast<off_t>(span.offset), static_cast<std::size_t>(span.length)};
+}
+
+const http::archive_entry* http::archive::find(std::string_view path) const {
+    const std::uint64_t mask = header->slot_count - 1;
+    for(std::uint64_t i = archive_hash(path) & mask;; i = (i + 1) & mask) {
+        std::uint32_t slot = slots[i];
+        if(slot == 0) return nullptr;
+        if(slot > header->entry_count) throw std::runtime_error("Archive is truncated or corrupt");
+        const archive_entry& entry = entries[slot - 1];
+        if(bytes(entry.path) == path) return &entry;
+    }
+}
+
+const http::archive* http::packed_site() {
+    static const std::unique_ptr<const archive> instance =
+        settings().archive.empty() ? nullptr : std::make_unique<const archive>(settings().archive);
+    return instance.get();
+}
@@ -0,0 +1,134 @@
+#include <http/async_socket.hpp>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <http/log.hpp>
+#include <http/metrics.hpp>
+
+static bool would_block() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+void http::async_socket::readiness::await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    socket.waiting = awaiting;
+    socket.wanted = events;
+}
+
+void http::async_socket::readiness::await_resume() {
+    socket.waiting = {};
+    socket.wanted = 0;
+    if(std::exchange(socket.expired, false)) {
+        throw std::system_error(ETIMEDOUT, std::generic_category(), "Timed out");
+    }
+}
+
+http::async_socket::readiness http::async_socket::readable() {
+    return {*this, EPOLLIN};
+}
+
+http::async_socket::readiness http::async_socket::writable() {
+    return {*this, EPOLLOUT};
+}
+
+http::task<std::size_t> http::async_socket::read_some(char* into, std::size_t max) {
+    while(true) {
+        ssize_t n = ::recv(fd, into, max, 0);
+        if(n >= 0) {
+            http::count(http::counter::bytes_received, n);
+            co_return n;
+        }
+        if(would_block()) {
+            co_await readable();
+        } else if(errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "recv");
+        }
+    }
+}
+
+http::task<void> http::async_socket::write(iovec* iov, int count, int flags) {
+    while(count > 0) {
+        msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t n = ::sendmsg(fd, &message, MSG_NOSIGNAL | flags);
+        if(n < 0) {
+            if(would_block()) {
+                co_await writable();
+            } else if(errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "sendmsg");
+            }
+            continue;
+        }
+        http::count(http::counter::bytes_sent, n);
+        sent_some = sent_some || n > 0;
+        std::size_t left = n;
+        while(count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+}
+
+http::task<void> http::async_socket::send_file(const http::file_body& file) {
+    off_t offset = file.offset;
+    std::size_t left = file.length;
+    while(left > 0) {
+        ssize_t n = ::sendfile(fd, file.fd->get(), &offset, left);
+        if(n == 0) {
+            // The file got shorter under us
+            throw std::system_error(EIO, std::generic_category(), "sendfile");
+        }
+        if(n < 0) {
+            if(would_block()) {
+                co_await writable();
+            } else if(errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "sendfile");
+            }
+            continue;
+        }
+        http::count(http::counter::bytes_sent, n);
+        sent_some = true;
+        left -= n;
+    }
+}
+
+http::task<int> http::async_socket::accept() {
+    while(true) {
+        sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int clientfd = ::accept4(fd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientfd >= 0) {
+            co_return clientfd;
+        }
+        if(errno == EINTR || errno == ECONNABORTED) continue;
+        // Anything but an empty queue (EMFILE, ENOBUFS...) also waits for the next wakeup
+        if(!would_block()) {
+            HTTP_LOG(error) << "accept failed: " << std::strerror(errno);
+        }
+        co_await readable();
+    }
+}
+
+void http::async_socket::wake(unsigned events) {
+    // Errors and hangups wake any wait, so the next call sees them
+    if(waiting && (events & (wanted | EPOLLERR | EPOLLHUP))) {
+        waiting.resume();
+    }
+}
+
+void http::async_socket::time_out() {
+    if(waiting) {
+        expired = true;
+        waiting.resume();
+    }
+}
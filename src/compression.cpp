@@ -0,0 +1,189 @@
+#include <http/compression.hpp>
+#include <http/config.hpp>
+#include <http/headers.hpp>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+    // Types outside text/* (and the +xml and +json suffixes) that deflate well
+    const std::array<std::string_view, 7> compressible_types = {
+        "application/javascript",
+        "application/json",
+        "application/xml",
+        "application/vnd.ms-fontobject",
+        "font/ttf",
+        "font/otf",
+        "image/svg+xml"
+    };
+
+    std::string_view trim(std::string_view s) {
+        std::size_t begin = s.find_first_not_of(" \t");
+        if(begin == std::string_view::npos) return {};
+        return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+    }
+
+    // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] ), in thousandths
+    std::optional<int> parse_qvalue(std::string_view s) {
+        if(s.empty() || (s[0] != '0' && s[0] != '1')) return std::nullopt;
+        int q = (s[0] - '0') * 1000;
+        if(s.size() == 1) return q;
+        if(s[1] != '.' || s.size() > 5) return std::nullopt;
+        int scale = 100;
+        for(char c : s.substr(2)) {
+            if(!std::isdigit(static_cast<unsigned char>(c))) return std::nullopt;
+            q += (c - '0') * scale;
+            scale /= 10;
+        }
+        if(q > 1000) return std::nullopt;
+        return q;
+    }
+
+    // The q-value of coding's own entry in Accept-Encoding, if it has one.
+    // Elements with a malformed q-value are ignored.
+    std::optional<int> listed_quality(std::string_view accept_encoding, std::string_view coding) {
+        std::optional<int> found;
+        while(!accept_encoding.empty()) {
+            std::size_t comma = accept_encoding.find(',');
+            std::string_view element = accept_encoding.substr(0, comma);
+            accept_encoding = comma == std::string_view::npos ? std::string_view{} : accept_encoding.substr(comma + 1);
+            std::size_t semicolon = element.find(';');
+            if(!http::iequals(trim(element.substr(0, semicolon)), coding)) continue;
+            std::optional<int> q = 1000;
+            while(semicolon != std::string_view::npos && q) {
+                element = element.substr(semicolon + 1);
+                semicolon = element.find(';');
+                std::string_view param = trim(element.substr(0, semicolon));
+                if(param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                    q = parse_qvalue(param.substr(2));
+                }
+            }
+            if(q) found = std::max(found.value_or(0), *q);
+        }
+        return found;
+    }
+
+    // A gzip deflate stream and its input buffer. Resetting one for the next
+    // body keeps its allocations, which deflateInit2 would otherwise redo.
+    struct deflate_context {
+        static const std::size_t input_size = 64 * 1024;
+        z_stream stream;
+        int level;
+        std::vector<char> input;
+
+        explicit deflate_context(int level) : stream{}, level(level), input(input_size) {
+            // 15 window bits, +16 for a gzip rather than zlib wrapper
+            if(deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error("Could not initialise zlib");
+            }
+        }
+        deflate_context(const deflate_context&) = delete;
+        deflate_context& operator=(const deflate_context&) = delete;
+        ~deflate_context() {
+            deflateEnd(&stream);
+        }
+    };
+
+    // Idle contexts kept per thread; enough for the bodies one event loop
+    // usually has in flight, without pinning much memory in pool threads
+    const std::size_t max_idle = 8;
+    thread_local std::vector<std::unique_ptr<deflate_context>> idle_contexts;
+
+    std::unique_ptr<deflate_context> acquire_context(int level) {
+        if(idle_contexts.empty()) {
+            return std::make_unique<deflate_context>(level);
+        }
+        std::unique_ptr<deflate_context> context = std::move(idle_contexts.back());
+        idle_contexts.pop_back();
+        if(context->level != level) {
+            // Nothing has been deflated since the reset, so this can't fail for lack of output space
+            if(deflateParams(&context->stream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return std::make_unique<deflate_context>(level);
+            }
+            context->level = level;
+        }
+        return context;
+    }
+
+    void release_context(std::unique_ptr<deflate_context> context) {
+        if(idle_contexts.size() < max_idle && deflateReset(&context->stream) == Z_OK) {
+            idle_contexts.push_back(std::move(context));
+        }
+    }
+
+    class gzip_source : public http::body_source {
+        std::shared_ptr<http::body_source> inner;
+        std::unique_ptr<deflate_context> context;
+        bool input_done = false;
+        bool output_done = false;
+
+        public:
+        gzip_source(std::shared_ptr<http::body_source> inner, int level) : inner(std::move(inner)), context(acquire_context(level)) {}
+
+        ~gzip_source() {
+            release_context(std::move(context));
+        }
+
+        std::size_t read(char* out, std::size_t max) override {
+            if(max == 0) return 0;
+            z_stream& stream = context->stream;
+            stream.next_out = reinterpret_cast<Bytef*>(out);
+            stream.avail_out = static_cast<uInt>(std::min<std::size_t>(max, UINT32_MAX));
+            while(!output_done && stream.avail_out == max) {
+                if(stream.avail_in == 0 && !input_done) {
+                    std::size_t n = inner->read(context->input.data(), context->input.size());
+                    input_done = n == 0;
+                    stream.next_in = reinterpret_cast<Bytef*>(context->input.data());
+                    stream.avail_in = static_cast<uInt>(n);
+                }
+                int status = deflate(&stream, input_done ? Z_FINISH : Z_NO_FLUSH);
+                if(status == Z_STREAM_END) {
+                    output_done = true;
+                } else if(status != Z_OK && status != Z_BUF_ERROR) {
+                    throw std::runtime_error("zlib deflate failed");
+                }
+            }
+            return max - stream.avail_out;
+        }
+    };
+}
+
+bool http::compressible(std::string_view content_type) {
+    std::string_view type = trim(content_type.substr(0, content_type.find(';')));
+    if(type.size() >= 5 && http::iequals(type.substr(0, 5), "text/")) return true;
+    for(std::string_view suffix : {"+xml", "+json"}) {
+        if(type.size() > suffix.size() && http::iequals(type.substr(type.size() - suffix.size()), suffix)) return true;
+    }
+    return std::any_of(compressible_types.begin(), compressible_types.end(), [&](std::string_view candidate){
+        return http::iequals(type, candidate);
+    });
+}
+
+bool http::worth_compressing(std::string_view content_type, std::optional<std::size_t> size) {
+    const http::config& config = http::settings();
+    if(config.gzip_level <= 0) return false;
+    // Below the minimum the gzip header and trailer eat most of the saving
+    if(size && *size < config.gzip_min_size) return false;
+    return compressible(content_type);
+}
+
+int http::coding_quality(std::string_view accept_encoding, std::string_view coding) {
+    if(auto q = listed_quality(accept_encoding, coding)) return *q;
+    return listed_quality(accept_encoding, "*").value_or(0);
+}
+
+bool http::accepts_gzip(std::string_view accept_encoding) {
+    int gzip = coding_quality(accept_encoding, "gzip");
+    // identity is always acceptable, but ranks last unless listed
+    std::optional<int> identity = listed_quality(accept_encoding, "identity");
+    return gzip > 0 && (!identity || gzip >= *identity);
+}
+
+std::shared_ptr<http::body_source> http::gzip_source(std::shared_ptr<body_source> inner, int level) {
+    return std::make_shared<::gzip_source>(std::move(inner), level);
+}
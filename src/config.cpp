@@ -0,0 +1,132 @@
+#include <http/config.hpp>
+#include <optional>
+#include <stdexcept>
+#include <fnmatch.h>
+#include <string_view>
+
+http::config& http::settings() {
+    static config instance;
+    return instance;
+}
+
+std::string_view http::cache_control_for(const std::string& path) {
+    for(const auto& [pattern, value] : settings().cache_control) {
+        if(::fnmatch(pattern.c_str(), path.c_str(), 0) == 0) return value;
+    }
+    return {};
+}
+
+static std::optional<http::log_level> parse_level(const std::string& value) {
+    for(auto level : {http::log_level::trace, http::log_level::debug, http::log_level::info, http::log_level::warning,
+                      http::log_level::error, http::log_level::fatal, http::log_level::off}) {
+        if(http::log_level_name(level) == value) return level;
+    }
+    return std::nullopt;
+}
+
+static bool parse_switch(const std::string& value) {
+    if(value == "on" || value == "true" || value == "1") return true;
+    if(value == "off" || value == "false" || value == "0") return false;
+    throw std::invalid_argument("Expected on or off, got " + value);
+}
+
+// PREFIX=HOST:PORT, with the prefix a path that the route's requests fall under
+static std::optional<http::proxy_route> parse_route(const std::string& value) {
+    std::size_t eq = value.find('=');
+    std::size_t colon = value.rfind(':');
+    if(eq == std::string::npos || colon == std::string::npos || colon < eq) return std::nullopt;
+    std::string prefix = value.substr(0, eq);
+    if(prefix.empty() || prefix.front() != '/') return std::nullopt;
+    // "/" forwards everything; otherwise a trailing slash is implied
+    if(prefix.size() > 1 && prefix.back() == '/') prefix.pop_back();
+    std::string host = value.substr(eq + 1, colon - eq - 1);
+    if(host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    unsigned long port = std::stoul(value.substr(colon + 1));
+    if(host.empty() || port == 0 || port > 65535) return std::nullopt;
+    return http::proxy_route{std::move(prefix), std::move(host), static_cast<unsigned short>(port)};
+}
+
+void http::parse_args(int argc, char** argv) {
+    config& c = settings();
+    for(int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        auto eq = arg.find('=');
+        if(arg.substr(0, 2) != "--" || eq == std::string_view::npos) {
+            throw std::invalid_argument("Expected --name=value, got " + std::string{arg});
+        }
+        std::string_view name = arg.substr(2, eq - 2);
+        std::string value{arg.substr(eq + 1)};
+        if(name == "port") {
+            c.port = static_cast<unsigned short>(std::stoul(value));
+        } else if(name == "root" && !value.empty()) {
+            c.root = value;
+        } else if(name == "archive" && !value.empty()) {
+            c.archive = value;
+        } else if(name == "mode" && value == "blocking") {
+            c.mode = server_mode::blocking;
+        } else if(name == "mode" && value == "reactor") {
+            c.mode = server_mode::reactor;
+        } else if(name == "mode" && value == "sharded") {
+            c.mode = server_mode::sharded;
+        } else if(name == "mode" && value == "uring") {
+            c.mode = server_mode::uring;
+        } else if(name == "mode" && value == "coroutine") {
+            c.mode = server_mode::coroutine;
+        } else if(name == "threads") {
+            c.threads = std::stoi(value);
+        } else if(name == "pin-threads") {
+            c.pin_threads = parse_switch(value);
+        } else if(name == "backlog" && std::stoi(value) > 0) {
+            c.backlog = std::stoi(value);
+        } else if(name == "defer-accept" && std::stoi(value) >= 0) {
+            c.defer_accept = std::stoi(value);
+        } else if(name == "cache-control" && value.find(':') != std::string::npos) {
+            // --cache-control=GLOB:VALUE, e.g. --cache-control='*.css:public, max-age=86400'
+            std::size_t colon = value.find(':');
+            c.cache_control.emplace_back(value.substr(0, colon), value.substr(colon + 1));
+        } else if(name == "log-level" && parse_level(value)) {
+            c.log_threshold = *parse_level(value);
+        } else if(name == "access-log" && !value.empty()) {
+            c.access_log = value;
+        } else if(name == "chunk-size" && std::stoul(value) > 0) {
+            c.chunk_size = std::stoul(value);
+        } else if(name == "idle-timeout" && std::stoi(value) > 0) {
+            c.idle_timeout = std::stoi(value);
+        } else if(name == "header-timeout" && std::stoi(value) > 0) {
+            c.header_timeout = std::stoi(value);
+        } else if(name == "write-timeout" && std::stoi(value) > 0) {
+            c.write_timeout = std::stoi(value);
+        } else if(name == "body-timeout" && std::stoi(value) > 0) {
+            c.body_timeout = std::stoi(value);
+        } else if(name == "uploads") {
+            c.uploads = parse_switch(value);
+        } else if(name == "max-upload-size") {
+            c.max_upload_size = std::stoull(value);
+        } else if(name == "max-body-size") {
+            c.max_body_size = std::stoul(value);
+        } else if(name == "proxy" && parse_route(value)) {
+            // --proxy=PREFIX=HOST:PORT, e.g. --proxy=/api=127.0.0.1:8080
+            c.proxies.push_back(*parse_route(value));
+        } else if(name == "upstream-timeout" && std::stoi(value) > 0) {
+            c.upstream_timeout = std::stoi(value);
+        } else if(name == "upstream-retries" && std::stoi(value) >= 0) {
+            c.upstream_retries = std::stoi(value);
+        } else if(name == "upstream-idle") {
+            c.upstream_idle = std::stoul(value);
+        } else if(name == "upstream-threads" && std::stoi(value) > 0) {
+            c.upstream_threads = std::stoi(value);
+        } else if(name == "max-connections" && std::stoi(value) >= 0) {
+            c.max_connections = std::stoi(value);
+        } else if(name == "max-queued" && std::stoi(value) >= 0) {
+            c.max_queued = std::stoi(value);
+        } else if(name == "retry-after" && std::stoi(value) >= 0) {
+            c.retry_after = std::stoi(value);
+        } else if(name == "gzip-level" && std::stoi(value) >= 0 && std::stoi(value) <= 9) {
+            c.gzip_level = std::stoi(value);
+        } else if(name == "gzip-min-size") {
+            c.gzip_min_size = std::stoul(value);
+        } else {
+            throw std::invalid_argument("Bad option " + std::string{arg});
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,408 @@
+#include <http/coroutine_loop.hpp>
+#include <http/session.hpp>
+#include <http/outbox.hpp>
+#include <http/error.hpp>
+#include <http/admission.hpp>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <system_error>
+#include <http/log.hpp>
+#include <http/metrics.hpp>
+
+static const std::size_t recv_chunk_size = 16 * 1024;
+
+// A connection served by one coroutine: the same session logic as the
+// reactor's connections, but the read, serve, write cycle is written out as
+// the loop it is, suspending wherever the socket would block.
+class http::coroutine_connection : public http::session, public http::connection_timer, public http::upstream_task {
+    http::coroutine_loop& owner;
+    http::outbox queued;
+    bool closing = false;
+    // The next request goes upstream, once everything before it has been sent
+    bool handing_off = false;
+
+    protected:
+    // Requests are only served once fully buffered, so there is never anything more to wait for
+    std::size_t recv_some(char*, std::size_t) override {
+        return 0;
+    }
+
+    void send_message(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked) override {
+        queued.push(head, std::move(body), chunked);
+    }
+
+    bool recv_body() override {
+        return pull_body(blocking_io);
+    }
+
+    private:
+    // Suspends while an upstream worker gets the response to the request that goes upstream, until the loop takes the connection back
+    struct upstream_served {
+        coroutine_connection& conn;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            conn.resume_after_upstream = awaiting;
+            conn.owner.hand_off(conn);
+        }
+        void await_resume() noexcept {}
+    };
+
+    // Suspends until the upstream a response body comes from has sent more of it
+    struct upstream_readable {
+        coroutine_connection& conn;
+        int fd;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            conn.resume_after_upstream = awaiting;
+            conn.owner.watch_upstream(conn, fd);
+        }
+        void await_resume() noexcept {}
+    };
+
+    void serve_buffered() {
+        while(!closing && !handing_off && request_buffered()) {
+            if(!body_pending() && bound_upstream()) {
+                handing_off = true;
+                return;
+            }
+            closing = !serve_one();
+            if(body_pending()) return; // until more of it arrives
+            head_finished();
+        }
+    }
+
+    // Writes out everything queued, waiting for the client to take it
+    http::task<void> send_queued() {
+        std::array<iovec, http::outbox::max_iov> iov;
+        while(!queued.empty()) {
+            if(const http::file_body* file = queued.front_file()) {
+                const std::size_t length = file->length;
+                co_await socket.send_file(*file);
+                queued.file_sent(length);
+                continue;
+            }
+            bool more;
+            int count;
+            try {
+                count = queued.gather(iov, more);
+            } catch (const std::exception& err) {
+                // A body that fails part way (an upstream gone, say) can only be cut off
+                HTTP_LOG(error) << "fd #" << sockfd << " response body failed: " << err.what();
+                throw;
+            }
+            if(count == 0 && queued.stalled_on() >= 0) {
+                co_await upstream_readable{*this, queued.stalled_on()};
+                continue;
+            }
+            std::size_t total = 0;
+            for(int i = 0; i < count; i++) {
+                total += iov[i].iov_len;
+            }
+            // Corked when a file follows, to share a segment with its start
+            co_await socket.write(iov.data(), count, more ? MSG_MORE : 0);
+            queued.advance(total);
+        }
+    }
+
+    // Reading stops while the client isn't taking our responses, so one that
+    // pipelines without reading can't make us buffer without bound.
+    http::task<void> converse() {
+        while(true) {
+            co_await send_queued();
+            if(closing) co_return;
+            if(handing_off) {
+                co_await upstream_served{*this};
+                // Whatever was pipelined behind it is already buffered
+                serve_buffered();
+                continue;
+            }
+            if(body_pending()) {
+                // The session reads the rest itself, splicing uploads straight into their files
+                serve_buffered();
+                if(body_pending()) co_await socket.readable();
+                continue;
+            }
+            char* space = buffer.prepare(recv_chunk_size);
+            std::size_t n = co_await socket.read_some(space, buffer.writable());
+            buffer.commit(n);
+            serve_buffered();
+            // Peer half-closed: answer what we already have, then hang up. A request
+            // going upstream is answered first, and the next read sees the close again.
+            if(n == 0 && !handing_off) closing = true;
+        }
+    }
+
+    http::task<void> run() {
+        bool timed_out = false;
+        try {
+            co_await converse();
+        } catch (const std::system_error& err) {
+            timed_out = err.code() == std::errc::timed_out;
+            if(!timed_out) {
+                HTTP_LOG(debug) << "        fd #" << sockfd << " failed: " << err.what();
+            }
+        } catch (const std::exception& err) {
+            HTTP_LOG(debug) << "        fd #" << sockfd << " failed: " << err.what();
+        }
+        if(!timed_out) co_return;
+        // Only waits for a request head or body are timed out this way: tell the client why, if the socket will take it
+        if(queued.empty() && !closing) time_out();
+        closing = true;
+        try {
+            co_await send_queued();
+        } catch (const std::exception&) {
+        }
+    }
+
+    public:
+    http::async_socket socket;
+    // Only touched by the loop thread
+    bool out = false;
+    // Resumed once back from an upstream worker, or once the upstream it waits on is readable
+    std::coroutine_handle<> resume_after_upstream;
+    int watched_upstream = -1;
+    // Last, so the coroutine goes before anything it refers to
+    http::task<void> main;
+
+    coroutine_connection(int fd, http::coroutine_loop& owner) : owner(owner), socket(fd), main(run()) {
+        attach(fd);
+    }
+
+    void run_upstream() override {
+        closing = !serve_upstream_bound();
+        handing_off = false;
+        head_finished();
+        owner.take_back(*this);
+    }
+
+    int fd() const {
+        return sockfd;
+    }
+
+    // Moves the deadline on to whatever the connection now waits for
+    void rearm(http::timer_wheel& timers) {
+        update(timers, http::timer_wheel::clock::now(), !buffer.data().empty(), body_pending(), !queued.empty(), socket.progressed() || body_progress);
+        body_progress = false;
+    }
+};
+
+http::coroutine_loop::coroutine_loop(int listenfd) : epollfd(::epoll_create1(EPOLL_CLOEXEC)), wakefd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), stopping(false), listener(listenfd) {
+    http::check_error(epollfd);
+    http::check_error(wakefd);
+    epoll_event wake_event = {};
+    wake_event.events = EPOLLIN;
+    wake_event.data.fd = wakefd;
+    http::check_error(::epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &wake_event));
+    epoll_event listen_event = {};
+    listen_event.events = EPOLLIN | EPOLLET;
+    listen_event.data.fd = listenfd;
+    http::check_error(::epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &listen_event));
+    thread = std::thread([this](){ run(); });
+}
+
+http::coroutine_loop::~coroutine_loop() {
+    stopping.store(true);
+    std::uint64_t one = 1;
+    ::write(wakefd, &one, sizeof(one));
+    thread.join();
+    ::close(wakefd);
+    ::close(epollfd);
+}
+
+void http::coroutine_loop::hand_off(coroutine_connection& conn) {
+    timers.cancel(conn);
+    conn.out = true;
+    out_on_workers++;
+    http::post_upstream(conn);
+}
+
+void http::coroutine_loop::take_back(coroutine_connection& conn) {
+    {
+        std::lock_guard<std::mutex> lock(returned_mutex);
+        returned.push_back(&conn);
+    }
+    all_returned.notify_all();
+    std::uint64_t one = 1;
+    http::check_error(::write(wakefd, &one, sizeof(one)));
+}
+
+void http::coroutine_loop::watch_upstream(coroutine_connection& conn, int fd) {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    http::check_error(::epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event));
+    upstreams.emplace(fd, &conn);
+    conn.watched_upstream = fd;
+}
+
+void http::coroutine_loop::unwatch_upstream(coroutine_connection& conn) {
+    if(conn.watched_upstream < 0) return;
+    ::epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.watched_upstream, nullptr);
+    upstreams.erase(conn.watched_upstream);
+    conn.watched_upstream = -1;
+}
+
+void http::coroutine_loop::resume_returned() {
+    std::uint64_t count;
+    while(::read(wakefd, &count, sizeof(count)) > 0);
+    std::vector<coroutine_connection*> back;
+    {
+        std::lock_guard<std::mutex> lock(returned_mutex);
+        back.swap(returned);
+    }
+    for(coroutine_connection* conn : back) {
+        out_on_workers--;
+        conn->out = false;
+        std::exchange(conn->resume_after_upstream, {}).resume();
+        settle(*conn);
+    }
+}
+
+void http::coroutine_loop::pin_to_cpu(unsigned cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if(error != 0) {
+        HTTP_LOG(warning) << "Could not pin event loop to CPU " << cpu << ": " << std::strerror(error);
+    }
+}
+
+http::task<void> http::coroutine_loop::accept_connections() {
+    while(true) {
+        int clientfd = co_await listener.accept();
+        if(!http::admit_connection()) {
+            http::turn_away(clientfd);
+            continue;
+        }
+        HTTP_LOG(debug) << "        accepted fd #" << clientfd;
+        http::count(http::counter::connections_accepted);
+        watch(clientfd);
+    }
+}
+
+void http::coroutine_loop::watch(int fd) {
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    if(::epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        HTTP_LOG(error) << "Could not watch fd #" << fd << ": " << std::strerror(errno);
+        ::close(fd);
+        http::count(http::counter::connections_closed);
+        http::release_connection();
+        return;
+    }
+    auto conn = std::make_unique<coroutine_connection>(fd, *this);
+    coroutine_connection& started = *conn;
+    connections.emplace(fd, std::move(conn));
+    // Serve straight away: with TCP_DEFER_ACCEPT the request is usually already here
+    started.main.start();
+    settle(started);
+}
+
+void http::coroutine_loop::on_event(coroutine_connection& conn, unsigned events) {
+    if(conn.out) return;
+    if(events & EPOLLERR) {
+        close(conn);
+        return;
+    }
+    conn.socket.wake(events);
+    settle(conn);
+}
+
+void http::coroutine_loop::expire(coroutine_connection& conn) {
+    if(conn.out) return;
+    http::count(http::counter::timeouts);
+    HTTP_LOG(debug) << "        fd #" << conn.fd() << " timed out";
+    if(conn.waiting_for() == http::connection_timer::header || conn.waiting_for() == http::connection_timer::body) {
+        conn.socket.time_out();
+        settle(conn);
+        return;
+    }
+    close(conn);
+}
+
+void http::coroutine_loop::settle(coroutine_connection& conn) {
+    // An upstream worker has it, with no deadline, until it comes back
+    if(conn.out) return;
+    if(conn.main.done()) {
+        close(conn);
+    } else {
+        conn.rearm(timers);
+    }
+}
+
+void http::coroutine_loop::close(coroutine_connection& conn) {
+    unwatch_upstream(conn);
+    int fd = conn.fd();
+    ::shutdown(fd, SHUT_RDWR);
+    ::close(fd);
+    connections.erase(fd);
+    http::count(http::counter::connections_closed);
+    http::release_connection();
+    HTTP_LOG(debug) << "        closed fd #" << fd;
+}
+
+void http::coroutine_loop::run() {
+    acceptor = accept_connections();
+    acceptor.start();
+    std::array<epoll_event, 256> events;
+    while(!stopping.load()) {
+        int timeout = -1;
+        if(auto wait = timers.until_next(http::timer_wheel::clock::now())) {
+            timeout = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(*wait).count());
+        }
+        int n = ::epoll_wait(epollfd, events.data(), events.size(), timeout);
+        if(n < 0 && errno == EINTR) continue;
+        http::check_error(n);
+        for(int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if(fd == wakefd) {
+                resume_returned();
+                continue;
+            }
+            if(fd == listener.get()) {
+                listener.wake(events[i].events);
+                continue;
+            }
+            // More of a response body has come from upstream
+            if(auto up = upstreams.find(fd); up != upstreams.end()) {
+                coroutine_connection& conn = *up->second;
+                unwatch_upstream(conn);
+                std::exchange(conn.resume_after_upstream, {}).resume();
+                settle(conn);
+                continue;
+            }
+            auto it = connections.find(fd);
+            if(it != connections.end()) {
+                on_event(*it->second, events[i].events);
+            }
+        }
+        timers.advance(http::timer_wheel::clock::now(), [this](http::timer_wheel::timer& t){
+            expire(static_cast<coroutine_connection&>(static_cast<http::connection_timer&>(t)));
+        });
+    }
+    {
+        // Connections out on an upstream worker still come back here
+        std::unique_lock<std::mutex> lock(returned_mutex);
+        all_returned.wait(lock, [this](){ return returned.size() == out_on_workers; });
+    }
+    // Connections and their coroutines are torn down on the thread they ran on
+    for(auto& [fd, conn] : connections) {
+        ::close(fd);
+    }
+    connections.clear();
+    acceptor = {};
+}
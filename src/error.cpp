@@ -0,0 +1,9 @@
+#include <http/error.hpp>
+#include <cerrno>
+#include <system_error>
+
+void http::check_error(int return_val) {
+    if(return_val < 0 && errno > 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+}
@@ -0,0 +1,193 @@
+#include <http/headers.hpp>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    constexpr std::string_view names[] = {
+        "Host", "Connection", "Keep-Alive", "TE", "Upgrade", "Via", "Forwarded", "X-Forwarded-For",
+        "Accept", "Accept-Encoding", "Accept-Language", "User-Agent", "Authorization", "Cookie", "Referer",
+        "Content-Length", "Content-Type", "Content-Encoding", "Transfer-Encoding", "Expect",
+        "Range", "If-Range", "If-Match", "If-None-Match", "If-Modified-Since", "If-Unmodified-Since", "Cache-Control"
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == http::field_count, "every field needs a name");
+    constexpr std::size_t max_name = 19;
+    // A power of two, with room enough that a collision-free seed turns up quickly
+    constexpr std::size_t n_slots = 128;
+
+    // ASCII lowercase of every byte, so that folding case is a load rather than a call
+    struct case_folding {
+        unsigned char lower[256];
+    };
+
+    constexpr case_folding build_folding() {
+        case_folding folding = {};
+        for(int c = 0; c < 256; c++) {
+            folding.lower[c] = static_cast<unsigned char>(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+        }
+        return folding;
+    }
+
+    constexpr case_folding folding = build_folding();
+
+    // FNV-1a over the length and the first, middle and last characters, lowercased so that
+    // any capitalisation lands in the same slot. Those alone tell the well-known names apart,
+    // and hashing every byte of every header name costs more than the rest of parsing it.
+    constexpr std::uint32_t hash(std::uint32_t seed, const char* name, std::size_t size) {
+        seed = (seed ^ static_cast<std::uint32_t>(size)) * 16777619u;
+        seed = (seed ^ folding.lower[static_cast<unsigned char>(name[0])]) * 16777619u;
+        seed = (seed ^ folding.lower[static_cast<unsigned char>(name[size / 2])]) * 16777619u;
+        seed = (seed ^ folding.lower[static_cast<unsigned char>(name[size - 1])]) * 16777619u;
+        // The low bits of a product only see the low bits of its inputs, so fold the high ones down
+        return seed ^ (seed >> 15);
+    }
+
+    constexpr bool perfect(std::uint32_t seed) {
+        bool taken[n_slots] = {};
+        for(std::string_view name : names) {
+            std::size_t slot = hash(seed, name.data(), name.size()) % n_slots;
+            if(taken[slot]) return false;
+            taken[slot] = true;
+        }
+        return true;
+    }
+
+    // The first FNV-1a offset basis, counting up, under which no two names share a slot
+    constexpr std::uint32_t find_seed() {
+        std::uint32_t seed = 2166136261u;
+        while(!perfect(seed)) seed++;
+        return seed;
+    }
+
+    constexpr std::uint32_t seed = find_seed();
+
+    // Index into names for each slot, or -1
+    struct slot_table {
+        signed char index[n_slots];
+    };
+
+    constexpr slot_table build_slots() {
+        slot_table slots = {};
+        for(auto& slot : slots.index) slot = -1;
+        for(std::size_t i = 0; i < http::field_count; i++) {
+            slots.index[hash(seed, names[i].data(), names[i].size()) % n_slots] = static_cast<signed char>(i);
+        }
+        return slots;
+    }
+
+    constexpr slot_table slots = build_slots();
+}
+
+std::string_view http::field_name(field f) {
+    return names[static_cast<std::size_t>(f)];
+}
+
+// Runs for every header of every request
+http::field http::find_field(std::string_view name) {
+    const std::size_t size = name.size();
+    if(size == 0 || size > max_name) return field::other;
+    int index = slots.index[hash(seed, name.data(), size) % n_slots];
+    if(index < 0) return field::other;
+    // Clients mostly send the canonical spelling, which memcmp checks fastest
+    const std::string_view candidate = names[index];
+    if(size != candidate.size()) return field::other;
+    if(std::memcmp(candidate.data(), name.data(), size) == 0 || iequals(candidate, name)) return static_cast<field>(index);
+    return field::other;
+}
+
+bool http::iequals(std::string_view lhs, std::string_view rhs) {
+    const std::size_t size = lhs.size();
+    if(size != rhs.size()) return false;
+    const auto* l = reinterpret_cast<const unsigned char*>(lhs.data());
+    const auto* r = reinterpret_cast<const unsigned char*>(rhs.data());
+    for(std::size_t i = 0; i < size; i++) {
+        if(folding.lower[l[i]] != folding.lower[r[i]]) return false;
+    }
+    return true;
+}
+
+bool http::next_element(std::string_view& list, std::string_view& element) {
+    if(list.empty()) return false;
+    std::size_t comma = list.find(',');
+    element = list.substr(0, comma);
+    list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+    while(!element.empty() && (element.front() == ' ' || element.front() == '\t')) element.remove_prefix(1);
+    while(!element.empty() && (element.back() == ' ' || element.back() == '\t')) element.remove_suffix(1);
+    return true;
+}
+
+bool http::has_token(std::string_view list, std::string_view token) {
+    std::string_view item;
+    while(next_element(list, item)) {
+        if(iequals(item, token)) return true;
+    }
+    return false;
+}
+
+void http::request_headers::clear() {
+    entries.clear();
+    slots.fill(0);
+}
+
+void http::request_headers::add(std::string_view name, std::string_view value, field known) {
+    entries.push_back({name, value});
+    if(known != field::other) {
+        std::uint16_t& slot = slots[static_cast<std::size_t>(known)];
+        if(!slot) slot = static_cast<std::uint16_t>(entries.size());
+    }
+}
+
+std::string_view http::request_headers::get(std::string_view name) const {
+    if(field known = find_field(name); known != field::other) return get(known);
+    for(const entry& e : entries) {
+        if(iequals(e.name, name)) return e.value;
+    }
+    return {};
+}
+
+http::response_headers::response_headers(std::initializer_list<std::pair<std::string_view, std::string_view>> headers,
+                                         std::pmr::memory_resource* memory) : entries(memory) {
+    entries.reserve(headers.size());
+    for(const auto& [name, value] : headers) {
+        set(name, value);
+    }
+}
+
+std::pmr::vector<http::response_headers::entry>::iterator http::response_headers::find(std::string_view name) {
+    return std::find_if(entries.begin(), entries.end(), [&](const entry& e){ return iequals(e.name, name); });
+}
+
+std::string_view http::response_headers::get(std::string_view name) const {
+    for(const entry& e : entries) {
+        if(iequals(e.name, name)) return e.value;
+    }
+    return {};
+}
+
+void http::response_headers::set(std::string_view name, std::string_view value) {
+    auto found = find(name);
+    if(found != entries.end()) {
+        found->value = value;
+    } else {
+        std::pmr::memory_resource* memory = entries.get_allocator().resource();
+        entries.push_back({std::pmr::string{name, memory}, std::pmr::string{value, memory}});
+    }
+}
+
+bool http::response_headers::insert(std::string_view name, std::string_view value) {
+    if(find(name) != entries.end()) return false;
+    std::pmr::memory_resource* memory = entries.get_allocator().resource();
+    entries.push_back({std::pmr::string{name, memory}, std::pmr::string{value, memory}});
+    return true;
+}
+
+void http::response_headers::add(std::string_view name, std::string_view value) {
+    std::pmr::memory_resource* memory = entries.get_allocator().resource();
+    entries.push_back({std::pmr::string{name, memory}, std::pmr::string{value, memory}});
+}
+
+bool http::response_headers::erase(std::string_view name) {
+    auto found = find(name);
+    if(found == entries.end()) return false;
+    entries.erase(found);
+    return true;
+}
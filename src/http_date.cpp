@@ -0,0 +1,31 @@
+#include <http/http_date.hpp>
+#include <time.h>
+
+std::pmr::string http::format_http_date(std::time_t time, std::pmr::memory_resource* memory) {
+    std::tm parts;
+    ::gmtime_r(&time, &parts);
+    char formatted[64];
+    std::size_t length = std::strftime(formatted, sizeof(formatted), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return {formatted, length, memory};
+}
+
+std::optional<std::time_t> http::parse_http_date(std::string_view date) {
+    static const char* const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT", // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT", // RFC 850
+        "%a %b %d %H:%M:%S %Y"       // asctime
+    };
+    // Terminated on the stack; no valid date comes close to this long
+    char terminated[64];
+    if(date.size() >= sizeof(terminated)) return std::nullopt;
+    date.copy(terminated, date.size());
+    terminated[date.size()] = '\0';
+    for(const char* format : formats) {
+        std::tm parts = {};
+        const char* end = ::strptime(terminated, format, &parts);
+        if(end && *end == '\0') {
+            return ::timegm(&parts);
+        }
+    }
+    return std::nullopt;
+}
@@ -1,4 +1,6 @@
 #include <http/index.hpp>
+#include <http/listing_cache.hpp>
+#include <http/mime.hpp>
 #include <iterator>
 #include <sstream>
 #include <algorithm>
@@ -9,30 +11,16 @@
 
 namespace fs = boost::filesystem;
 
-std::string get_content_type(fs::path path) {
-    auto e = path.extension();
-    if      (e == ".css")   return "text/css";
-    else if (e == ".html")  return "text/html";
-    else if (e == ".eot")   return "application/vnd.ms-fontobject";
-    else if (e == ".svg")   return "image/svg+xml";
-    else if (e == ".ttf")   return "font/ttf";
-    else if (e == ".woff")  return "font/woff";
-    else if (e == ".woff2") return "font/woff2";
-    else if (e == ".webm")  return "video/webm";
-    else if (e == ".pptx")  return "application/vnd.openxmlformats-officedocument.presentationml.presentation";
-    else if (e == ".png")   return "image/png";
-    else if (e == ".jpeg")  return "image/jpeg";
-    else if (e == ".jpg")   return "image/jpeg";
-    else if (e == ".pdf")   return "application/pdf";
-    else return "application/octet-stream";
-}
-
-http::response http::serve_file(fs::path p, std::fstream& stream) {
+http::response http::serve_file(const fs::path& p, http::unique_fd file, const struct stat& info) {
     return {
         200, "OK",
-        {{"Content-Type", get_content_type(p)}},
-        {std::istreambuf_iterator<char>{stream},
-         std::istreambuf_iterator<char>{}}
+        {{"Content-Type", http::get_content_type(p.string())}, {"Accept-Ranges", "bytes"}},
+        {},
+        http::file_source({
+            std::make_shared<const http::unique_fd>(std::move(file)),
+            0,
+            static_cast<std::size_t>(info.st_size)
+        })
     };
 }
 
@@ -77,47 +65,64 @@ static const std::string index_template = R"EOS(<!DOCTYPE html>
 </html>
 )EOS";
 
-std::string last_modified_string(fs::path path) {
-    std::ostringstream sstream;
-    const std::time_t last_modified_raw = fs::last_write_time(path);
-    const std::tm* last_modified = std::localtime(&last_modified_raw);
-    sstream << std::put_time(last_modified, "%c, %Z");
-    return sstream.str();
+namespace {
+    // Everything a listing row shows, from a single stat
+    struct listing_entry {
+        std::string name;
+        bool is_dir;
+        off_t size;
+        std::time_t last_modified;
+    };
+}
+
+static std::string last_modified_string(std::time_t last_modified_raw) {
+    std::tm last_modified;
+    ::localtime_r(&last_modified_raw, &last_modified);
+    char formatted[128];
+    std::size_t length = std::strftime(formatted, sizeof(formatted), "%c, %Z", &last_modified);
+    return {formatted, length};
 }
 
-std::string format_row(fs::path path) {
-    bool is_dir = fs::is_directory(path);
+static std::string format_row(const listing_entry& entry) {
     static const std::string row_template =
     "<tr><td><a href='{}{}'>{}</a></td><td>{}</td><td>{}</td><td>{}</td></tr>";
-    return fmt::format(row_template,
-        path.filename().string(),
-        is_dir ? "/" : "",
-        path.filename().string(),
-        is_dir ? "" : last_modified_string(path),
-        is_dir ? "" : std::to_string(fs::file_size(path)),
-        is_dir ? "Directory" : get_content_type(path)
+    return fmt::format(fmt::runtime(row_template),
+        entry.name,
+        entry.is_dir ? "/" : "",
+        entry.name,
+        entry.is_dir ? "" : last_modified_string(entry.last_modified),
+        entry.is_dir ? "" : std::to_string(entry.size),
+        entry.is_dir ? "Directory" : http::get_content_type(entry.name)
     );
 }
 
-http::response http::serve_index(fs::path requested_path, fs::path mapped_path) {
-    std::stringstream rows;
-    std::vector<fs::directory_entry> entries;
-    std::copy(
-        fs::directory_iterator{mapped_path},
-        fs::directory_iterator{},
-        std::back_inserter(entries)
-    );
-    std::sort(entries.begin(), entries.end(), [](const auto& lhs, const auto& rhs){
-        return std::make_tuple(!fs::is_directory(lhs), lhs.path().filename().string())
-             < std::make_tuple(!fs::is_directory(rhs), rhs.path().filename().string());
+std::string http::render_index(const fs::path& requested_path, const fs::path& mapped_path) {
+    std::vector<listing_entry> entries;
+    for(fs::directory_iterator it{mapped_path}, end; it != end; ++it) {
+        struct stat info;
+        if(::stat(it->path().c_str(), &info) != 0) continue; // vanished, or a dangling link
+        entries.push_back({it->path().filename().string(), S_ISDIR(info.st_mode), info.st_size, info.st_mtime});
+    }
+    std::sort(entries.begin(), entries.end(), [](const listing_entry& lhs, const listing_entry& rhs){
+        if(lhs.is_dir != rhs.is_dir) return lhs.is_dir; // directories first
+        return lhs.name < rhs.name;
     });
+    std::string rows;
     for(const auto& entry : entries) {
-        rows << format_row(entry);
+        rows += format_row(entry);
     }
+    return fmt::format(fmt::runtime(index_template), requested_path.string(), rows);
+}
+
+http::response http::serve_index(const fs::path& requested_path, const std::string& mapped_path) {
+    auto html = http::directory_listings().find_or_render(requested_path.string(), mapped_path, [&](){
+        return http::render_index(requested_path, mapped_path);
+    });
     return {
         200, "OK",
         {{"Content-Type", "text/html; charset=utf-8"}},
-        fmt::format(index_template, requested_path.string(), rows.str())
+        {},
+        http::memory_source(std::move(html))
     };
 }
 
@@ -136,10 +141,10 @@ static const std::string error_404_template = R"EOS(<!DOCTYPE html>
 </html>
 )EOS";
 
-http::response http::serve_404(fs::path requested_path) {
+http::response http::serve_404(const fs::path& requested_path) {
     return {
         404, "File Not Found",
         {{"Content-Type", "text/html; charset=utf-8"}},
-        fmt::format(error_404_template, requested_path.string())
+        fmt::format(fmt::runtime(error_404_template), requested_path.string())
     };
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include <http/listing_cache.hpp>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <http/log.hpp>
+
+// Directories rarely number more than this under the root; past it we start over
+static const std::size_t max_listings = 1024;
+
+static const std::uint32_t watched_events =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+http::listing_cache::listing_cache() : inotifyfd(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), epoch(0) {
+    if(inotifyfd < 0) {
+        HTTP_LOG(warning) << "inotify unavailable, directory listings won't be cached: " << std::strerror(errno);
+    }
+}
+
+http::listing_cache::~listing_cache() {
+    if(inotifyfd >= 0) ::close(inotifyfd);
+}
+
+void http::listing_cache::invalidate(int wd) {
+    epoch++;
+    for(auto it = listings.begin(); it != listings.end();) {
+        if(wd < 0 || it->second.wd == wd) {
+            it = listings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void http::listing_cache::drain_events() {
+    alignas(inotify_event) char events[4096];
+    while(true) {
+        ssize_t n = ::read(inotifyfd, events, sizeof(events));
+        if(n <= 0) return; // EAGAIN: nothing has changed
+        for(ssize_t i = 0; i < n;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(events + i);
+            // An overflowed queue may have lost anything, so forget everything
+            invalidate(event->mask & IN_Q_OVERFLOW ? -1 : event->wd);
+            i += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+
+http::listing_cache::entry http::listing_cache::find_or_render(const std::string& key, const std::string& directory, const std::function<std::string()>& render) {
+    if(inotifyfd < 0) {
+        return std::make_shared<const std::string>(render());
+    }
+    int wd;
+    std::uint64_t rendered_at;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        drain_events();
+        auto found = listings.find(key);
+        if(found != listings.end()) {
+            return found->second.html;
+        }
+        // Watch before reading the directory, so changes made while we render aren't missed
+        wd = ::inotify_add_watch(inotifyfd, directory.c_str(), watched_events | IN_ONLYDIR);
+        rendered_at = epoch;
+    }
+    entry html = std::make_shared<const std::string>(render());
+    if(wd < 0) return html;
+    std::lock_guard<std::mutex> lock(mutex);
+    drain_events();
+    if(epoch == rendered_at) {
+        if(listings.size() >= max_listings) listings.clear();
+        listings[key] = {wd, html};
+    }
+    return html;
+}
+
+http::listing_cache& http::directory_listings() {
+    static listing_cache instance;
+    return instance;
+}
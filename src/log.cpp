@@ -0,0 +1,232 @@
+#include <http/log.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+std::atomic<http::log_level> http::runtime_log_level{http::log_level::info};
+
+namespace {
+    // Longer records are cut short rather than spilling into a second slot
+    const std::size_t max_text = 240;
+    const std::size_t ring_capacity = 1024;
+    const auto idle_wait = std::chrono::milliseconds(2);
+
+    struct slot {
+        std::int64_t nanos;
+        http::log_level level;
+        bool access;
+        std::uint16_t length;
+        char text[max_text];
+    };
+
+    // Single-producer (the owning thread), single-consumer (whoever holds drain_mutex)
+    class log_ring {
+        std::array<slot, ring_capacity> slots;
+        alignas(64) std::atomic<std::size_t> head{0}; // next to write
+        alignas(64) std::atomic<std::size_t> tail{0}; // next to read
+
+        public:
+        std::atomic<std::uint64_t> dropped{0};
+        const int thread_number;
+
+        explicit log_ring(int thread_number) : thread_number(thread_number) {}
+
+        slot* claim() {
+            std::size_t h = head.load(std::memory_order_relaxed);
+            if(h - tail.load(std::memory_order_acquire) == ring_capacity) return nullptr;
+            return &slots[h % ring_capacity];
+        }
+
+        void publish() {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        const slot* front() {
+            std::size_t t = tail.load(std::memory_order_relaxed);
+            if(t == head.load(std::memory_order_acquire)) return nullptr;
+            return &slots[t % ring_capacity];
+        }
+
+        void pop() {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        bool empty() const {
+            return tail.load() == head.load();
+        }
+    };
+
+    class log_writer {
+        std::mutex rings_mutex;
+        std::vector<std::shared_ptr<log_ring>> rings;
+        int next_thread = 0;
+        std::uint64_t retired_drops = 0; // from the rings of threads that have exited
+
+        std::mutex drain_mutex;
+        fmt::memory_buffer log_lines;
+        fmt::memory_buffer access_lines;
+        std::int64_t stamped_second = -1;
+        char stamp[32];
+        std::uint64_t dropped_reported = 0;
+
+        std::thread thread;
+
+        void format_stamp(std::int64_t nanos) {
+            std::int64_t second = nanos / 1000000000;
+            if(second != stamped_second) {
+                std::time_t t = second;
+                std::tm parts;
+                ::gmtime_r(&t, &parts);
+                std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &parts);
+                stamped_second = second;
+            }
+        }
+
+        static void write_out(int fd, fmt::memory_buffer& lines) {
+            std::size_t done = 0;
+            while(fd >= 0 && done < lines.size()) {
+                ssize_t n = ::write(fd, lines.data() + done, lines.size() - done);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) break;
+                done += n;
+            }
+            lines.clear();
+        }
+
+        void run() {
+            while(true) {
+                if(drain() == 0) std::this_thread::sleep_for(idle_wait);
+            }
+        }
+
+        public:
+        std::atomic<int> access_fd{-1};
+        std::atomic<std::uint64_t> written{0};
+
+        log_writer() {
+            thread = std::thread([this](){ run(); });
+            thread.detach();
+        }
+
+        std::shared_ptr<log_ring> add_ring() {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            rings.push_back(std::make_shared<log_ring>(next_thread++));
+            return rings.back();
+        }
+
+        std::uint64_t total_dropped() {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            std::uint64_t total = retired_drops;
+            for(const auto& ring : rings) total += ring->dropped.load();
+            return total;
+        }
+
+        // Writes out every queued record; returns how many there were
+        std::size_t drain() {
+            std::lock_guard<std::mutex> drain_lock(drain_mutex);
+            std::vector<std::shared_ptr<log_ring>> current;
+            std::uint64_t dropped;
+            {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                // Rings of threads that have exited go once they're empty
+                auto retired = std::partition(rings.begin(), rings.end(), [](const auto& ring){
+                    return ring.use_count() > 1 || !ring->empty();
+                });
+                for(auto it = retired; it != rings.end(); ++it) {
+                    retired_drops += (*it)->dropped.load();
+                }
+                rings.erase(retired, rings.end());
+                current = rings;
+                dropped = retired_drops;
+            }
+            std::size_t count = 0;
+            for(const auto& ring : current) {
+                dropped += ring->dropped.load(std::memory_order_relaxed);
+                while(const slot* record = ring->front()) {
+                    format_stamp(record->nanos);
+                    int millis = static_cast<int>(record->nanos / 1000000 % 1000);
+                    std::string_view text{record->text, record->length};
+                    if(record->access) {
+                        fmt::format_to(std::back_inserter(access_lines), "{}.{:03} {}\n", stamp, millis, text);
+                    } else {
+                        fmt::format_to(std::back_inserter(log_lines), "{}.{:03} [{}] <{}> {}\n",
+                            stamp, millis, http::log_level_name(record->level), ring->thread_number, text);
+                    }
+                    ring->pop();
+                    count++;
+                }
+            }
+            if(dropped > dropped_reported) {
+                fmt::format_to(std::back_inserter(log_lines), "[warning] logging fell behind; {} records dropped\n", dropped - dropped_reported);
+                dropped_reported = dropped;
+            }
+            written += count;
+            write_out(STDERR_FILENO, log_lines);
+            write_out(access_fd.load(), access_lines);
+            return count;
+        }
+    };
+
+    // Never destroyed, so threads still logging during exit have somewhere to put it
+    log_writer& writer() {
+        static log_writer* instance = new log_writer;
+        return *instance;
+    }
+
+    thread_local std::shared_ptr<log_ring> local_ring;
+}
+
+std::string_view http::log_level_name(log_level level) {
+    static const std::string_view names[] = {"trace", "debug", "info", "warning", "error", "fatal", "off"};
+    return names[static_cast<std::size_t>(level)];
+}
+
+http::log_record::~log_record() {
+    if(!local_ring) local_ring = writer().add_ring();
+    slot* s = local_ring->claim();
+    if(!s) {
+        local_ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    timespec now;
+    ::clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    s->nanos = static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    s->level = level;
+    s->access = access;
+    s->length = static_cast<std::uint16_t>(std::min(text.size(), max_text));
+    std::memcpy(s->text, text.data(), s->length);
+    local_ring->publish();
+}
+
+http::log_stats http::log_counters() {
+    return {writer().written.load(), writer().total_dropped()};
+}
+
+void http::open_access_log(const std::string& destination) {
+    int fd = -1;
+    if(destination == "-") {
+        fd = STDOUT_FILENO;
+    } else if(destination != "off") {
+        fd = ::open(destination.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(fd < 0) throw std::system_error(errno, std::generic_category(), "Could not open access log " + destination);
+    }
+    int previous = writer().access_fd.exchange(fd);
+    if(previous > STDERR_FILENO) ::close(previous);
+}
+
+bool http::access_log_enabled() {
+    return writer().access_fd.load(std::memory_order_relaxed) >= 0;
+}
+
+void http::flush_log() {
+    writer().drain();
+}
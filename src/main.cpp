@@ -1,28 +1,67 @@
 #include <http/server.hpp>
 #include <http/error.hpp>
-#include <boost/log/trivial.hpp>
+#include <http/response_cache.hpp>
+#include <http/log.hpp>
+#include <http/metrics.hpp>
+#include <http/path_cache.hpp>
+#include <http/archive.hpp>
+#include <http/proxy.hpp>
 #include <signal.h>
 #include <csignal>
+#include <algorithm>
+#include <iostream>
+#include <thread>
 
-void http::check_error(int return_val) {
-    if(return_val < 0 && errno > 0) {
-        throw std::system_error(errno, std::generic_category());
+int main(int argc, char** argv) {
+    // Usage: a.out [--mode=blocking|reactor|sharded|uring|coroutine] [--threads=N] [--pin-threads=on|off] [--port=N] [--root=DIR] [--archive=FILE]
+    //              [--backlog=N] [--defer-accept=SECONDS] [--chunk-size=BYTES] [--cache-control=GLOB:VALUE]...
+    //              [--gzip-level=0-9] [--gzip-min-size=BYTES] [--idle-timeout=S] [--header-timeout=S] [--write-timeout=S]
+    //              [--body-timeout=S] [--uploads=on|off] [--max-upload-size=BYTES] [--max-body-size=BYTES]
+    //              [--proxy=PREFIX=HOST:PORT]... [--upstream-timeout=S] [--upstream-retries=N] [--upstream-idle=N] [--upstream-threads=N]
+    //              [--max-connections=N] [--max-queued=N] [--retry-after=S]
+    //              [--log-level=trace|debug|info|warning|error|off] [--access-log=PATH|-|off]
+    try {
+        http::parse_args(argc, argv);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    http::dump_metrics_on_sigusr1();
+    const http::config& config = http::settings();
+    http::runtime_log_level.store(config.log_threshold);
+    try {
+        http::open_access_log(config.access_log);
+        // Maps the archive or canonicalizes the document root, so a missing one fails here rather than per request
+        if(!http::packed_site()) http::resolved_paths();
+        // Likewise resolves every proxy upstream
+        http::find_upstream({});
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    int n_threads = config.threads;
+    if(n_threads <= 0) {
+        n_threads = config.mode != http::server_mode::blocking ? std::max(1u, std::thread::hardware_concurrency()) : 20;
     }
-}
 
-int main() {
     // Ignore "broken pipe" signals (ie unexpected socket closures)
     // They are handled correctly in networking code.
     signal(SIGPIPE, SIG_IGN);
     
     // Start server
-    BOOST_LOG_TRIVIAL(info) << "Listening...";
+    HTTP_LOG(info) << "Listening...";
     try {
-        auto s = http::server{9999, 20};
+        auto s = http::server{static_cast<short>(config.port), n_threads, config.mode};
         s.serve_forever();
     } catch (const std::system_error& ex) {
         if (ex.code().value() == EINTR) {
-            BOOST_LOG_TRIVIAL(info) << "Keyboard interrupt. Stopping server";
+            HTTP_LOG(info) << "Keyboard interrupt. Stopping server";
+            auto cache = http::file_cache().counters();
+            HTTP_LOG(info) << "Response cache: " << cache.hits << " hits, " << cache.misses << " misses, "
+                                    << cache.evictions << " evictions, " << cache.entries << " entries, " << cache.bytes << " bytes";
+            auto log = http::log_counters();
+            HTTP_LOG(info) << "Log: " << log.written << " records written, " << log.dropped << " dropped";
+            http::flush_log();
         } else {
             throw;
         }
@@ -0,0 +1,195 @@
+#include <http/metrics.hpp>
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fmt/format.h>
+
+namespace {
+    const std::size_t n_counters = static_cast<std::size_t>(http::counter::count_);
+    const std::size_t n_phases = static_cast<std::size_t>(http::phase::count_);
+
+    // Log-linear buckets, as in HdrHistogram: 16 per power of two, so any
+    // value is placed within about 6% of itself. Values are nanoseconds; the
+    // top bucket holds everything past about 18 minutes.
+    const int sub_bucket_bits = 4;
+    const int sub_buckets = 1 << sub_bucket_bits;
+    const int max_exponent = 40;
+    const std::size_t n_buckets = (max_exponent - sub_bucket_bits + 2) * sub_buckets;
+
+    std::size_t bucket_of(std::uint64_t value) {
+        if(value < sub_buckets) return value;
+        int exponent = 63 - __builtin_clzll(value);
+        if(exponent > max_exponent) return n_buckets - 1;
+        std::size_t sub = (value >> (exponent - sub_bucket_bits)) & (sub_buckets - 1);
+        return (exponent - sub_bucket_bits + 1) * sub_buckets + sub;
+    }
+
+    // The middle of the values a bucket holds
+    double bucket_value(std::size_t bucket) {
+        if(bucket < sub_buckets) return bucket;
+        int exponent = static_cast<int>(bucket / sub_buckets) + sub_bucket_bits - 1;
+        std::uint64_t width = std::uint64_t{1} << (exponent - sub_bucket_bits);
+        std::uint64_t low = (std::uint64_t{1} << exponent) + (bucket % sub_buckets) * width;
+        return low + width / 2.0;
+    }
+
+    // One thread's numbers. Only that thread writes them, so plain loads
+    // and stores suffice; readers may see a slightly stale total.
+    struct shard {
+        std::array<std::atomic<std::uint64_t>, n_counters> counters{};
+        std::array<std::array<std::atomic<std::uint64_t>, n_buckets>, n_phases> buckets{};
+        std::array<std::atomic<std::uint64_t>, n_phases> sums{};
+    };
+
+    void bump(std::atomic<std::uint64_t>& slot, std::uint64_t n) {
+        slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    struct gauge {
+        std::string help;
+        std::function<double()> read;
+    };
+
+    struct registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<shard>> shards; // kept after their threads exit
+        std::map<std::string, gauge> gauges;
+    };
+
+    registry& metrics() {
+        static registry instance;
+        return instance;
+    }
+
+    shard& local_shard() {
+        thread_local shard* mine = [](){
+            registry& r = metrics();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.shards.push_back(std::make_unique<shard>());
+            return r.shards.back().get();
+        }();
+        return *mine;
+    }
+
+    const char* const counter_names[n_counters][2] = {
+        {"http_connections_accepted_total", "Connections accepted"},
+        {"http_connections_closed_total", "Connections closed"},
+        {"http_connections_rejected_total", "Connections turned away with a 503 under overload"},
+        {"http_connection_timeouts_total", "Connections timed out idling, sending a request head or reading responses"},
+        {"http_requests_total", "Requests read"},
+        {"http_responses_2xx_total", "Responses with a 2xx status"},
+        {"http_responses_3xx_total", "Responses with a 3xx status"},
+        {"http_responses_4xx_total", "Responses with a 4xx status"},
+        {"http_responses_5xx_total", "Responses with a 5xx status"},
+        {"http_received_bytes_total", "Bytes read from clients"},
+        {"http_sent_bytes_total", "Bytes written to clients"},
+        {"http_upstream_connects_total", "New connections made to proxy upstreams"},
+        {"http_upstream_reuses_total", "Proxied requests sent on a pooled upstream connection"},
+        {"http_upstream_retries_total", "Proxied requests tried again after an upstream failed"}
+    };
+
+    const char* const phase_names[n_phases] = {"parse", "resolve", "file", "encode", "send", "request"};
+    const double quantiles[] = {0.5, 0.99, 0.999};
+}
+
+void http::count(counter c, std::uint64_t n) {
+    bump(local_shard().counters[static_cast<std::size_t>(c)], n);
+}
+
+void http::record(phase p, std::chrono::nanoseconds elapsed) {
+    shard& s = local_shard();
+    auto i = static_cast<std::size_t>(p);
+    std::uint64_t ns = elapsed.count() > 0 ? elapsed.count() : 0;
+    bump(s.buckets[i][bucket_of(ns)], 1);
+    bump(s.sums[i], ns);
+}
+
+void http::register_gauge(const std::string& name, const std::string& help, std::function<double()> read) {
+    registry& r = metrics();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.gauges[name] = {help, std::move(read)};
+}
+
+void http::unregister_gauge(const std::string& name) {
+    registry& r = metrics();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.gauges.erase(name);
+}
+
+std::string http::metrics_text() {
+    registry& r = metrics();
+    std::array<std::uint64_t, n_counters> counters{};
+    std::vector<std::array<std::uint64_t, n_buckets>> buckets(n_phases);
+    std::array<std::uint64_t, n_phases> sums{};
+    fmt::memory_buffer text;
+    auto out = std::back_inserter(text);
+
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for(const auto& s : r.shards) {
+        for(std::size_t c = 0; c < n_counters; c++) counters[c] += s->counters[c].load(std::memory_order_relaxed);
+        for(std::size_t p = 0; p < n_phases; p++) {
+            sums[p] += s->sums[p].load(std::memory_order_relaxed);
+            for(std::size_t b = 0; b < n_buckets; b++) buckets[p][b] += s->buckets[p][b].load(std::memory_order_relaxed);
+        }
+    }
+
+    for(std::size_t c = 0; c < n_counters; c++) {
+        fmt::format_to(out, "# HELP {0} {1}\n# TYPE {0} counter\n{0} {2}\n", counter_names[c][0], counter_names[c][1], counters[c]);
+    }
+    auto accepted = counters[static_cast<std::size_t>(counter::connections_accepted)];
+    auto closed = counters[static_cast<std::size_t>(counter::connections_closed)];
+    fmt::format_to(out, "# HELP http_connections_active Connections currently open\n# TYPE http_connections_active gauge\n"
+                        "http_connections_active {}\n", accepted >= closed ? accepted - closed : 0);
+    for(const auto& [name, g] : r.gauges) {
+        fmt::format_to(out, "# HELP {0} {1}\n# TYPE {0} gauge\n{0} {2}\n", name, g.help, g.read());
+    }
+
+    fmt::format_to(out, "# HELP http_phase_seconds Time spent in each phase of serving a request\n# TYPE http_phase_seconds summary\n");
+    for(std::size_t p = 0; p < n_phases; p++) {
+        std::uint64_t total = 0;
+        for(std::uint64_t n : buckets[p]) total += n;
+        for(double q : quantiles) {
+            // The bucket holding the q-th value, walking up from the smallest
+            double value = 0;
+            std::uint64_t rank = static_cast<std::uint64_t>(q * total + 0.5), seen = 0;
+            for(std::size_t b = 0; b < n_buckets && total > 0; b++) {
+                seen += buckets[p][b];
+                if(seen >= std::max<std::uint64_t>(rank, 1)) {
+                    value = bucket_value(b);
+                    break;
+                }
+            }
+            fmt::format_to(out, "http_phase_seconds{{phase=\"{}\",quantile=\"{}\"}} {:.9f}\n", phase_names[p], q, value / 1e9);
+        }
+        fmt::format_to(out, "http_phase_seconds_sum{{phase=\"{}\"}} {:.9f}\n", phase_names[p], sums[p] / 1e9);
+        fmt::format_to(out, "http_phase_seconds_count{{phase=\"{}\"}} {}\n", phase_names[p], total);
+    }
+    return fmt::to_string(text);
+}
+
+void http::dump_metrics_on_sigusr1() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread([signals](){
+        while(true) {
+            int signal;
+            if(sigwait(&signals, &signal) != 0) continue;
+            std::string text = http::metrics_text();
+            std::size_t done = 0;
+            while(done < text.size()) {
+                ssize_t n = ::write(STDERR_FILENO, text.data() + done, text.size() - done);
+                if(n <= 0) break;
+                done += n;
+            }
+        }
+    }).detach();
+}
@@ -0,0 +1,85 @@
+#include <http/mime.hpp>
+#include <array>
+#include <cctype>
+#include <cstdint>
+
+namespace {
+    struct mime_entry {
+        std::string_view extension; // lowercase, without the dot
+        std::string_view type;
+    };
+
+    constexpr mime_entry mime_types[] = {
+        {"css", "text/css"},
+        {"html", "text/html"},
+        {"eot", "application/vnd.ms-fontobject"},
+        {"svg", "image/svg+xml"},
+        {"ttf", "font/ttf"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"webm", "video/webm"},
+        {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+        {"png", "image/png"},
+        {"jpeg", "image/jpeg"},
+        {"jpg", "image/jpeg"},
+        {"pdf", "application/pdf"}
+    };
+    constexpr std::size_t n_types = sizeof(mime_types) / sizeof(mime_types[0]);
+    constexpr std::size_t max_extension = 5;
+    // A power of two, with room enough that a collision-free seed turns up quickly
+    constexpr std::size_t n_slots = 32;
+
+    constexpr std::uint32_t hash(std::uint32_t seed, std::string_view s) {
+        for(char c : s) {
+            seed = (seed ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return seed;
+    }
+
+    constexpr bool perfect(std::uint32_t seed) {
+        bool taken[n_slots] = {};
+        for(const mime_entry& entry : mime_types) {
+            std::size_t slot = hash(seed, entry.extension) % n_slots;
+            if(taken[slot]) return false;
+            taken[slot] = true;
+        }
+        return true;
+    }
+
+    // The first FNV-1a offset basis, counting up, under which no two extensions share a slot
+    constexpr std::uint32_t find_seed() {
+        std::uint32_t seed = 2166136261u;
+        while(!perfect(seed)) seed++;
+        return seed;
+    }
+
+    constexpr std::uint32_t seed = find_seed();
+
+    // Index into mime_types for each slot, or -1
+    constexpr std::array<signed char, n_slots> build_slots() {
+        std::array<signed char, n_slots> slots = {};
+        for(auto& slot : slots) slot = -1;
+        for(std::size_t i = 0; i < n_types; i++) {
+            slots[hash(seed, mime_types[i].extension) % n_slots] = static_cast<signed char>(i);
+        }
+        return slots;
+    }
+
+    constexpr std::array<signed char, n_slots> slots = build_slots();
+}
+
+std::string_view http::get_content_type(std::string_view path) {
+    static const std::string_view unknown = "application/octet-stream";
+    std::size_t dot = path.rfind('.');
+    if(dot == std::string_view::npos) return unknown;
+    std::string_view extension = path.substr(dot + 1);
+    if(extension.size() > max_extension || extension.find('/') != std::string_view::npos) return unknown;
+    char lowered[max_extension];
+    for(std::size_t i = 0; i < extension.size(); i++) {
+        lowered[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(extension[i])));
+    }
+    std::string_view key{lowered, extension.size()};
+    int index = slots[hash(seed, key) % n_slots];
+    if(index >= 0 && mime_types[index].extension == key) return mime_types[index].type;
+    return unknown;
+}
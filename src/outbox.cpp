@@ -0,0 +1,96 @@
+#include <http/outbox.hpp>
+#include <http/config.hpp>
+#include <algorithm>
+#include <fmt/format.h>
+
+void http::outbox::push(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked) {
+    bool body_done = !body;
+    segments.push_back({std::string{head}, 0, std::move(body), chunked, body_done});
+}
+
+bool http::outbox::empty() {
+    while(!segments.empty() && segments.front().done()) {
+        segments.pop_front();
+    }
+    return segments.empty();
+}
+
+const http::file_body* http::outbox::front_file() const {
+    if(segments.empty()) return nullptr;
+    const segment& front = segments.front();
+    return front.bytes_done() && front.file_body() ? front.body->file() : nullptr;
+}
+
+void http::outbox::file_sent(std::size_t n) {
+    segment& front = segments.front();
+    front.body->skip(n);
+    front.body_done = front.body->size() == 0;
+}
+
+// Pulls the next piece of a segment's body into its (fully sent) bytes
+bool http::outbox::stage(segment& seg) {
+    const std::size_t chunk_size = http::settings().chunk_size;
+    seg.bytes.resize(size_line_room + chunk_size + 2);
+    std::size_t n = seg.body->read_ready(seg.bytes.data() + size_line_room, chunk_size, stalled);
+    if(n == 0 && stalled >= 0) {
+        seg.bytes.clear();
+        seg.sent = 0;
+        return false;
+    }
+    if(n == 0) {
+        seg.body_done = true;
+        seg.bytes = seg.chunked ? "0\r\n\r\n" : "";
+        seg.sent = 0;
+    } else if(seg.chunked) {
+        std::array<char, size_line_room> size_line;
+        std::size_t length = fmt::format_to_n(size_line.data(), size_line.size(), "{:x}\r\n", n).size;
+        seg.sent = size_line_room - length;
+        std::copy_n(size_line.data(), length, seg.bytes.data() + seg.sent);
+        seg.bytes.resize(size_line_room + n);
+        seg.bytes += "\r\n";
+    } else {
+        seg.sent = size_line_room;
+        seg.bytes.resize(size_line_room + n);
+    }
+    return true;
+}
+
+int http::outbox::gather(std::array<iovec, max_iov>& iov, bool& more) {
+    int count = 0;
+    more = false;
+    stalled = -1;
+    for(segment& seg : segments) {
+        if(count + 2 > max_iov) break;
+        if(seg.bytes_done() && !seg.body_done && !seg.file_body() && seg.body_in_memory().empty() && !stage(seg)) {
+            break;
+        }
+        if(!seg.bytes_done()) {
+            iov[count++] = {seg.bytes.data() + seg.sent, seg.bytes.size() - seg.sent};
+        }
+        if(seg.body_done) continue;
+        if(seg.file_body()) {
+            more = true;
+            break;
+        }
+        std::string_view in_memory = seg.body_in_memory();
+        if(in_memory.empty()) break; // the staged chunk has to drain before the next is pulled
+        iov[count++] = {const_cast<char*>(in_memory.data()), in_memory.size()};
+    }
+    return count;
+}
+
+void http::outbox::advance(std::size_t n) {
+    for(segment& seg : segments) {
+        if(n == 0) return;
+        std::size_t from_bytes = std::min(n, seg.bytes.size() - seg.sent);
+        seg.sent += from_bytes;
+        n -= from_bytes;
+        std::string_view in_memory = seg.body_in_memory();
+        if(n > 0 && !in_memory.empty()) {
+            std::size_t from_body = std::min(n, in_memory.size());
+            seg.body->skip(from_body);
+            n -= from_body;
+            seg.body_done = seg.body->size() == 0;
+        }
+    }
+}
@@ -0,0 +1,148 @@
+#include <http/parser.hpp>
+#include <http/response.hpp>
+#include <algorithm>
+#include <cstring>
+
+static const std::string_view http11 = "HTTP/1.1";
+static const std::string_view http10 = "HTTP/1.0";
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+std::string_view http::recv_buffer::data() const {
+    return {storage.data() + data_begin, data_end - data_begin};
+}
+
+char* http::recv_buffer::prepare(std::size_t min_space) {
+    if(writable() < min_space && data_begin > 0) {
+        std::memmove(storage.data(), storage.data() + data_begin, data_end - data_begin);
+        data_end -= data_begin;
+        data_begin = 0;
+    }
+    if(writable() < min_space) {
+        storage.resize(std::max(storage.size() * 2, data_end + min_space));
+    }
+    return storage.data() + data_end;
+}
+
+std::size_t http::recv_buffer::writable() const {
+    return storage.size() - data_end;
+}
+
+void http::recv_buffer::commit(std::size_t n) {
+    data_end += n;
+}
+
+void http::recv_buffer::consume(std::size_t n) {
+    data_begin += n;
+    if(data_begin == data_end) {
+        data_begin = 0;
+        data_end = 0;
+    }
+}
+
+void http::recv_buffer::erase(std::size_t offset, std::size_t n) {
+    if(n == 0) return;
+    char* at = storage.data() + data_begin + offset;
+    std::memmove(at, at + n, data_end - (data_begin + offset + n));
+    data_end -= n;
+    if(data_begin == data_end) {
+        data_begin = 0;
+        data_end = 0;
+    }
+}
+
+http::request_parser::request_parser(parse_limits limits) : limits(limits) {
+    reset();
+}
+
+void http::request_parser::reset() {
+    current = state::request_line;
+    scanned = 0;
+    searched = 0;
+    method = uri = version = {0, 0};
+    header_spans.clear();
+}
+
+void http::request_parser::parse_request_line(std::string_view input, std::size_t begin, std::size_t end) {
+    const char* line = input.data() + begin;
+    const std::size_t length = end - begin;
+    auto method_end = static_cast<const char*>(std::memchr(line, ' ', length));
+    if(!method_end || method_end == line) throw http::response{400, "Bad Request"};
+    auto uri_begin = method_end + 1;
+    auto uri_end = static_cast<const char*>(std::memchr(uri_begin, ' ', line + length - uri_begin));
+    if(!uri_end || uri_end == uri_begin) throw http::response{400, "Bad Request"};
+    auto version_begin = uri_end + 1;
+    std::string_view version_text{version_begin, static_cast<std::size_t>(line + length - version_begin)};
+    if(version_text != http11 && version_text != http10) {
+        throw http::response{505, "HTTP Version Not Supported"};
+    }
+    method = {begin, static_cast<std::size_t>(method_end - line)};
+    uri = {static_cast<std::size_t>(uri_begin - input.data()), static_cast<std::size_t>(uri_end - uri_begin)};
+    version = {static_cast<std::size_t>(version_begin - input.data()), http11.size()};
+}
+
+void http::request_parser::parse_header_line(std::string_view input, std::size_t begin, std::size_t end) {
+    if(header_spans.size() == limits.max_headers) throw http::response{431, "Request Header Fields Too Large"};
+    // Obsolete line folding, and whitespace before the colon, are both rejected outright
+    if(is_space(input[begin])) throw http::response{400, "Bad Request"};
+    auto colon = static_cast<const char*>(std::memchr(input.data() + begin, ':', end - begin));
+    if(!colon) throw http::response{400, "Bad Request"};
+    std::size_t name_end = colon - input.data();
+    if(name_end == begin || is_space(input[name_end - 1])) throw http::response{400, "Bad Request"};
+    std::size_t value_begin = name_end + 1;
+    std::size_t value_end = end;
+    while(value_begin < value_end && is_space(input[value_begin])) value_begin++;
+    while(value_end > value_begin && is_space(input[value_end - 1])) value_end--;
+    header_spans.push_back({
+        {begin, name_end - begin},
+        {value_begin, value_end - value_begin},
+        http::find_field(input.substr(begin, name_end - begin))
+    });
+}
+
+bool http::request_parser::parse(std::string_view input, request& req) {
+    while(current != state::done) {
+        // memchr is vectorised, so finding the end of each line is cheap even for long ones
+        auto newline = static_cast<const char*>(std::memchr(input.data() + searched, '\n', input.size() - searched));
+        if(!newline) {
+            searched = input.size();
+            if(input.size() - scanned > limits.max_line) {
+                if(current == state::request_line) throw http::response{414, "URI Too Long"};
+                throw http::response{431, "Request Header Fields Too Large"};
+            }
+            if(input.size() > limits.max_head) throw http::response{431, "Request Header Fields Too Large"};
+            return false;
+        }
+        std::size_t next = newline - input.data() + 1;
+        std::size_t line_end = next - 1;
+        if(line_end > scanned && input[line_end - 1] == '\r') line_end--;
+        if(line_end - scanned > limits.max_line) {
+            if(current == state::request_line) throw http::response{414, "URI Too Long"};
+            throw http::response{431, "Request Header Fields Too Large"};
+        }
+        if(next > limits.max_head) throw http::response{431, "Request Header Fields Too Large"};
+        if(current == state::request_line) {
+            // Stray blank lines before a request are ignored (RFC 7230 section 3.5)
+            if(line_end != scanned) {
+                parse_request_line(input, scanned, line_end);
+                current = state::headers;
+            }
+        } else if(line_end == scanned) {
+            current = state::done;
+        } else {
+            parse_header_line(input, scanned, line_end);
+        }
+        scanned = searched = next;
+    }
+    auto view = [&](span s) { return input.substr(s.offset, s.length); };
+    req.method = view(method);
+    req.uri = view(uri);
+    req.version = view(version);
+    req.headers.clear();
+    for(const auto& h : header_spans) {
+        req.headers.add(view(h.name), view(h.value), h.known);
+    }
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,177 @@
+#include <http/path_cache.hpp>
+#include <http/config.hpp>
+#include <http/mime.hpp>
+#include <http/log.hpp>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+// Whether path (canonical) is root or under it
+static bool within(std::string_view root, std::string_view path) {
+    return path.substr(0, root.size()) == root && (path.size() == root.size() || path[root.size()] == '/');
+}
+
+// Lexically normal paths keep a leading "..", which would climb out of the root
+static bool climbs(std::string_view path) {
+    std::size_t begin = 0;
+    while(begin <= path.size()) {
+        std::size_t end = std::min(path.find('/', begin), path.size());
+        if(path.substr(begin, end - begin) == "..") return true;
+        begin = end + 1;
+    }
+    return false;
+}
+
+// Past this many we start over
+static const std::size_t max_entries = 8192;
+
+static const std::uint32_t watched_events =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+http::path_cache::path_cache(const std::string& root_dir) : inotifyfd(::inotify_init1(IN_CLOEXEC)), epoch(0) {
+    char canonical[PATH_MAX];
+    if(!::realpath(root_dir.c_str(), canonical)) {
+        int error = errno;
+        if(inotifyfd >= 0) ::close(inotifyfd);
+        throw std::system_error(error, std::system_category(), "Document root " + root_dir);
+    }
+    root = canonical;
+    if(root == "/") root.clear();
+    if(inotifyfd < 0) {
+        HTTP_LOG(warning) << "inotify unavailable, paths will be resolved on every request: " << std::strerror(errno);
+    } else {
+        std::thread([this](){ watch_events(); }).detach();
+    }
+}
+
+// Blocks on the inotify queue, dropping the entries under each directory that reports a change
+void http::path_cache::watch_events() {
+    alignas(inotify_event) char events[4096];
+    while(true) {
+        ssize_t n = ::read(inotifyfd, events, sizeof(events));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            HTTP_LOG(error) << "Reading inotify events failed, no longer caching paths: " << std::strerror(errno);
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            epoch++;
+            entries.clear();
+            ::close(inotifyfd);
+            inotifyfd = -1;
+            return;
+        }
+        std::vector<int> changed;
+        bool overflowed = false;
+        for(ssize_t i = 0; i < n;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(events + i);
+            // An overflowed queue may have lost anything, so forget everything
+            overflowed = overflowed || (event->mask & IN_Q_OVERFLOW);
+            changed.push_back(event->wd);
+            i += sizeof(inotify_event) + event->len;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        epoch++;
+        for(auto it = entries.begin(); it != entries.end();) {
+            const std::vector<int>& wds = it->second.wds;
+            bool stale = overflowed || std::find_first_of(wds.begin(), wds.end(), changed.begin(), changed.end()) != wds.end();
+            it = stale ? entries.erase(it) : std::next(it);
+        }
+    }
+}
+
+// Watches the root and every directory named on the way down from it, each
+// where it really is once symlinks are followed. Returns nothing if one of
+// those can't be watched, or lies outside the root, since the entry then can't be kept.
+std::vector<int> http::path_cache::watch(const std::string& request_path) {
+    std::vector<int> wds;
+    int wd = ::inotify_add_watch(inotifyfd, root.empty() ? "/" : root.c_str(), watched_events | IN_ONLYDIR);
+    if(wd < 0) return {};
+    wds.push_back(wd);
+    std::string directory = root;
+    std::size_t begin = 0;
+    while(begin < request_path.size()) {
+        std::size_t end = std::min(request_path.find('/', begin), request_path.size());
+        std::string_view component = std::string_view{request_path}.substr(begin, end - begin);
+        begin = end + 1;
+        if(component.empty()) continue;
+        directory += '/';
+        directory += component;
+        char canonical[PATH_MAX];
+        if(!::realpath(directory.c_str(), canonical) || !within(root, canonical)) return {};
+        wd = ::inotify_add_watch(inotifyfd, canonical, watched_events | IN_ONLYDIR);
+        if(wd >= 0) {
+            wds.push_back(wd);
+        } else if(!(begin >= request_path.size() && errno == ENOTDIR)) {
+            return {};
+        }
+    }
+    return wds;
+}
+
+http::resolved_path http::path_cache::lookup(const std::string& request_path) const {
+    resolved_path target;
+    target.mapped = root;
+    if(request_path.empty() || request_path.front() != '/') target.mapped += '/';
+    target.mapped += request_path;
+    char canonical[PATH_MAX];
+    if(!::realpath(target.mapped.c_str(), canonical)) {
+        target.type = errno == EACCES ? resolved_path::forbidden : resolved_path::missing;
+        return target;
+    }
+    // Wherever symlinks lead, the result must still be under the root
+    if(!within(root, canonical)) {
+        target.type = resolved_path::forbidden;
+    } else if(::stat(canonical, &target.info) < 0) {
+        target.type = resolved_path::missing;
+    } else if(S_ISREG(target.info.st_mode)) {
+        target.type = resolved_path::file;
+        target.content_type = http::get_content_type(request_path);
+    } else if(S_ISDIR(target.info.st_mode)) {
+        target.type = resolved_path::directory;
+    } else {
+        target.type = resolved_path::missing;
+    }
+    return target;
+}
+
+http::path_cache::entry http::path_cache::resolve(const std::string& request_path) {
+    if(climbs(request_path)) {
+        resolved_path target;
+        target.type = resolved_path::forbidden;
+        return std::make_shared<const resolved_path>(std::move(target));
+    }
+    std::uint64_t started;
+    bool watching;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto found = entries.find(request_path);
+        if(found != entries.end()) return found->second.target;
+        started = epoch;
+        watching = inotifyfd >= 0;
+    }
+    auto target = std::make_shared<const resolved_path>(lookup(request_path));
+    if(!watching || target->type == resolved_path::missing || target->type == resolved_path::forbidden) return target;
+    std::vector<int> wds = watch(request_path);
+    if(wds.empty()) return target;
+    // Look again now the watches are in place, so changes made in between aren't missed
+    target = std::make_shared<const resolved_path>(lookup(request_path));
+    if(target->type == resolved_path::missing || target->type == resolved_path::forbidden) return target;
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if(epoch == started) {
+        if(entries.size() >= max_entries) entries.clear();
+        entries[request_path] = {std::move(wds), target};
+    }
+    return target;
+}
+
+http::path_cache& http::resolved_paths() {
+    // Leaked: the watcher thread uses it until the process exits
+    static path_cache* instance = new path_cache(http::settings().root);
+    return *instance;
+}
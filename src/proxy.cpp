@@ -0,0 +1,585 @@
+#include <http/proxy.hpp>
+#include <http/error.hpp>
+#include <http/headers.hpp>
+#include <http/log.hpp>
+#include <http/metrics.hpp>
+#include <http/request_body.hpp>
+#include <http/worker_pool.hpp>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fmt/format.h>
+
+// Big enough for any response head we are prepared to pass on
+static const std::size_t upstream_buffer_size = 64 * 1024;
+
+// Every wait on an upstream is bounded by the upstream timeout
+static bool ready_within(int fd, short events) {
+    pollfd ready = {fd, events, 0};
+    int n;
+    do {
+        n = ::poll(&ready, 1, http::settings().upstream_timeout * 1000);
+    } while(n < 0 && errno == EINTR);
+    http::check_error(n);
+    return n > 0;
+}
+
+static std::system_error upstream_timed_out() {
+    return std::system_error(ETIMEDOUT, std::generic_category(), "Upstream timed out");
+}
+
+static http::response plain_error(int code, std::string_view reason) {
+    return {code, reason, {{"Content-Type", "text/plain; charset=utf-8"}}, fmt::format("{} {}", code, reason)};
+}
+
+// What the client is told when the upstream lets it down
+static http::response gateway_error(const std::system_error& err) {
+    if(err.code().value() == ETIMEDOUT) return plain_error(504, "Gateway Timeout");
+    return plain_error(502, "Bad Gateway");
+}
+
+http::upstream_pool::upstream_pool(const std::string& host, unsigned short port)
+    : name(host.find(':') != std::string::npos ? fmt::format("[{}]:{}", host, port) : fmt::format("{}:{}", host, port)) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found;
+    int error = ::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found);
+    if(error != 0) throw std::runtime_error("Could not resolve upstream " + name + ": " + ::gai_strerror(error));
+    std::memcpy(&address, found->ai_addr, found->ai_addrlen);
+    address_length = found->ai_addrlen;
+    ::freeaddrinfo(found);
+}
+
+http::unique_fd http::upstream_pool::acquire(bool& reused) {
+    const auto now = std::chrono::steady_clock::now();
+    while(true) {
+        idle_connection candidate;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(idle.empty()) break;
+            // The most recently used, as the least likely to have been closed by the upstream
+            candidate = std::move(idle.back());
+            idle.pop_back();
+        }
+        if(now - candidate.since > std::chrono::seconds(http::settings().idle_timeout)) continue;
+        // One the upstream has closed (or sent something unasked on) reads as ready
+        char byte;
+        if(::recv(candidate.fd.get(), &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            reused = true;
+            http::count(http::counter::upstream_reuses);
+            return std::move(candidate.fd);
+        }
+    }
+    reused = false;
+    http::unique_fd fd{::socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)};
+    http::check_error(fd.get());
+    // Request heads and bodies go out in pieces, which mustn't wait on each other's ACKs
+    int one = 1;
+    ::setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(::connect(fd.get(), reinterpret_cast<const sockaddr*>(&address), address_length) < 0) {
+        if(errno != EINPROGRESS) throw std::system_error(errno, std::generic_category(), "Connecting to upstream " + name);
+        if(!ready_within(fd.get(), POLLOUT)) throw upstream_timed_out();
+        int error = 0;
+        socklen_t length = sizeof(error);
+        http::check_error(::getsockopt(fd.get(), SOL_SOCKET, SO_ERROR, &error, &length));
+        if(error != 0) throw std::system_error(error, std::generic_category(), "Connecting to upstream " + name);
+    }
+    http::count(http::counter::upstream_connects);
+    HTTP_LOG(debug) << "        connected to upstream " << name << " on fd #" << fd.get();
+    return fd;
+}
+
+void http::upstream_pool::release(http::unique_fd fd) {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(lock);
+    // The oldest are at the front, and go first when there are too many or they have idled too long
+    while(!idle.empty() && (idle.size() >= http::settings().upstream_idle
+                            || now - idle.front().since > std::chrono::seconds(http::settings().idle_timeout))) {
+        idle.erase(idle.begin());
+    }
+    if(http::settings().upstream_idle > 0) idle.push_back({std::move(fd), now});
+}
+
+namespace {
+    struct upstream_routes {
+        std::vector<std::unique_ptr<http::upstream_pool>> pools;
+        std::vector<std::pair<std::string, http::upstream_pool*>> prefixes;
+
+        // Routes to the same host and port share one pool
+        upstream_routes() {
+            std::vector<std::pair<std::string, http::upstream_pool*>> by_address;
+            for(const http::proxy_route& route : http::settings().proxies) {
+                std::string address = fmt::format("{}:{}", route.host, route.port);
+                auto same = std::find_if(by_address.begin(), by_address.end(), [&](const auto& known){ return known.first == address; });
+                if(same == by_address.end()) {
+                    pools.push_back(std::make_unique<http::upstream_pool>(route.host, route.port));
+                    same = by_address.insert(by_address.end(), {address, pools.back().get()});
+                }
+                prefixes.emplace_back(route.prefix, same->second);
+            }
+        }
+    };
+
+    // The bytes read from an upstream connection that haven't been used yet
+    struct upstream_connection {
+        http::upstream_pool* pool;
+        http::unique_fd fd;
+        std::unique_ptr<char[]> buffer{new char[upstream_buffer_size]};
+        std::size_t start = 0;
+        std::size_t end = 0;
+        // Set by a fill that wasn't to wait and found nothing yet
+        bool blocked = false;
+
+        std::string_view pending() const { return {buffer.get() + start, end - start}; }
+        void consume(std::size_t n) { start += n; }
+
+        // Reads more onto the end of what is pending. Returns false if the
+        // upstream has closed, or if there is no room left for more. Without
+        // wait, it also returns false (with blocked set) if nothing has arrived yet.
+        bool fill(bool wait = true) {
+            blocked = false;
+            if(start > 0) {
+                std::memmove(buffer.get(), buffer.get() + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            if(end == upstream_buffer_size) return false;
+            // A backend that writes a head and body separately, without TCP_NODELAY, would
+            // otherwise wait out our delayed ACK between them once a pooled connection has warmed up
+            int one = 1;
+            ::setsockopt(fd.get(), IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+            while(true) {
+                ssize_t n = ::recv(fd.get(), buffer.get() + end, upstream_buffer_size - end, 0);
+                if(n >= 0) {
+                    end += n;
+                    return n > 0;
+                }
+                if(errno == EINTR) continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK) throw std::system_error(errno, std::generic_category(), "Reading from upstream");
+                if(!wait) {
+                    blocked = true;
+                    return false;
+                }
+                if(!ready_within(fd.get(), POLLIN)) throw upstream_timed_out();
+            }
+        }
+    };
+
+    // A response body read from the upstream as the client takes it. Its
+    // connection goes back to the pool once the body has been read in full.
+    // An event loop reading it with read_ready() is given the upstream's fd to
+    // wait on instead of waiting for it here.
+    class upstream_source : public http::body_source {
+        upstream_connection connection;
+        // Without one, the body runs until the upstream closes the connection
+        std::optional<http::body_decoder> decoder;
+        bool sized; // by a Content-Length, rather than chunked
+        bool keep_alive;
+        bool finished = false;
+
+        void finish() {
+            finished = true;
+            // Anything more than the body would only confuse the next response
+            if(keep_alive && connection.pending().empty()) connection.pool->release(std::move(connection.fd));
+        }
+
+        std::size_t pull(char* out, std::size_t max, bool wait) {
+            while(!finished) {
+                if(decoder && decoder->done()) {
+                    finish();
+                    break;
+                }
+                if(connection.pending().empty() && !connection.fill(wait)) {
+                    if(connection.blocked) break;
+                    if(decoder) throw std::runtime_error("Upstream closed the connection part way through a response body");
+                    finished = true;
+                    break;
+                }
+                std::string_view data = connection.pending().substr(0, max);
+                std::size_t consumed = data.size();
+                if(decoder) {
+                    try {
+                        consumed = decoder->decode(connection.pending().substr(0, max), data);
+                    } catch (const http::response&) {
+                        throw std::runtime_error("Malformed chunked response body from upstream");
+                    }
+                }
+                std::copy(data.begin(), data.end(), out);
+                connection.consume(consumed);
+                if(!data.empty()) return data.size();
+            }
+            return 0;
+        }
+
+        public:
+        upstream_source(upstream_connection connection, std::optional<http::body_decoder> decoder, bool sized, bool keep_alive)
+            : connection(std::move(connection)), decoder(decoder), sized(sized), keep_alive(keep_alive && decoder) {}
+
+        std::size_t read(char* out, std::size_t max) override {
+            return pull(out, max, true);
+        }
+
+        std::size_t read_ready(char* out, std::size_t max, int& wait_fd) override {
+            std::size_t n = pull(out, max, false);
+            wait_fd = n == 0 && connection.blocked ? connection.fd.get() : -1;
+            return n;
+        }
+
+        std::optional<std::size_t> size() const override {
+            // With a Content-Length, what is left of the body is all there is to decode
+            if(sized) return decoder->raw_remaining();
+            return std::nullopt;
+        }
+
+        // A body that came in whole with its head (as most small ones do) is
+        // offered as if in memory, so that it goes out in one write with the head
+        std::string_view peek() const override {
+            if(!sized || finished || connection.pending().size() < decoder->raw_remaining()) return {};
+            return connection.pending().substr(0, decoder->raw_remaining());
+        }
+
+        void skip(std::size_t n) override {
+            connection.consume(n);
+            decoder->skip(n);
+            if(decoder->done()) finish();
+        }
+    };
+
+    bool idempotent(std::string_view method) {
+        for(std::string_view safe : {"GET", "HEAD", "OPTIONS", "PUT", "DELETE", "TRACE"}) {
+            if(method == safe) return true;
+        }
+        return false;
+    }
+
+    // Headers that only concern one hop, and aren't passed on in either direction.
+    // The framing ones are replaced with this hop's own.
+    bool hop_by_hop(std::string_view name, std::string_view connection) {
+        switch(http::find_field(name)) {
+            case http::field::connection:
+            case http::field::keep_alive:
+            case http::field::te:
+            case http::field::upgrade:
+            case http::field::transfer_encoding:
+            case http::field::content_length:
+                return true;
+            default:
+                break;
+        }
+        return http::iequals(name, "Proxy-Connection") || http::iequals(name, "Trailer") || http::iequals(name, "Proxy-Authenticate")
+            || http::iequals(name, "Proxy-Authorization") || http::has_token(connection, name);
+    }
+
+    // Response reasons have to be string literals, so the upstream's own is swapped for the standard one
+    std::string_view standard_reason(int code) {
+        switch(code) {
+            case 200: return "OK";
+            case 201: return "Created";
+            case 202: return "Accepted";
+            case 203: return "Non-Authoritative Information";
+            case 204: return "No Content";
+            case 205: return "Reset Content";
+            case 206: return "Partial Content";
+            case 300: return "Multiple Choices";
+            case 301: return "Moved Permanently";
+            case 302: return "Found";
+            case 303: return "See Other";
+            case 304: return "Not Modified";
+            case 307: return "Temporary Redirect";
+            case 308: return "Permanent Redirect";
+            case 400: return "Bad Request";
+            case 401: return "Unauthorized";
+            case 402: return "Payment Required";
+            case 403: return "Forbidden";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 406: return "Not Acceptable";
+            case 407: return "Proxy Authentication Required";
+            case 408: return "Request Timeout";
+            case 409: return "Conflict";
+            case 410: return "Gone";
+            case 411: return "Length Required";
+            case 412: return "Precondition Failed";
+            case 413: return "Content Too Large";
+            case 414: return "URI Too Long";
+            case 415: return "Unsupported Media Type";
+            case 416: return "Range Not Satisfiable";
+            case 417: return "Expectation Failed";
+            case 421: return "Misdirected Request";
+            case 422: return "Unprocessable Content";
+            case 425: return "Too Early";
+            case 426: return "Upgrade Required";
+            case 428: return "Precondition Required";
+            case 429: return "Too Many Requests";
+            case 431: return "Request Header Fields Too Large";
+            case 451: return "Unavailable For Legal Reasons";
+            case 500: return "Internal Server Error";
+            case 501: return "Not Implemented";
+            case 502: return "Bad Gateway";
+            case 503: return "Service Unavailable";
+            case 504: return "Gateway Timeout";
+            case 505: return "HTTP Version Not Supported";
+        }
+        switch(code / 100) {
+            case 2: return "Success";
+            case 3: return "Redirection";
+            case 4: return "Client Error";
+            default: return "Server Error";
+        }
+    }
+
+    std::string_view trimmed(std::string_view s) {
+        while(!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+        while(!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+        return s;
+    }
+
+    struct malformed_response : std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+}
+
+// Reads a response head, after any interim (1xx) ones, and makes a response of
+// it whose body is streamed from the rest of the connection
+static http::response read_response(upstream_connection& connection, bool head_request, std::optional<std::uint64_t>& content_length) {
+    while(true) {
+        std::size_t head_end;
+        while((head_end = connection.pending().find("\r\n\r\n")) == std::string_view::npos) {
+            if(connection.fill()) continue;
+            if(connection.pending().size() == upstream_buffer_size) throw malformed_response("Response head too large");
+            throw std::system_error(ECONNRESET, std::generic_category(), "Upstream closed the connection");
+        }
+        const std::string_view head = connection.pending().substr(0, head_end + 2);
+        const std::size_t status_end = head.find("\r\n");
+        const std::string_view status_line = head.substr(0, status_end);
+        // HTTP/1.x NNN reason
+        if(status_line.size() < 12 || status_line.substr(0, 7) != "HTTP/1." || status_line[8] != ' '
+           || (status_line.size() > 12 && status_line[12] != ' ')) {
+            throw malformed_response("Bad status line");
+        }
+        int code;
+        auto [code_end, error] = std::from_chars(status_line.data() + 9, status_line.data() + 12, code);
+        if(error != std::errc{} || code_end != status_line.data() + 12 || code < 100 || code > 599) throw malformed_response("Bad status code");
+        // Upgrade headers aren't passed on, so there is never a 101 to expect
+        if(code == 101) throw malformed_response("Unasked for protocol switch");
+
+        std::vector<std::pair<std::string_view, std::string_view>> fields;
+        for(std::size_t start = status_end + 2; start < head.size();) {
+            const std::size_t end = head.find("\r\n", start);
+            const std::string_view line = head.substr(start, end - start);
+            start = end + 2;
+            const std::size_t colon = line.find(':');
+            if(colon == 0 || colon == std::string_view::npos || line.front() == ' ' || line.front() == '\t'
+               || line[colon - 1] == ' ' || line[colon - 1] == '\t') {
+                throw malformed_response("Bad header line");
+            }
+            fields.emplace_back(line.substr(0, colon), trimmed(line.substr(colon + 1)));
+        }
+        connection.consume(head_end + 4);
+        if(code < 200) continue;
+
+        std::string_view connection_header, transfer_encoding;
+        std::optional<std::uint64_t> length;
+        for(const auto& [name, value] : fields) {
+            switch(http::find_field(name)) {
+                case http::field::connection:
+                    connection_header = value;
+                    break;
+                case http::field::transfer_encoding:
+                    transfer_encoding = value;
+                    break;
+                case http::field::content_length: {
+                    std::uint64_t n;
+                    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), n);
+                    if(error != std::errc{} || end != value.data() + value.size() || (length && *length != n)) {
+                        throw malformed_response("Bad Content-Length");
+                    }
+                    length = n;
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        http::response r{code, standard_reason(code)};
+        for(const auto& [name, value] : fields) {
+            if(!hop_by_hop(name, connection_header)) r.headers.add(name, value);
+        }
+        const bool keep_alive = status_line[7] == '1' ? !http::has_token(connection_header, "close")
+                                                      : http::has_token(connection_header, "keep-alive");
+        content_length = length;
+        // How the body is framed: not at all for these, then chunked, then by Content-Length, and otherwise by closing
+        std::optional<http::body_decoder> decoder;
+        bool sized = false;
+        if(head_request || code == 204 || code == 304) {
+            decoder = http::body_decoder::with_length(0);
+            sized = true;
+        } else if(!transfer_encoding.empty()) {
+            if(http::has_token(transfer_encoding, "chunked")) decoder = http::body_decoder::chunks();
+        } else if(length) {
+            decoder = http::body_decoder::with_length(*length);
+            sized = true;
+        }
+        if(sized && decoder->done()) {
+            // Nothing to stream, so the connection can go straight back
+            if(keep_alive && connection.pending().empty()) connection.pool->release(std::move(connection.fd));
+        } else {
+            r.source = std::make_shared<upstream_source>(std::move(connection), decoder, sized, keep_alive);
+        }
+        return r;
+    }
+}
+
+http::upstream_pool* http::find_upstream(std::string_view path) {
+    static const upstream_routes routes;
+    for(const auto& [prefix, pool] : routes.prefixes) {
+        if(prefix == "/") return pool;
+        if(path.substr(0, prefix.size()) != prefix) continue;
+        if(path.size() == prefix.size() || path[prefix.size()] == '/' || path[prefix.size()] == '?') return pool;
+    }
+    return nullptr;
+}
+
+namespace {
+    struct upstream_worker {
+        void operator()(http::upstream_task* task) {
+            task->run_upstream();
+        }
+    };
+}
+
+void http::post_upstream(upstream_task& task) {
+    // Leaked: tasks may still be running on it as the process exits
+    static auto* workers = new http::worker_pool<upstream_worker>(http::settings().upstream_threads);
+    workers->post_task(&task);
+}
+
+http::upstream_exchange::upstream_exchange(upstream_pool& pool, const http::request& req, std::string_view client_address)
+    : pool(pool), idempotent(::idempotent(req.method)), head_request(req.method == "HEAD"),
+      retries_left(http::settings().upstream_retries) {
+    const std::string_view connection = req.header(http::field::connection);
+    // Already checked by the session, so this only says which framing to pass on
+    const http::request_framing framing = http::body_framing(req.headers);
+    chunked = framing.type == http::request_framing::chunked;
+
+    auto out = std::back_inserter(head);
+    fmt::format_to(out, "{} {} HTTP/1.1\r\n", req.method, req.uri);
+    for(const auto& [name, value] : req.headers) {
+        if(hop_by_hop(name, connection)) continue;
+        // Expect is answered by this server; X-Forwarded-For is added to below
+        if(http::find_field(name) == http::field::expect || http::find_field(name) == http::field::x_forwarded_for) continue;
+        fmt::format_to(out, "{}: {}\r\n", name, value);
+    }
+    if(req.header(http::field::host).empty()) fmt::format_to(out, "Host: {}\r\n", pool.name);
+    const std::string_view forwarded_for = req.header(http::field::x_forwarded_for);
+    if(forwarded_for.empty()) {
+        fmt::format_to(out, "X-Forwarded-For: {}\r\n", client_address);
+    } else {
+        fmt::format_to(out, "X-Forwarded-For: {}, {}\r\n", forwarded_for, client_address);
+    }
+    if(chunked) {
+        fmt::format_to(out, "Transfer-Encoding: chunked\r\n");
+    } else if(framing.type == http::request_framing::sized) {
+        fmt::format_to(out, "Content-Length: {}\r\n", framing.length);
+    }
+    fmt::format_to(out, "\r\n");
+    start();
+}
+
+// Whether to make another attempt after the upstream failed us. A pooled
+// connection that has gone stale is always worth another try, as the pool
+// runs out of those; anything else counts against the configured retries.
+bool http::upstream_exchange::retry_after(const std::system_error& err) {
+    if(!reused) {
+        if(retries_left == 0) return false;
+        retries_left--;
+    }
+    HTTP_LOG(warning) << "Upstream " << pool.name << " failed (" << err.what() << "), trying again";
+    http::count(http::counter::upstream_retries);
+    return true;
+}
+
+void http::upstream_exchange::start() {
+    while(true) {
+        try {
+            fd = pool.acquire(reused);
+            send(head);
+            return;
+        } catch (const std::system_error& err) {
+            fd = {};
+            if(!retry_after(err)) {
+                HTTP_LOG(error) << "Upstream " << pool.name << " failed: " << err.what();
+                throw gateway_error(err);
+            }
+        }
+    }
+}
+
+void http::upstream_exchange::send(std::string_view bytes, int flags) {
+    while(!bytes.empty()) {
+        ssize_t sent = ::send(fd.get(), bytes.data(), bytes.size(), flags | MSG_NOSIGNAL);
+        if(sent >= 0) {
+            bytes.remove_prefix(sent);
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            if(!ready_within(fd.get(), POLLOUT)) throw upstream_timed_out();
+        } else if(errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "Writing to upstream");
+        }
+    }
+}
+
+void http::upstream_exchange::send_body(std::string_view data) {
+    if(data.empty()) return;
+    body_sent = true;
+    try {
+        if(chunked) {
+            std::array<char, 24> size_line;
+            // Corked, so that each chunk leaves whole despite TCP_NODELAY
+            send({size_line.data(), fmt::format_to_n(size_line.data(), size_line.size(), "{:x}\r\n", data.size()).size}, MSG_MORE);
+            send(data, MSG_MORE);
+            send("\r\n");
+        } else {
+            send(data);
+        }
+    } catch (const std::system_error& err) {
+        HTTP_LOG(error) << "Upstream " << pool.name << " failed: " << err.what();
+        throw gateway_error(err);
+    }
+}
+
+http::response http::upstream_exchange::response() {
+    while(true) {
+        try {
+            if(chunked) send("0\r\n\r\n");
+            upstream_connection connection{&pool, std::move(fd)};
+            try {
+                return read_response(connection, head_request, declared_length);
+            } catch (const std::system_error& err) {
+                // Closed (or reset) without a word: a pooled connection the upstream
+                // gave up on just as the request went out. Only a request that can be
+                // sent again, and that is safe to send twice, gets another go.
+                const bool unanswered = connection.start == 0 && connection.end == 0 && err.code().value() != ETIMEDOUT;
+                if(!unanswered || !reused || !idempotent || body_sent || !retry_after(err)) throw;
+            }
+            start();
+        } catch (const std::system_error& err) {
+            HTTP_LOG(error) << "Upstream " << pool.name << " failed: " << err.what();
+            throw gateway_error(err);
+        } catch (const malformed_response& err) {
+            HTTP_LOG(error) << "Upstream " << pool.name << " sent a malformed response: " << err.what();
+            throw plain_error(502, "Bad Gateway");
+        }
+    }
+}
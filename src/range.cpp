@@ -0,0 +1,132 @@
+#include <http/range.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <ctime>
+#include <fmt/format.h>
+
+static std::string_view trim(std::string_view s) {
+    while(!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while(!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+static std::optional<std::size_t> parse_offset(std::string_view digits) {
+    std::size_t value;
+    if(digits.empty()) return std::nullopt;
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    if(error != std::errc{} || end != digits.data() + digits.size()) return std::nullopt;
+    return value;
+}
+
+std::optional<std::vector<http::byte_range>> http::parse_range(std::string_view header, std::size_t size) {
+    static const std::string_view unit = "bytes=";
+    if(header.size() < unit.size() || !std::equal(unit.begin(), unit.end(), header.begin(), [](char a, char b){
+        return a == std::tolower(static_cast<unsigned char>(b));
+    })) {
+        return std::nullopt;
+    }
+    header.remove_prefix(unit.size());
+
+    std::vector<byte_range> ranges;
+    bool any = false;
+    while(!header.empty()) {
+        std::size_t comma = header.find(',');
+        std::string_view spec = trim(header.substr(0, comma));
+        header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
+        if(spec.empty()) continue;
+        any = true;
+        std::size_t dash = spec.find('-');
+        if(dash == std::string_view::npos) return std::nullopt;
+        std::string_view first_digits = spec.substr(0, dash);
+        std::string_view last_digits = spec.substr(dash + 1);
+        if(first_digits.empty()) {
+            // Suffix: the final n bytes
+            auto suffix = parse_offset(last_digits);
+            if(!suffix) return std::nullopt;
+            if(*suffix > 0 && size > 0) {
+                ranges.push_back({size - std::min(*suffix, size), size - 1});
+            }
+            continue;
+        }
+        auto first = parse_offset(first_digits);
+        if(!first) return std::nullopt;
+        std::size_t last = size - 1;
+        if(!last_digits.empty()) {
+            auto given = parse_offset(last_digits);
+            if(!given || *given < *first) return std::nullopt;
+            last = std::min(last, *given);
+        }
+        if(*first < size) {
+            ranges.push_back({*first, last});
+        }
+    }
+    if(!any) return std::nullopt;
+
+    std::sort(ranges.begin(), ranges.end(), [](const byte_range& lhs, const byte_range& rhs){
+        return lhs.first < rhs.first;
+    });
+    std::vector<byte_range> merged;
+    for(const byte_range& range : ranges) {
+        if(!merged.empty() && range.first <= merged.back().last + 1) {
+            merged.back().last = std::max(merged.back().last, range.last);
+        } else {
+            merged.push_back(range);
+        }
+    }
+    return merged;
+}
+
+static std::shared_ptr<http::body_source> range_source(const http::file_body& whole, const http::byte_range& range) {
+    return http::file_source({whole.fd, whole.offset + static_cast<off_t>(range.first), range.length()});
+}
+
+http::response http::serve_ranges(const std::string& content_type, const http::file_body& whole, const std::vector<byte_range>& ranges) {
+    const std::size_t size = whole.length;
+    if(ranges.size() == 1) {
+        const byte_range& range = ranges.front();
+        return {
+            206, "Partial Content",
+            {
+                {"Content-Type", content_type},
+                {"Content-Range", fmt::format("bytes {}-{}/{}", range.first, range.last, size)},
+                {"Accept-Ranges", "bytes"}
+            },
+            {},
+            range_source(whole, range)
+        };
+    }
+    static std::atomic<std::uint64_t> next_boundary{static_cast<std::uint64_t>(std::time(nullptr)) << 20};
+    const std::string boundary = fmt::format("comp4621-{:016x}", next_boundary++);
+    std::vector<std::shared_ptr<body_source>> parts;
+    for(const byte_range& range : ranges) {
+        parts.push_back(http::memory_source(fmt::format(
+            "\r\n--{}\r\nContent-Type: {}\r\nContent-Range: bytes {}-{}/{}\r\n\r\n",
+            boundary, content_type, range.first, range.last, size
+        )));
+        parts.push_back(range_source(whole, range));
+    }
+    parts.push_back(http::memory_source(fmt::format("\r\n--{}--\r\n", boundary)));
+    return {
+        206, "Partial Content",
+        {
+            {"Content-Type", "multipart/byteranges; boundary=" + boundary},
+            {"Accept-Ranges", "bytes"}
+        },
+        {},
+        http::concat_source(std::move(parts))
+    };
+}
+
+http::response http::serve_416(std::size_t size) {
+    return {
+        416, "Range Not Satisfiable",
+        {
+            {"Content-Type", "text/plain; charset=utf-8"},
+            {"Content-Range", fmt::format("bytes */{}", size)}
+        },
+        "416 Range Not Satisfiable"
+    };
+}
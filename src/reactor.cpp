@@ -0,0 +1,425 @@
+#include <http/reactor.hpp>
+#include <http/session.hpp>
+#include <http/outbox.hpp>
+#include <http/error.hpp>
+#include <http/config.hpp>
+#include <http/admission.hpp>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <array>
+#include <string>
+#include <string_view>
+#include <http/log.hpp>
+#include <http/metrics.hpp>
+#include <fmt/format.h>
+
+static const std::size_t recv_chunk_size = 16 * 1024;
+
+// A non-blocking connection. Bytes are gathered in the session's buffer until
+// a whole request head has arrived, which is then served by the ordinary
+// session logic; a body that follows is read by the session as it arrives.
+// Responses are queued in the outbox and written out as the socket becomes
+// writable. Its deadline sits in the reactor's timer wheel. A request that is
+// forwarded upstream is served on an upstream worker instead, as far as the
+// response head, and the connection then comes back to the reactor, which
+// writes the response as the upstream's body arrives.
+class http::connection : public http::session, public http::connection_timer, public http::upstream_task {
+    http::reactor& owner;
+    http::outbox queued;
+    bool closing = false;
+    bool progressed = false;
+    // The next request goes upstream, once everything before it has been sent
+    bool handing_off = false;
+
+    protected:
+    // Requests are only served once fully buffered, so there is never anything more to wait for
+    std::size_t recv_some(char*, std::size_t) override {
+        return 0;
+    }
+
+    void send_message(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked) override {
+        queued.push(head, std::move(body), chunked);
+    }
+
+    bool recv_body() override {
+        return pull_body(blocking_io);
+    }
+
+    public:
+    // Only touched by the reactor thread
+    bool out = false;
+    // The upstream fd the last flush found the response waiting on, and the one the reactor watches
+    int waiting_on = -1;
+    int watched_upstream = -1;
+
+    connection(int fd, http::reactor& owner) : owner(owner) {
+        attach(fd);
+    }
+
+    int fd() const {
+        return sockfd;
+    }
+
+    // Serves every complete request sitting in the buffer, up to one that goes upstream.
+    void serve_buffered() {
+        while(!closing && !handing_off && request_buffered()) {
+            if(!body_pending() && bound_upstream()) {
+                handing_off = true;
+                return;
+            }
+            closing = !serve_one();
+            if(body_pending()) return; // until more of it arrives
+            head_finished();
+        }
+    }
+
+    // Gives up on a request head or body that is taking too long, with a 408 if the outbox is clear
+    void time_out_head() {
+        if(queued.empty() && !closing) time_out();
+        closing = true;
+    }
+
+    // Moves the deadline on to whatever the connection now waits for
+    void rearm(http::timer_wheel& timers) {
+        update(timers, http::timer_wheel::clock::now(), !buffer.data().empty(), body_pending(), !queued.empty(), progressed || body_progress);
+        progressed = false;
+        body_progress = false;
+    }
+
+    // Alternates reading, serving and writing until the socket would block.
+    // Reading stops while the socket can't take our responses, so a client
+    // that pipelines without reading can't make us buffer without bound; we
+    // carry on once it becomes writable again. Returns false if the connection failed.
+    bool pump() {
+        while(true) {
+            if(!flush()) return false;
+            if(closing || !queued.empty() || handing_off) return true;
+            if(body_pending()) {
+                // The session reads the rest itself, splicing uploads straight into their files
+                serve_buffered();
+                if(body_pending()) return true;
+                continue;
+            }
+            char* space = buffer.prepare(recv_chunk_size);
+            ssize_t n = ::recv(sockfd, space, buffer.writable(), 0);
+            if(n > 0) {
+                http::count(http::counter::bytes_received, n);
+                buffer.commit(n);
+                serve_buffered();
+            } else if(n == 0) {
+                // Peer half-closed: answer what we already have, then hang up. A request
+                // going upstream is answered first, and the next recv sees the close again.
+                serve_buffered();
+                if(!handing_off) closing = true;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if(errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // Writes as much of the outbox as the socket accepts. Returns false if the connection failed.
+    bool flush() {
+        std::array<iovec, http::outbox::max_iov> iov;
+        waiting_on = -1;
+        while(!queued.empty()) {
+            ssize_t n;
+            if(const http::file_body* file = queued.front_file()) {
+                off_t offset = file->offset;
+                n = file->length > 0 ? ::sendfile(sockfd, file->fd->get(), &offset, file->length) : 0;
+                if(n == 0 && file->length > 0) return false;
+                if(n >= 0) queued.file_sent(n);
+            } else {
+                bool more;
+                msghdr message = {};
+                message.msg_iov = iov.data();
+                try {
+                    message.msg_iovlen = queued.gather(iov, more);
+                } catch (const std::exception& err) {
+                    // A body that fails part way (an upstream gone, say) can only be cut off
+                    HTTP_LOG(error) << "fd #" << sockfd << " response body failed: " << err.what();
+                    return false;
+                }
+                if(message.msg_iovlen == 0) {
+                    // Nothing more until the upstream sends it
+                    waiting_on = queued.stalled_on();
+                    if(waiting_on >= 0) return true;
+                    continue;
+                }
+                // Corked when a file follows, to share a segment with its start
+                n = ::sendmsg(sockfd, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+                if(n >= 0) queued.advance(n);
+            }
+            if(n > 0) {
+                http::count(http::counter::bytes_sent, n);
+                progressed = true;
+            }
+            if(n < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                if(errno != EINTR) return false;
+            }
+        }
+        return true;
+    }
+
+    bool finished() {
+        return closing && queued.empty();
+    }
+
+    bool ready_for_upstream() {
+        return handing_off && queued.empty();
+    }
+
+    void run_upstream() override {
+        closing = !serve_upstream_bound();
+        handing_off = false;
+        head_finished();
+        owner.take_back(*this);
+    }
+};
+
+http::reactor::reactor(int listenfd) : epollfd(::epoll_create1(EPOLL_CLOEXEC)), wakefd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), listenfd(listenfd), stopping(false) {
+    http::check_error(epollfd);
+    http::check_error(wakefd);
+    epoll_event wake_event = {};
+    wake_event.events = EPOLLIN;
+    wake_event.data.fd = wakefd;
+    http::check_error(::epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &wake_event));
+    if(listenfd >= 0) {
+        epoll_event listen_event = {};
+        listen_event.events = EPOLLIN;
+        listen_event.data.fd = listenfd;
+        http::check_error(::epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &listen_event));
+    }
+    thread = std::thread([this](){ run(); });
+}
+
+http::reactor::~reactor() {
+    stopping.store(true);
+    std::uint64_t one = 1;
+    ::write(wakefd, &one, sizeof(one));
+    thread.join();
+    {
+        // Connections out on an upstream worker still come back here
+        std::unique_lock<std::mutex> lock(incoming_mutex);
+        all_returned.wait(lock, [this](){ return returned.size() == out_on_workers; });
+    }
+    for(auto& [fd, conn] : connections) {
+        ::close(fd);
+    }
+    ::close(wakefd);
+    ::close(epollfd);
+}
+
+void http::reactor::adopt(int clientfd) {
+    {
+        std::lock_guard<std::mutex> lock(incoming_mutex);
+        incoming.push_back(clientfd);
+    }
+    std::uint64_t one = 1;
+    http::check_error(::write(wakefd, &one, sizeof(one)));
+}
+
+void http::reactor::take_back(connection& conn) {
+    {
+        std::lock_guard<std::mutex> lock(incoming_mutex);
+        returned.push_back(&conn);
+    }
+    all_returned.notify_all();
+    std::uint64_t one = 1;
+    http::check_error(::write(wakefd, &one, sizeof(one)));
+}
+
+void http::reactor::pin_to_cpu(unsigned cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if(error != 0) {
+        HTTP_LOG(warning) << "Could not pin event loop to CPU " << cpu << ": " << std::strerror(error);
+    }
+}
+
+void http::reactor::watch(int fd) {
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    if(::epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        HTTP_LOG(error) << "Could not watch fd #" << fd << ": " << std::strerror(errno);
+        ::close(fd);
+        http::count(http::counter::connections_closed);
+        http::release_connection();
+        return;
+    }
+    auto conn = std::make_unique<connection>(fd, *this);
+    conn->rearm(timers);
+    connections.emplace(fd, std::move(conn));
+}
+
+void http::reactor::adopt_incoming() {
+    std::uint64_t count;
+    while(::read(wakefd, &count, sizeof(count)) > 0);
+    std::vector<int> fds;
+    std::vector<connection*> back;
+    {
+        std::lock_guard<std::mutex> lock(incoming_mutex);
+        fds.swap(incoming);
+        back.swap(returned);
+    }
+    for(int fd : fds) {
+        watch(fd);
+    }
+    for(connection* conn : back) {
+        out_on_workers--;
+        conn->out = false;
+        // Whatever was pipelined behind it is already buffered; edges that came
+        // while it was away are lost, so carry on as if it were both readable and writable
+        conn->serve_buffered();
+        on_event(*conn, EPOLLIN | EPOLLOUT);
+    }
+}
+
+void http::reactor::accept_incoming() {
+    while(true) {
+        sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int clientfd = ::accept4(listenfd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientfd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAIN once the queue is drained; anything else (EMFILE, ENOBUFS...) waits for the next wakeup
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                HTTP_LOG(error) << "accept failed: " << std::strerror(errno);
+            }
+            return;
+        }
+        if(!http::admit_connection()) {
+            http::turn_away(clientfd);
+            continue;
+        }
+        HTTP_LOG(debug) << "        accepted fd #" << clientfd;
+        http::count(http::counter::connections_accepted);
+        watch(clientfd);
+        // Serve straight away: with TCP_DEFER_ACCEPT the request is usually already here
+        auto it = connections.find(clientfd);
+        if(it != connections.end()) {
+            on_event(*it->second, EPOLLIN);
+        }
+    }
+}
+
+void http::reactor::on_event(connection& conn, unsigned events) {
+    if(conn.out) return;
+    if((events & EPOLLERR) || !conn.pump() || conn.finished()) {
+        close(conn);
+        return;
+    }
+    if(!watch_upstream(conn, conn.waiting_on)) return;
+    if(conn.ready_for_upstream()) {
+        hand_off(conn);
+        return;
+    }
+    conn.rearm(timers);
+}
+
+bool http::reactor::watch_upstream(connection& conn, int fd) {
+    if(conn.watched_upstream == fd) return true;
+    if(conn.watched_upstream >= 0) {
+        // It may already have gone back to the pool, or been closed
+        ::epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.watched_upstream, nullptr);
+        upstreams.erase(conn.watched_upstream);
+        conn.watched_upstream = -1;
+    }
+    if(fd < 0) return true;
+    // Level-triggered: the body is read until it would block before the loop waits again
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(::epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        HTTP_LOG(error) << "Could not watch upstream fd #" << fd << " for fd #" << conn.fd() << ": " << std::strerror(errno);
+        close(conn);
+        return false;
+    }
+    upstreams.emplace(fd, &conn);
+    conn.watched_upstream = fd;
+    return true;
+}
+
+void http::reactor::hand_off(connection& conn) {
+    timers.cancel(conn);
+    conn.out = true;
+    out_on_workers++;
+    http::post_upstream(conn);
+}
+
+void http::reactor::expire(connection& conn) {
+    http::count(http::counter::timeouts);
+    HTTP_LOG(debug) << "        fd #" << conn.fd() << " timed out";
+    if(conn.waiting_for() == http::connection_timer::header || conn.waiting_for() == http::connection_timer::body) {
+        // Tell the client why, if the socket will take it
+        conn.time_out_head();
+        if(conn.pump() && !conn.finished()) {
+            if(watch_upstream(conn, conn.waiting_on)) conn.rearm(timers);
+            return;
+        }
+    }
+    close(conn);
+}
+
+void http::reactor::close(connection& conn) {
+    watch_upstream(conn, -1);
+    int fd = conn.fd();
+    ::shutdown(fd, SHUT_RDWR);
+    ::close(fd);
+    connections.erase(fd);
+    http::count(http::counter::connections_closed);
+    http::release_connection();
+    HTTP_LOG(debug) << "        closed fd #" << fd;
+}
+
+void http::reactor::run() {
+    std::array<epoll_event, 256> events;
+    while(!stopping.load()) {
+        int timeout = -1;
+        if(auto wait = timers.until_next(http::timer_wheel::clock::now())) {
+            timeout = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(*wait).count());
+        }
+        int n = ::epoll_wait(epollfd, events.data(), events.size(), timeout);
+        if(n < 0 && errno == EINTR) continue;
+        http::check_error(n);
+        for(int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if(fd == wakefd) {
+                adopt_incoming();
+                continue;
+            }
+            if(fd == listenfd) {
+                accept_incoming();
+                continue;
+            }
+            // More of a response body has come from upstream
+            if(auto up = upstreams.find(fd); up != upstreams.end()) {
+                on_event(*up->second, 0);
+                continue;
+            }
+            auto it = connections.find(fd);
+            if(it != connections.end()) {
+                on_event(*it->second, events[i].events);
+            }
+        }
+        timers.advance(http::timer_wheel::clock::now(), [this](http::timer_wheel::timer& t){
+            expire(static_cast<connection&>(static_cast<http::connection_timer&>(t)));
+        });
+    }
+}
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include <http/request_body.hpp>
+#include <http/error.hpp>
+#include <http/response.hpp>
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Chunk extensions are skipped, but not without bound; likewise trailers
+static const std::size_t max_size_line = 4 * 1024;
+static const std::size_t max_trailers = 8 * 1024;
+
+static int hex_digit(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+http::body_decoder::body_decoder(state initial, bool chunked, std::uint64_t remaining)
+    : current(initial), chunked(chunked), remaining(remaining) {}
+
+http::body_decoder http::body_decoder::with_length(std::uint64_t length) {
+    return {length > 0 ? state::data : state::done, false, length};
+}
+
+http::body_decoder http::body_decoder::chunks() {
+    return {state::size, true, 0};
+}
+
+void http::body_decoder::data_consumed(std::uint64_t n) {
+    remaining -= n;
+    total += n;
+    if(remaining == 0) current = chunked ? state::data_end : state::done;
+}
+
+void http::body_decoder::skip(std::uint64_t n) {
+    data_consumed(std::min(n, raw_remaining()));
+}
+
+std::size_t http::body_decoder::decode(std::string_view input, std::string_view& data) {
+    data = {};
+    std::size_t pos = 0;
+    while(pos < input.size() && current != state::done) {
+        const char c = input[pos];
+        switch(current) {
+        case state::data: {
+            std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(remaining, input.size() - pos));
+            data = input.substr(pos, n);
+            data_consumed(n);
+            return pos + n;
+        }
+        case state::size:
+            if(int digit = hex_digit(c); digit >= 0) {
+                if(++size_digits > 15) throw http::response{413, "Content Too Large"};
+                remaining = remaining * 16 + digit;
+                pos++;
+            } else if(size_digits == 0) {
+                throw http::response{400, "Bad Request"};
+            } else {
+                current = state::size_line;
+                line_length = 0;
+            }
+            break;
+        case state::size_line:
+            // Whatever follows the size, up to the end of the line, is extensions
+            pos++;
+            if(c == '\n') {
+                size_digits = 0;
+                current = remaining > 0 ? state::data : state::trailers;
+                line_length = 0;
+            } else if(++line_length > max_size_line) {
+                throw http::response{400, "Bad Request"};
+            }
+            break;
+        case state::data_end:
+            pos++;
+            if(c == '\n') {
+                current = state::size;
+            } else if(c != '\r') {
+                throw http::response{400, "Bad Request"};
+            }
+            break;
+        case state::trailers:
+            // Skipped line by line, until an empty one
+            pos++;
+            if(++trailer_bytes > max_trailers) throw http::response{431, "Request Header Fields Too Large"};
+            if(c == '\n') {
+                if(line_length == 0) current = state::done;
+                line_length = 0;
+            } else if(c != '\r') {
+                line_length++;
+            }
+            break;
+        case state::done:
+            break;
+        }
+    }
+    return pos;
+}
+
+http::request_framing http::body_framing(const http::request_headers& headers) {
+    request_framing framing;
+    std::size_t codings = 0;
+    std::size_t chunked = 0;
+    bool chunked_last = false;
+    bool sized = false;
+    for(auto [name, value] : headers) {
+        const http::field known = http::find_field(name);
+        std::string_view element;
+        if(known == http::field::transfer_encoding) {
+            while(http::next_element(value, element)) {
+                if(element.empty()) continue;
+                codings++;
+                chunked_last = http::iequals(element, "chunked");
+                if(chunked_last) chunked++;
+            }
+        } else if(known == http::field::content_length) {
+            // Repeats are only tolerable when they all say the same
+            while(http::next_element(value, element)) {
+                if(element.empty()) continue;
+                std::uint64_t length;
+                auto [end, error] = std::from_chars(element.data(), element.data() + element.size(), length);
+                if(error != std::errc{} || end != element.data() + element.size()) throw http::response{400, "Bad Request"};
+                if(sized && length != framing.length) throw http::response{400, "Bad Request"};
+                framing.length = length;
+                sized = true;
+            }
+            if(!sized) throw http::response{400, "Bad Request"};
+        }
+    }
+    if(codings > 0) {
+        // Framed both ways is how requests get smuggled past proxies, and without
+        // chunked last (once) there is no telling where the body ends
+        if(sized || !chunked_last || chunked > 1) throw http::response{400, "Bad Request"};
+        framing.type = codings == 1 ? request_framing::chunked : request_framing::unsupported;
+    } else if(sized) {
+        framing.type = request_framing::sized;
+    }
+    return framing;
+}
+
+http::upload_file::upload_file(std::string target) : target(std::move(target)) {
+    std::size_t slash = this->target.rfind('/') + 1;
+    temporary = this->target.substr(0, slash) + "." + this->target.substr(slash) + ".upload-XXXXXX";
+    std::vector<char> name(temporary.begin(), temporary.end());
+    name.push_back('\0');
+    fd = http::unique_fd{::mkostemp(name.data(), O_CLOEXEC)};
+    http::check_error(fd.get());
+    temporary.assign(name.data());
+    // mkostemp makes it private to us, but it is going to be served
+    ::fchmod(fd.get(), 0644);
+}
+
+http::upload_file::~upload_file() {
+    if(!committed) ::unlink(temporary.c_str());
+}
+
+void http::upload_file::write(std::string_view bytes) {
+    while(!bytes.empty()) {
+        ssize_t n = ::write(fd.get(), bytes.data(), bytes.size());
+        if(n < 0 && errno == EINTR) continue;
+        http::check_error(n);
+        bytes.remove_prefix(n);
+    }
+}
+
+bool http::upload_file::commit() {
+    struct stat existing;
+    bool replaced = ::stat(target.c_str(), &existing) == 0;
+    http::check_error(::rename(temporary.c_str(), target.c_str()));
+    committed = true;
+    return replaced;
+}
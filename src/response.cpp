@@ -0,0 +1,169 @@
+#include <http/response.hpp>
+#include <http/error.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+    class memory_source : public http::body_source {
+        std::string owned;
+        std::shared_ptr<const std::string> shared;
+        std::string_view bytes;
+        std::size_t position = 0;
+
+        public:
+        explicit memory_source(std::string bytes) : owned(std::move(bytes)), bytes(owned) {}
+        memory_source(std::shared_ptr<const std::string> bytes, std::size_t from) : shared(std::move(bytes)), bytes(std::string_view{*shared}.substr(from)) {}
+        explicit memory_source(std::string_view bytes) : bytes(bytes) {}
+
+        std::size_t read(char* out, std::size_t max) override {
+            std::size_t n = std::min(max, bytes.size() - position);
+            std::memcpy(out, bytes.data() + position, n);
+            position += n;
+            return n;
+        }
+
+        std::optional<std::size_t> size() const override {
+            return bytes.size() - position;
+        }
+
+        std::string_view peek() const override {
+            return bytes.substr(position);
+        }
+
+        void skip(std::size_t n) override {
+            position += std::min(n, bytes.size() - position);
+        }
+    };
+
+    class file_source : public http::body_source {
+        http::file_body remaining;
+
+        public:
+        explicit file_source(http::file_body file) : remaining(std::move(file)) {}
+
+        std::size_t read(char* out, std::size_t max) override {
+            std::size_t want = std::min(max, remaining.length);
+            if(want == 0) return 0;
+            ssize_t n = ::pread(remaining.fd->get(), out, want, remaining.offset);
+            http::check_error(n);
+            if(n == 0) throw std::runtime_error("File truncated while reading");
+            remaining.offset += n;
+            remaining.length -= n;
+            return n;
+        }
+
+        std::optional<std::size_t> size() const override {
+            return remaining.length;
+        }
+
+        const http::file_body* file() const override {
+            return &remaining;
+        }
+
+        void skip(std::size_t n) override {
+            n = std::min(n, remaining.length);
+            remaining.offset += n;
+            remaining.length -= n;
+        }
+    };
+
+    class generator_source : public http::body_source {
+        std::function<std::string()> next;
+        std::string piece;
+        std::size_t position = 0;
+
+        public:
+        explicit generator_source(std::function<std::string()> next) : next(std::move(next)) {}
+
+        std::size_t read(char* out, std::size_t max) override {
+            if(position == piece.size()) {
+                piece = next();
+                position = 0;
+            }
+            std::size_t n = std::min(max, piece.size() - position);
+            std::memcpy(out, piece.data() + position, n);
+            position += n;
+            return n;
+        }
+    };
+
+    class concat_source : public http::body_source {
+        std::vector<std::shared_ptr<http::body_source>> parts;
+        std::size_t current = 0;
+
+        public:
+        explicit concat_source(std::vector<std::shared_ptr<http::body_source>> parts) : parts(std::move(parts)) {}
+
+        std::size_t read(char* out, std::size_t max) override {
+            for(; current < parts.size(); current++) {
+                if(std::size_t n = parts[current]->read(out, max)) return n;
+            }
+            return 0;
+        }
+
+        std::optional<std::size_t> size() const override {
+            std::size_t total = 0;
+            for(std::size_t i = current; i < parts.size(); i++) {
+                auto part = parts[i]->size();
+                if(!part) return std::nullopt;
+                total += *part;
+            }
+            return total;
+        }
+    };
+}
+
+std::shared_ptr<http::body_source> http::memory_source(std::string bytes) {
+    return std::make_shared<::memory_source>(std::move(bytes));
+}
+
+std::shared_ptr<http::body_source> http::memory_source(std::shared_ptr<const std::string> bytes, std::size_t from) {
+    return std::make_shared<::memory_source>(std::move(bytes), from);
+}
+
+std::shared_ptr<http::body_source> http::view_source(std::string_view bytes) {
+    return std::make_shared<::memory_source>(bytes);
+}
+
+std::shared_ptr<http::body_source> http::file_source(http::file_body file) {
+    return std::make_shared<::file_source>(std::move(file));
+}
+
+std::shared_ptr<http::body_source> http::generator_source(std::function<std::string()> next) {
+    return std::make_shared<::generator_source>(std::move(next));
+}
+
+std::shared_ptr<http::body_source> http::concat_source(std::vector<std::shared_ptr<body_source>> parts) {
+    return std::make_shared<::concat_source>(std::move(parts));
+}
+
+std::shared_ptr<http::body_source> http::take_body(http::response& r) {
+    if(!r.source) {
+        r.source = http::memory_source(std::move(r.body));
+        r.body.clear();
+    }
+    return r.source;
+}
+
+static thread_local std::pmr::memory_resource* current_memory = nullptr;
+
+std::pmr::memory_resource* http::response_memory() {
+    return current_memory ? current_memory : std::pmr::new_delete_resource();
+}
+
+http::arena_scope::arena_scope(std::pmr::monotonic_buffer_resource& arena) : arena(arena), previous(current_memory) {
+    current_memory = &arena;
+}
+
+http::arena_scope::~arena_scope() {
+    current_memory = previous;
+    arena.release();
+}
+
+http::response::response(int code, std::string_view reason,
+                         std::initializer_list<std::pair<std::string_view, std::string_view>> headers,
+                         std::string body, std::shared_ptr<body_source> source)
+    : code(code), reason(reason), headers(headers, http::response_memory()), body(std::move(body)), source(std::move(source)) {}
@@ -0,0 +1,96 @@
+#include <http/response_cache.hpp>
+#include <functional>
+
+// Small enough to hold the site's HTML, CSS and icons; large files use sendfile instead
+static const std::size_t default_capacity = 64 * 1024 * 1024;
+static const std::size_t default_max_entry = 256 * 1024;
+
+bool http::response_cache::validator::operator==(const validator& other) const {
+    return inode == other.inode
+        && size == other.size
+        && mtime.tv_sec == other.mtime.tv_sec
+        && mtime.tv_nsec == other.mtime.tv_nsec;
+}
+
+http::response_cache::response_cache(std::size_t capacity, std::size_t max_entry_size, std::size_t n_shards) :
+    shards(n_shards),
+    shard_capacity(capacity / n_shards),
+    max_entry(max_entry_size),
+    hits(0), misses(0), evictions(0) {
+}
+
+std::string http::response_cache::make_key(std::string_view path, std::string_view encoding) {
+    std::string key;
+    key.reserve(path.size() + 1 + encoding.size());
+    key.append(path).append(1, '\0').append(encoding);
+    return key;
+}
+
+http::response_cache::validator http::response_cache::make_validator(const struct stat& info) {
+    return {info.st_ino, info.st_size, info.st_mtim};
+}
+
+http::response_cache::shard& http::response_cache::shard_for(const std::string& key) {
+    return shards[std::hash<std::string>{}(key) % shards.size()];
+}
+
+void http::response_cache::erase(shard& s, std::list<node>::iterator it) {
+    s.bytes -= it->bytes->size();
+    s.index.erase(it->key);
+    s.lru.erase(it);
+}
+
+http::response_cache::entry http::response_cache::find(std::string_view path, std::string_view encoding, const struct stat& info) {
+    // Built in a scratch string that each thread reuses, so hits don't allocate
+    static thread_local std::string key;
+    key.assign(path).append(1, '\0').append(encoding);
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto found = s.index.find(key);
+    if(found == s.index.end()) {
+        misses++;
+        return nullptr;
+    }
+    if(!(found->second->valid == make_validator(info))) {
+        // The file changed underneath us
+        erase(s, found->second);
+        misses++;
+        return nullptr;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, found->second);
+    hits++;
+    return found->second->bytes;
+}
+
+void http::response_cache::insert(std::string_view path, std::string_view encoding, const struct stat& info, entry serialized) {
+    if(serialized->size() > max_entry || serialized->size() > shard_capacity) return;
+    std::string key = make_key(path, encoding);
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto found = s.index.find(key);
+    if(found != s.index.end()) {
+        erase(s, found->second);
+    }
+    while(s.bytes + serialized->size() > shard_capacity && !s.lru.empty()) {
+        erase(s, std::prev(s.lru.end()));
+        evictions++;
+    }
+    s.bytes += serialized->size();
+    s.lru.push_front({std::move(key), make_validator(info), std::move(serialized)});
+    s.index.emplace(s.lru.front().key, s.lru.begin());
+}
+
+http::response_cache::stats http::response_cache::counters() {
+    stats result = {hits.load(), misses.load(), evictions.load(), 0, 0};
+    for(auto& s : shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        result.entries += s.lru.size();
+        result.bytes += s.bytes;
+    }
+    return result;
+}
+
+http::response_cache& http::file_cache() {
+    static response_cache cache{default_capacity, default_max_entry};
+    return cache;
+}
\ No newline at end of file
@@ -2,43 +2,148 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
-#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <thread>
+#include <http/log.hpp>
+#include <http/metrics.hpp>
 #include <http/error.hpp>
+#include <http/admission.hpp>
 
-http::server::server(short port, int n_threads) : sockfd(::socket(AF_INET, SOCK_STREAM, 0)), workers(n_threads) {
-    http::check_error(sockfd);
-    int enable_reuse = 1;
-    http::check_error(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable_reuse, sizeof(enable_reuse)));
+static int open_listener(short port, bool shared, bool non_blocking) {
+    const http::config& config = http::settings();
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (non_blocking ? SOCK_NONBLOCK : 0), 0);
+    http::check_error(fd);
+    int enable = 1;
+    http::check_error(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)));
+    if(shared) {
+        http::check_error(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)));
+    }
+    if(config.defer_accept > 0) {
+        http::check_error(setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept)));
+    }
     const sockaddr_in listen_address = {
         AF_INET,      // sin_family
         htons(port),  // sin_port
         INADDR_ANY    // sin_addr
     };
-    http::check_error(::bind(sockfd, reinterpret_cast<const sockaddr*>(&listen_address), sizeof(listen_address)));
-    http::check_error(::listen(sockfd, n_threads));
+    http::check_error(::bind(fd, reinterpret_cast<const sockaddr*>(&listen_address), sizeof(listen_address)));
+    http::check_error(::listen(fd, config.backlog));
+    return fd;
+}
+
+http::server::server(short port, int n_threads, server_mode mode) : mode(mode), next_reactor(0) {
+    const bool pin = http::settings().pin_threads;
+    const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+    if(mode == server_mode::uring && !http::uring_available()) {
+        HTTP_LOG(warning) << "io_uring is not built in or not supported by this kernel; using epoll loops instead";
+        mode = this->mode = server_mode::sharded;
+    }
+    if(mode == server_mode::sharded || mode == server_mode::uring || mode == server_mode::coroutine) {
+        // The kernel spreads incoming connections over the listeners by hash,
+        // and each loop accepts and serves its own
+        for(int i = 0; i < n_threads; i++) {
+            shard_listeners.push_back(open_listener(port, true, true));
+            if(mode == server_mode::coroutine) {
+                coroutine_loops.push_back(std::make_unique<coroutine_loop>(shard_listeners.back()));
+                if(pin) coroutine_loops.back()->pin_to_cpu(i % cpus);
+                continue;
+            }
+            if(mode == server_mode::uring) {
+                try {
+                    rings.push_back(std::make_unique<uring_loop>(shard_listeners.back()));
+                    if(pin) rings.back()->pin_to_cpu(i % cpus);
+                    continue;
+                } catch (const std::system_error& err) {
+                    HTTP_LOG(warning) << "Could not set up an io_uring loop, using epoll for this one: " << err.what();
+                }
+            }
+            reactors.push_back(std::make_unique<reactor>(shard_listeners.back()));
+            if(pin) reactors.back()->pin_to_cpu(i % cpus);
+        }
+        sockfd = shard_listeners.front();
+        return;
+    }
+    sockfd = open_listener(port, false, false);
+    if(mode == server_mode::blocking) {
+        workers.emplace(n_threads, pin);
+        http::register_gauge("http_worker_tasks_pending", "Connections handed to the worker pool and not yet finished", [this](){
+            return static_cast<double>(workers->pending());
+        });
+    } else {
+        reactors.reserve(n_threads);
+        for(int i = 0; i < n_threads; i++) {
+            reactors.push_back(std::make_unique<reactor>());
+            if(pin) reactors.back()->pin_to_cpu(i % cpus);
+        }
+    }
 }
 
 http::server::~server() {
-    ::close(sockfd);
+    http::unregister_gauge("http_worker_tasks_pending");
+    // Loops go first, since they may still be accepting on their listeners
+    reactors.clear();
+    rings.clear();
+    coroutine_loops.clear();
+    if(shard_listeners.empty()) {
+        ::close(sockfd);
+    }
+    for(int fd : shard_listeners) {
+        ::close(fd);
+    }
 }
 
-static void set_timeout(int fd) {
-    timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    http::check_error(::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
-    http::check_error(::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)));
+void http::server::serve_blocking() {
+    const int max_queued = http::settings().max_queued;
+    while(true) {
+        sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        // Non-blocking, so that sessions can bound every wait with poll
+        int clientfd = ::accept4(sockfd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        http::check_error(clientfd);
+        // Past this many waiting, a new connection would only wait longer still
+        const std::size_t queued = workers->pending() > workers->size() ? workers->pending() - workers->size() : 0;
+        if((max_queued > 0 && queued >= static_cast<std::size_t>(max_queued)) || !http::admit_connection()) {
+            http::turn_away(clientfd);
+            continue;
+        }
+        HTTP_LOG(debug) << "        accepted fd #" << clientfd;
+        http::count(http::counter::connections_accepted);
+        workers->post_task(clientfd);
+    }
 }
 
-void http::server::serve_forever() {
+void http::server::serve_reactor() {
     while(true) {
         sockaddr_in client_addr;
         socklen_t addrlen = sizeof(client_addr);
-        int clientfd = ::accept(sockfd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen);
-        set_timeout(clientfd);
-        BOOST_LOG_TRIVIAL(info) << "        accepted fd #" << clientfd;
+        int clientfd = ::accept4(sockfd, reinterpret_cast<sockaddr*>(&client_addr), &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         http::check_error(clientfd);
-        workers.post_task(clientfd);
+        if(!http::admit_connection()) {
+            http::turn_away(clientfd);
+            continue;
+        }
+        HTTP_LOG(debug) << "        accepted fd #" << clientfd;
+        http::count(http::counter::connections_accepted);
+        reactors[next_reactor++ % reactors.size()]->adopt(clientfd);
+    }
+}
+
+void http::server::serve_sharded() {
+    // The event loops do all the work; wait here until a signal interrupts us
+    while(true) {
+        http::check_error(::pause());
+    }
+}
+
+void http::server::serve_forever() {
+    if(mode == server_mode::blocking) {
+        serve_blocking();
+    } else if(mode == server_mode::reactor) {
+        serve_reactor();
+    } else {
+        // Sharded, uring and coroutine loops accept for themselves
+        serve_sharded();
     }
 }
\ No newline at end of file
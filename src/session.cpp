@@ -1,148 +1,529 @@
 #include <http/session.hpp>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sstream>
 #include <optional>
 #include <string>
 #include <algorithm>
+#include <array>
 #include <iterator>
-#include <boost/log/trivial.hpp>
+#include <climits>
+#include <cctype>
 #include <csignal>
 #include <http/index.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/scope_exit.hpp>
 #include <http/error.hpp>
+#include <http/response_cache.hpp>
+#include <http/compression.hpp>
+#include <http/admission.hpp>
+#include <http/range.hpp>
+#include <http/http_date.hpp>
+#include <http/validators.hpp>
+#include <http/config.hpp>
+#include <http/log.hpp>
+#include <http/metrics.hpp>
 #include <ios>
-#include <zlib.h>
+#include <chrono>
 #include <fmt/format.h>
-#include <boost/iostreams/device/back_inserter.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
-
-static const std::string crlf = "\r\n";
-static auto crlf_begin = crlf.begin();
-static auto crlf_end = crlf.end();
-
-static const char header_kv_delim = ':';
-static const std::string http11 = "HTTP/1.1";
-
-std::string http::session::recv_line() {
-    std::ostringstream line;
-    auto line_end = std::search(data_begin, data_end, crlf_begin, crlf_end);
-    // While we have not encountered a crlf in our buffer
-    while(line_end == data_end) {
-        // Add what we have so far to our line
-        std::copy(data_begin, data_end, std::ostream_iterator<char>(line));
-        // Read more data
-        data_begin = begin(buffer);
-        int n = ::recv(sockfd, data_begin, buffer_size, 0);
-        if (n == 0) throw http::premature_close("Socket closed while receiving line data");
-        http::check_error(n);
-        BOOST_LOG_TRIVIAL(info) << "        recv'd " << n << " from fd #" << sockfd;
-        data_end = data_begin + n;
-        // Search for newline again
-        line_end = std::search(data_begin, data_end, begin(crlf), end(crlf));
-    }
-    //We've found a line, copy it
-    std::copy(data_begin, line_end, std::ostream_iterator<char>(line));
-    data_begin = line_end + crlf.size();
-    return line.str();
-}
-
-void http::session::send_all(const unsigned char* start, ssize_t size) {
-    ssize_t unsent = size;
+
+namespace fs = boost::filesystem;
+
+static const std::size_t recv_chunk_size = 16 * 1024;
+// What an upload splices at a time: the default capacity of a pipe
+static const std::size_t splice_chunk_size = 64 * 1024;
+static const std::string_view crlf = "\r\n";
+static const std::string_view last_chunk = "0\r\n\r\n";
+// Past this much, corked responses are written out even if more requests are waiting
+static const std::size_t cork_limit = 64 * 1024;
+
+// Blocking sessions' sockets are non-blocking underneath, so that every wait
+// is bounded (SO_SNDTIMEO doesn't hold sendfile back): reads by the idle
+// timeout, writes by the write timeout
+static bool ready_within(int fd, short events, int timeout_seconds) {
+    pollfd ready = {fd, events, 0};
+    int n;
+    do {
+        n = ::poll(&ready, 1, timeout_seconds * 1000);
+    } while(n < 0 && errno == EINTR);
+    http::check_error(n);
+    return n > 0;
+}
+
+static void wait_for(int fd, short events, int timeout_seconds) {
+    if(!ready_within(fd, events, timeout_seconds)) throw std::system_error(EAGAIN, std::system_category(), "Timed out");
+}
+
+static bool would_block(ssize_t result) {
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+std::size_t http::session::recv_some(char* into, std::size_t max) {
+    ssize_t n;
+    while(would_block(n = ::recv(sockfd, into, max, 0))) {
+        if(errno != EINTR) wait_for(sockfd, POLLIN, http::settings().idle_timeout);
+    }
+    http::check_error(n);
+    http::count(http::counter::bytes_received, n);
+    HTTP_LOG(debug) << "        recv'd " << n << " from fd #" << sockfd;
+    return static_cast<std::size_t>(n);
+}
+
+// Sends every iovec, picking up after short writes. The array is advanced in place.
+void http::session::write_all(iovec* iov, int count, int flags) {
+    std::size_t total = 0;
+    msghdr message = {};
+    while(count > 0) {
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t sent = ::sendmsg(sockfd, &message, flags | MSG_NOSIGNAL);
+        if(would_block(sent)) {
+            if(errno != EINTR) wait_for(sockfd, POLLOUT, http::settings().write_timeout);
+            continue;
+        }
+        http::check_error(sent);
+        total += sent;
+        http::count(http::counter::bytes_sent, sent);
+        while(count > 0 && static_cast<std::size_t>(sent) >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    HTTP_LOG(debug) << "        fd #" << sockfd << " sent " << total;
+}
+
+void http::session::write_file(const http::file_body& file) {
+    off_t offset = file.offset;
+    std::size_t unsent = file.length;
     while(unsent > 0) {
-        ssize_t sent = ::send(sockfd, start, unsent, 0);
-        BOOST_LOG_TRIVIAL(info) << "        sent " << sent << " from fd #" << sockfd;
+        ssize_t sent = ::sendfile(sockfd, file.fd->get(), &offset, unsent);
+        if(would_block(sent)) {
+            if(errno != EINTR) wait_for(sockfd, POLLOUT, http::settings().write_timeout);
+            continue;
+        }
         http::check_error(sent);
+        if(sent == 0) throw std::runtime_error("File truncated while sending");
+        http::count(http::counter::bytes_sent, sent);
         unsent -= sent;
     }
-    BOOST_LOG_TRIVIAL(info) << "        fd #" << sockfd << " finished sending " << size;
+    HTTP_LOG(debug) << "        fd #" << sockfd << " finished sendfile of " << file.length;
 }
 
-http::request http::session::recv_request() {
-    const std::string reqln = recv_line();
-    auto reqln_end = end(reqln);
-    auto method_start = begin(reqln);
-    auto method_end = std::find(method_start, reqln_end, ' ');
-    std::string method = {method_start, method_end};
-    if(method_end == reqln_end) throw http::response{400};
+static iovec as_iovec(std::string_view bytes) {
+    return {const_cast<char*>(bytes.data()), bytes.size()};
+}
 
-    auto req_uri_start = method_end + 1;
-    auto req_uri_end = std::find(req_uri_start, reqln_end, ' ');
-    if(req_uri_end == reqln_end) throw http::response{400};
+void http::session::flush_corked(int flags) {
+    if(corked.empty()) return;
+    std::vector<iovec>& iov = corked_iov;
+    iov.clear();
+    std::size_t head_start = 0;
+    for(const corked_response& r : corked) {
+        iov.push_back(as_iovec(std::string_view{corked_heads}.substr(head_start, r.head_end - head_start)));
+        if(r.body) iov.push_back(as_iovec(r.body->peek()));
+        head_start = r.head_end;
+    }
+    for(std::size_t first = 0; first < iov.size(); first += IOV_MAX) {
+        int count = static_cast<int>(std::min<std::size_t>(IOV_MAX, iov.size() - first));
+        write_all(iov.data() + first, count, first + count < iov.size() ? MSG_MORE : flags);
+    }
+    for(const corked_response& r : corked) {
+        if(r.body) r.body->skip(r.body->peek().size());
+    }
+    HTTP_LOG(debug) << "        fd #" << sockfd << " flushed " << corked.size() << " corked responses";
+    corked.clear();
+    corked_heads.clear();
+    corked_bytes = 0;
+}
+
+// An interim (1xx) response goes out at once, ahead of the body it asks for
+void http::session::send_interim(std::string_view head) {
+    if(blocking_io) {
+        // Nothing is queued ahead of it on an upstream worker, and the loop won't write until it's back
+        iovec iov[] = {as_iovec(head)};
+        write_all(iov, 1);
+        return;
+    }
+    send_message(head, nullptr, false);
+    flush_corked();
+}
 
-    auto version_start = req_uri_end + 1;
-    auto version_end = reqln_end;
-    if(!std::equal(version_start, version_end, begin(http11), end(http11))) {
-        throw http::response{505};
+// Each write gathers the head (or the previous chunk's trailing CRLF), the
+// chunk size line and the chunk itself, so there is one syscall per chunk
+void http::session::send_message(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked) {
+    // Whole responses already in memory wait for the rest of the pipelined batch
+    std::string_view in_memory = body && !chunked && !body->file() ? body->peek() : std::string_view{};
+    if((!body || (!in_memory.empty() && body->size() == in_memory.size()))
+       && corked_bytes + head.size() + in_memory.size() <= cork_limit) {
+        corked_heads += head;
+        corked.push_back({corked_heads.size(), std::move(body)});
+        corked_bytes += head.size() + in_memory.size();
+        return;
+    }
+    flush_corked(MSG_MORE);
+    if(!body) {
+        iovec iov[] = {as_iovec(head)};
+        write_all(iov, 1);
+        return;
+    }
+    if(!chunked) {
+        if(const http::file_body* file = body->file()) {
+            // Held back by MSG_MORE so it leaves in the same segment as the start of the file
+            iovec iov[] = {as_iovec(head)};
+            write_all(iov, 1, MSG_MORE);
+            write_file(*file);
+            body->skip(file->length);
+            return;
+        }
+        in_memory = body->peek();
+        if(!in_memory.empty()) {
+            iovec iov[] = {as_iovec(head), as_iovec(in_memory)};
+            write_all(iov, 2);
+            body->skip(in_memory.size());
+            return;
+        }
+    }
+    stream_buffer.resize(http::settings().chunk_size);
+    std::string_view prefix = head;
+    while(std::size_t n = body->read(stream_buffer.data(), stream_buffer.size())) {
+        std::array<char, 24> size_line;
+        auto size_end = fmt::format_to_n(size_line.data(), size_line.size(), "{:x}\r\n", n).out;
+        iovec iov[] = {
+            as_iovec(prefix),
+            as_iovec(chunked ? std::string_view{size_line.data(), static_cast<std::size_t>(size_end - size_line.data())} : ""),
+            as_iovec({stream_buffer.data(), n})
+        };
+        write_all(iov, 3);
+        prefix = chunked ? crlf : "";
     }
+    iovec iov[] = {as_iovec(prefix), as_iovec(chunked ? last_chunk : "")};
+    write_all(iov, 2);
+}
 
-    std::unordered_map<std::string, std::string> headers;
-    for(std::string headerline = recv_line(); !headerline.empty(); headerline = recv_line()) {
-        auto key_start = headerline.begin();
-        auto key_end = std::find(headerline.begin(), headerline.end(), header_kv_delim);
-        auto value_start = key_end + 1;
-        auto value_end = headerline.end();
-        headers.emplace(std::piecewise_construct,
-                        std::forward_as_tuple(key_start, key_end),
-                        std::forward_as_tuple(value_start, value_end));
+bool http::session::request_buffered() {
+    if(parse_error) return true;
+    // Only attempts that finish a head are timed, so the count matches the requests
+    auto started = std::chrono::steady_clock::now();
+    try {
+        if(!parser.parse(buffer.data(), current_request)) return false;
+    } catch (http::response& err) {
+        parse_error = std::move(err);
     }
-    
-    return {
-        {method_start, method_end},
-        {req_uri_start, req_uri_end},
-        {version_start, version_end},
-        headers
-    };
+    http::record(http::phase::parse, std::chrono::steady_clock::now() - started);
+    return true;
 }
 
-void http::session::transfer_id(http::response r) {
-    r.headers["Content-Length"] = fmt::format("{}", r.body.size());
-    std::ostringstream sstr;
-    sstr << "HTTP/1.1 " << r.code << " " << r.reason << "\r\n";
-    for(auto [header, val] : r.headers) {
-        sstr << header << ": " << val << "\r\n";
-    }
-    sstr << "\r\n";
-    sstr << r.body;
-    std::string bytes = sstr.str();
-    send_all(
-        reinterpret_cast<const unsigned char*>(bytes.data()),
-        static_cast<ssize_t>(bytes.size())
-    );
-}
-
-void http::session::transfer_chunked(http::response r, std::size_t chunk_size) {
-    r.headers["Transfer-Encoding"] = "chunked";
-    std::ostringstream sstr;
-    sstr << "HTTP/1.1 " << r.code << " " << r.reason << "\r\n";
-    for(auto [header, val] : r.headers) {
-        sstr << header << ": " << val << "\r\n";
-    }
-    sstr << "\r\n";
-    sstr << std::hex;
-    const int total_chunks = r.body.size() / chunk_size + (r.body.size() % chunk_size != 0);
-    const char* begin = r.body.data();
-    for(int i = 0; i < total_chunks; i++) {
-        std::size_t this_chunk_size;
-        if(r.body.size() % chunk_size == 0 || i != total_chunks - 1) {
-            this_chunk_size = chunk_size;
+// Each wait is bounded by the idle timeout; this bounds a whole head, however it trickles in
+void http::session::recv_request() {
+    std::optional<std::chrono::steady_clock::time_point> head_started;
+    while(!request_buffered()) {
+        if(!buffer.data().empty()) {
+            auto now = std::chrono::steady_clock::now();
+            if(!head_started) {
+                head_started = now;
+            } else if(now - *head_started > std::chrono::seconds(http::settings().header_timeout)) {
+                http::count(http::counter::timeouts);
+                throw request_timeout();
+            }
+        }
+        char* space = buffer.prepare(recv_chunk_size);
+        std::size_t n = recv_some(space, buffer.writable());
+        if (n == 0) throw http::premature_close("Socket closed while receiving request head");
+        buffer.commit(n);
+    }
+    if(parse_error) {
+        http::response err = std::move(*parse_error);
+        parse_error.reset();
+        throw err;
+    }
+}
+
+static http::response plain_error(int code, std::string_view reason) {
+    return {code, reason, {{"Content-Type", "text/plain; charset=utf-8"}}, fmt::format("{} {}", code, reason)};
+}
+
+// Whether lexically_normal() would give the path back unchanged: absolute, with no
+// empty, "." or ".." segments and no trailing slash (which it turns into "/.")
+static bool already_normal(std::string_view path) {
+    if(path.empty() || path.front() != '/') return false;
+    if(path.size() == 1) return true;
+    for(std::size_t start = 1; start <= path.size();) {
+        std::size_t end = std::min(path.find('/', start), path.size());
+        std::string_view segment = path.substr(start, end - start);
+        if(segment.empty() || segment == "." || segment == "..") return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+// Normalising takes apart and rebuilds the path, which allocates for every segment, so it is skipped when it wouldn't change anything
+static fs::path normal_path(std::string_view uri) {
+    fs::path requested_path{uri.begin(), uri.end()};
+    if(!already_normal(uri)) requested_path = requested_path.lexically_normal();
+    return requested_path;
+}
+
+// Where a PUT goes: a new or replaced file, in a directory under the root that already exists
+static std::unique_ptr<http::upload_file> open_upload(std::string_view uri) {
+    if(!http::settings().uploads || http::packed_site()) {
+        http::response refused = plain_error(405, "Method Not Allowed");
+        refused.headers.set("Allow", "GET");
+        throw refused;
+    }
+    fs::path requested_path = normal_path(uri);
+    std::string name = requested_path.filename().string();
+    if(name.empty() || name == "." || name == ".." || name == "/") throw plain_error(409, "Conflict");
+    http::path_cache::entry parent = http::resolved_paths().resolve(requested_path.parent_path().string());
+    if(parent->type == http::resolved_path::forbidden) throw plain_error(403, "Forbidden");
+    if(parent->type != http::resolved_path::directory) throw plain_error(409, "Conflict");
+    std::string target = parent->mapped;
+    if(target.back() != '/') target += '/';
+    target += name;
+    struct stat existing;
+    if(::stat(target.c_str(), &existing) == 0 && !S_ISREG(existing.st_mode)) throw plain_error(409, "Conflict");
+    return std::make_unique<http::upload_file>(std::move(target));
+}
+
+// The client's address, as it goes in X-Forwarded-For
+static std::string peer_address(int fd) {
+    sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    char text[INET6_ADDRSTRLEN] = "unknown";
+    if(::getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &length) == 0) {
+        if(peer.ss_family == AF_INET) {
+            ::inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in&>(peer).sin_addr, text, sizeof(text));
+        } else if(peer.ss_family == AF_INET6) {
+            ::inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6&>(peer).sin6_addr, text, sizeof(text));
+        }
+    }
+    return text;
+}
+
+// Works out how the request body (if any) is framed and where it is to go,
+// turning it down before it is sent where possible. A client that waits to be
+// asked for it with Expect: 100-continue is then asked.
+void http::session::start_body(const http::request& req) {
+    current_request.body.clear();
+    // Matched on the normalised path, so that dot segments can't step into or out of a prefix
+    upstream = http::settings().proxies.empty() ? nullptr : http::find_upstream(normal_path(req.uri).string());
+    const http::request_framing framing = http::body_framing(req.headers);
+    const bool upload = req.method == "PUT" && !upstream;
+    if(framing.type == http::request_framing::none) {
+        if(upload) throw plain_error(411, "Length Required");
+        return;
+    }
+    const http::config& config = http::settings();
+    // Bodies that are passed on as they come are held to the same limit as uploads
+    const std::uint64_t limit = upload || upstream ? config.max_upload_size : config.max_body_size;
+    std::optional<http::body_decoder> decoder;
+    if(framing.type == http::request_framing::unsupported) {
+        throw plain_error(501, "Not Implemented");
+    } else if(framing.type == http::request_framing::chunked) {
+        decoder = http::body_decoder::chunks();
+    } else {
+        if(framing.length > limit) throw plain_error(413, "Content Too Large");
+        decoder = http::body_decoder::with_length(framing.length);
+    }
+    std::string_view expect = req.header(http::field::expect);
+    if(!expect.empty() && !http::iequals(expect, "100-continue")) throw plain_error(417, "Expectation Failed");
+    body = incoming_body{*decoder, limit, upload ? open_upload(req.uri) : nullptr};
+    if(upstream) body->proxied = std::make_unique<http::upstream_exchange>(*upstream, req, peer_address(sockfd));
+    // Only worth saying while none of the body has been sent
+    if(!expect.empty() && !legacy_client && !decoder->done() && buffer.data().size() == parser.head_size()) {
+        send_interim("HTTP/1.1 100 Continue\r\n\r\n");
+    }
+}
+
+void http::session::keep_body(std::string_view data) {
+    if(body->decoder.received() > body->limit) throw plain_error(413, "Content Too Large");
+    if(body->proxied) {
+        body->proxied->send_body(data);
+    } else if(body->upload) {
+        body->upload->write(data);
+    } else {
+        current_request.body += data;
+    }
+}
+
+// Moves the request body along: first whatever of it is already buffered
+// (after the head, which stays at the front), then more from the socket until
+// it is complete. Returns false if an event loop has to wait for more.
+bool http::session::receive_body() {
+    while(true) {
+        std::string_view buffered = buffer.data().substr(parser.head_size());
+        std::size_t consumed = 0;
+        while(!body->decoder.done() && consumed < buffered.size()) {
+            std::string_view data;
+            consumed += body->decoder.decode(buffered.substr(consumed), data);
+            keep_body(data);
+        }
+        buffer.erase(parser.head_size(), consumed);
+        if(consumed > 0) body_progress = true;
+        if(body->decoder.done()) break;
+        if(!recv_body()) return false;
+    }
+    // The head may have moved with the buffer, so its views are taken afresh
+    parser.parse(buffer.data(), current_request);
+    return true;
+}
+
+// Body bytes go from the socket to the upload's file through a pipe, without
+// passing through user space. Returns what recv would have.
+ssize_t http::session::splice_body(std::uint64_t max) {
+    if(!body->pipe_read) {
+        int fds[2];
+        http::check_error(::pipe2(fds, O_CLOEXEC | O_NONBLOCK));
+        body->pipe_read = http::unique_fd{fds[0]};
+        body->pipe_write = http::unique_fd{fds[1]};
+    }
+    ssize_t n = ::splice(sockfd, nullptr, body->pipe_write.get(), nullptr, std::min<std::uint64_t>(max, splice_chunk_size),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    for(ssize_t left = n; left > 0;) {
+        ssize_t moved = ::splice(body->pipe_read.get(), nullptr, body->upload->get(), nullptr, left, SPLICE_F_MOVE);
+        if(moved < 0 && errno == EINTR) continue;
+        http::check_error(moved);
+        left -= moved;
+    }
+    return n;
+}
+
+bool http::session::pull_body(bool wait) {
+    while(true) {
+        // Only body data can be spliced, so chunked framing still goes through the buffer
+        const std::uint64_t raw = body->upload ? body->decoder.raw_remaining() : 0;
+        ssize_t n;
+        if(raw > 0) {
+            n = splice_body(raw);
         } else {
-            this_chunk_size = r.body.size() % chunk_size;
+            char* space = buffer.prepare(recv_chunk_size);
+            n = ::recv(sockfd, space, buffer.writable(), 0);
+        }
+        if(n == 0) throw http::premature_close("Socket closed while receiving request body");
+        if(n > 0) {
+            http::count(http::counter::bytes_received, n);
+            body_progress = true;
+            if(raw > 0) {
+                body->decoder.skip(n);
+                if(body->decoder.received() > body->limit) throw plain_error(413, "Content Too Large");
+            } else {
+                buffer.commit(n);
+            }
+            return true;
+        }
+        if(!would_block(n)) http::check_error(n);
+        if(errno == EINTR) continue;
+        if(!wait) return false;
+        if(!ready_within(sockfd, POLLIN, http::settings().body_timeout)) {
+            http::count(http::counter::timeouts);
+            throw request_timeout();
         }
-        sstr << this_chunk_size << "\r\n";
-        sstr << std::string_view{begin, this_chunk_size} << "\r\n";
-        begin += chunk_size;
     }
-    BOOST_LOG_TRIVIAL(info) << "Chunked " << (begin - r.body.data()) << " bytes";
-    sstr << "0\r\n\r\n";
-    std::string bytes = sstr.str();
-    send_all(
-        reinterpret_cast<const unsigned char*>(bytes.data()),
-        static_cast<ssize_t>(bytes.size())
-    );
+}
+
+http::response http::session::request_timeout() {
+    return {408, "Request Timeout", {{"Content-Type", "text/plain; charset=utf-8"}}, "408 Request Timeout"};
+}
+
+void http::session::time_out() {
+    const auto started = std::chrono::steady_clock::now();
+    body.reset();
+    legacy_client = false;
+    persistent = false;
+    answering_head = false;
+    send_response(request_timeout());
+    account_for("-", "-", started);
+}
+
+// Goes straight after the status line, so cached responses (which are stored without it) are easy to splice
+std::string_view http::session::connection_header() const {
+    if(!persistent) return "Connection: close\r\n";
+    if(legacy_client) return "Connection: keep-alive\r\n";
+    return {};
+}
+
+// A cached head as this connection sends it, with its Connection header spliced in (in the reusable head buffer)
+std::string_view http::session::cached_head(std::string_view stored) {
+    std::string_view connection = connection_header();
+    if(connection.empty()) return stored;
+    std::size_t status_end = stored.find("\r\n") + 2;
+    head_buffer.clear();
+    head_buffer.append(stored.data(), stored.data() + status_end);
+    head_buffer.append(connection.data(), connection.data() + connection.size());
+    head_buffer.append(stored.data() + status_end, stored.data() + stored.size());
+    return {head_buffer.data(), head_buffer.size()};
+}
+
+// Formats the status line and headers into the reusable head buffer, framed
+// with either a Content-Length or chunked transfer coding. HTTP/1.0 clients
+// can't take chunks, so theirs are delimited by closing the connection.
+std::string_view http::session::build_head(const http::response& r, std::optional<std::size_t> content_length) {
+    head_buffer.clear();
+    response_status = r.code;
+    response_length = content_length;
+    auto out = std::back_inserter(head_buffer);
+    if(!content_length && r.code != 304 && legacy_client) persistent = false;
+    fmt::format_to(out, "HTTP/1.1 {} {}\r\n{}", r.code, r.reason, connection_header());
+    for(const auto& [header, val] : r.headers) {
+        fmt::format_to(out, "{}: {}\r\n", header, val);
+    }
+    if(r.code == 304 || r.code == 204) {
+        // Never has a body, so no framing either
+        fmt::format_to(out, "\r\n");
+    } else if(content_length) {
+        fmt::format_to(out, "Content-Length: {}\r\n\r\n", *content_length);
+    } else if(legacy_client) {
+        fmt::format_to(out, "\r\n");
+    } else {
+        fmt::format_to(out, "Transfer-Encoding: chunked\r\n\r\n");
+    }
+    return {head_buffer.data(), head_buffer.size()};
+}
+
+// Reads whatever is left of a body source into memory
+static std::string drain(http::body_source& source) {
+    const std::size_t chunk_size = http::settings().chunk_size;
+    std::string bytes;
+    std::size_t n;
+    do {
+        std::size_t before = bytes.size();
+        bytes.resize(before + chunk_size);
+        n = source.read(bytes.data() + before, chunk_size);
+        bytes.resize(before + n);
+    } while(n > 0);
+    return bytes;
+}
+
+void http::session::respond(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked) {
+    if(answering_head) {
+        send_message(head, nullptr, false);
+    } else {
+        send_message(head, std::move(body), chunked);
+    }
+}
+
+void http::session::transfer_id(http::response r) {
+    auto body = http::take_body(r);
+    std::string_view head = build_head(r, body->size().value());
+    respond(head, std::move(body), false);
+}
+
+void http::session::transfer_chunked(http::response r) {
+    auto body = http::take_body(r);
+    std::string_view head = build_head(r, std::nullopt);
+    respond(head, std::move(body), !legacy_client);
 }
 
 http::response http::session::encode_id(http::response x) {
@@ -150,113 +531,414 @@ http::response http::session::encode_id(http::response x) {
 }
 
 http::response http::session::encode_gzip(http::response x) {
-    namespace io = boost::iostreams;
-    http::response encoded = x;
-    encoded.headers["Content-Encoding"] = "gzip";
-    encoded.body.clear();
-    {
-        io::filtering_ostream out;
-        out.push(io::gzip_compressor{});
-        out.push(io::back_inserter(encoded.body));
-        out << x.body;
+    x.headers.set("Content-Encoding", "gzip");
+    if(std::string_view tag = x.headers.get("ETag"); !tag.empty()) {
+        x.headers.set("ETag", http::encoded_tag(tag, "gzip"));
     }
-    return encoded;
+    x.source = http::gzip_source(http::take_body(x), http::settings().gzip_level);
+    return x;
+}
+
+bool http::session::accepts_gzip() {
+    return http::accepts_gzip(current_request.header(http::field::accept_encoding));
+}
+
+http::response http::session::encode(http::response response) {
+    if(accepts_gzip() && http::worth_compressing(response.headers.get("Content-Type"), http::take_body(response)->size())) {
+        return encode_gzip(std::move(response));
+    } else {
+        // File bodies stay files, to go straight from the page cache
+        return encode_id(std::move(response));
+    }
+}
+
+// Frames an encoded response with Content-Length when its size is known up front, otherwise chunked
+void http::session::transfer(http::response encoded) {
+    http::phase_timer sending(http::phase::send);
+    if(http::take_body(encoded)->size()) {
+        transfer_id(std::move(encoded));
+    } else {
+        transfer_chunked(std::move(encoded));
+    }
+    HTTP_LOG(debug) << "        fd #" << sockfd << " finished sending this response";
 }
 
 void http::session::send_response(http::response response) {
-    http::response encoded;
-    if(current_request.headers["Accept-Encoding"].find("gzip") != std::string::npos) {
-        encoded = encode_gzip(response);
+    transfer(encode(std::move(response)));
+}
+
+// A Range only applies while If-Range (if sent) still matches the file, whose
+// unencoded tag and modification time are given
+bool http::session::if_range_holds(std::string_view tag, std::time_t modified) {
+    std::string_view if_range = current_request.header(http::field::if_range);
+    if(if_range.empty()) return true;
+    // Ranges are of the unencoded file, so only its own tag will do
+    if(if_range.front() == '"') return if_range == tag;
+    if(if_range.substr(0, 2) == "W/") return false;
+    auto date = http::parse_http_date(if_range);
+    return date && *date == modified;
+}
+
+// Validators and caching rules, which go on every response for a file (304s included).
+// The ETag is for the unencoded file; encode_gzip adjusts it.
+static void add_file_headers(http::response_headers& headers, const fs::path& requested_path, const struct stat& info, bool gzippable) {
+    headers.insert("ETag", http::entity_tag(info, http::response_memory()));
+    headers.insert("Last-Modified", http::format_http_date(info.st_mtime, http::response_memory()));
+    std::string_view cache_control = http::cache_control_for(requested_path.string());
+    if(!cache_control.empty()) headers.insert("Cache-Control", cache_control);
+    if(gzippable) headers.insert("Vary", "Accept-Encoding");
+}
+
+// If-None-Match wins over If-Modified-Since when both are sent
+bool http::session::not_modified(std::string_view tag, std::time_t modified) {
+    std::string_view if_none_match = current_request.header(http::field::if_none_match);
+    if(!if_none_match.empty()) {
+        return http::tag_list_matches(if_none_match, tag);
+    }
+    std::string_view if_modified_since = current_request.header(http::field::if_modified_since);
+    if(!if_modified_since.empty()) {
+        auto date = http::parse_http_date(if_modified_since);
+        return date && modified <= *date;
+    }
+    return false;
+}
+
+// Small files are answered from (and fill) the serialized response cache; larger ones are streamed.
+// Range requests get the unencoded bytes they ask for, straight from the file.
+void http::session::serve_static(const fs::path& requested_path, const http::resolved_path& target) {
+    http::response_cache& cache = http::file_cache();
+    const std::string& key = target.mapped;
+    struct stat info = target.info;
+    const std::pmr::string tag = http::entity_tag(info, http::response_memory());
+    const std::string_view range = current_request.header(http::field::range);
+    const bool partial = !range.empty() && if_range_holds(tag, info.st_mtime);
+    const bool cacheable = !partial && static_cast<std::size_t>(info.st_size) <= cache.max_entry_size();
+    const bool gzippable = http::worth_compressing(target.content_type, info.st_size);
+    const std::string_view encoding = accepts_gzip() && gzippable ? "gzip" : "identity";
+
+    // Answered from the stat alone, without opening the file
+    const std::pmr::string current_tag = encoding == "gzip" ? http::encoded_tag(tag, "gzip", http::response_memory()) : tag;
+    if(not_modified(current_tag, info.st_mtime)) {
+        http::response unchanged{304, "Not Modified"};
+        add_file_headers(unchanged.headers, requested_path, info, gzippable);
+        unchanged.headers.set("ETag", current_tag);
+        http::phase_timer sending(http::phase::send);
+        send_message(build_head(unchanged, std::nullopt), nullptr, false);
+        return;
+    }
+
+    std::optional<http::phase_timer> opening(http::phase::file);
+    if(cacheable) {
+        if(auto hit = cache.find(key, encoding, info)) {
+            opening.reset();
+            HTTP_LOG(debug) << "* Response cache hit";
+            std::size_t head_end = hit->find("\r\n\r\n") + 4;
+            response_status = 200;
+            response_length = hit->size() - head_end;
+            http::phase_timer sending(http::phase::send);
+            // The body is sent from the shared entry itself
+            std::string_view head = cached_head(std::string_view{*hit}.substr(0, head_end));
+            respond(head, http::memory_source(std::move(hit), head_end), false);
+            return;
+        }
+    }
+    http::unique_fd file{::open(target.mapped.c_str(), O_RDONLY | O_CLOEXEC)};
+    if(!file || ::fstat(file.get(), &info) < 0) {
+        opening.reset();
+        send_response(http::serve_404(requested_path));
+        return;
+    }
+    opening.reset();
+    if(partial) {
+        if(auto ranges = http::parse_range(range, info.st_size)) {
+            if(ranges->empty()) {
+                send_response(http::serve_416(info.st_size));
+            } else {
+                http::file_body whole{std::make_shared<const http::unique_fd>(std::move(file)), 0, static_cast<std::size_t>(info.st_size)};
+                http::response part = http::serve_ranges(std::string{target.content_type}, whole, *ranges);
+                add_file_headers(part.headers, requested_path, info, gzippable);
+                transfer(std::move(part));
+            }
+            return;
+        }
+    }
+    http::response full = http::serve_file(requested_path, std::move(file), info);
+    add_file_headers(full.headers, requested_path, info, gzippable);
+    http::response encoded = encode(std::move(full));
+    if(cacheable) {
+        std::optional<http::phase_timer> encoding_time(http::phase::encode);
+        std::string body = drain(*http::take_body(encoded));
+        encoding_time.reset();
+        std::string_view head = build_head(encoded, body.size());
+        // Stored without the Connection header, which cached_head() puts back per connection
+        std::string bytes{head};
+        if(std::string_view connection = connection_header(); !connection.empty()) {
+            bytes.erase(bytes.find("\r\n") + 2, connection.size());
+        }
+        const std::size_t head_end = bytes.size();
+        bytes += body;
+        auto entry = std::make_shared<const std::string>(std::move(bytes));
+        http::phase_timer sending(http::phase::send);
+        respond(head, http::memory_source(entry, head_end), false);
+        cache.insert(key, encoding, info, std::move(entry));
     } else {
-        encoded = encode_id(response);
+        transfer(std::move(encoded));
     }
-    transfer_chunked(encoded);
-    //transfer_id(encoded);
-    BOOST_LOG_TRIVIAL(info) << "        fd #" << sockfd << " finished sending this response";
 }
 
-void http::session::operator()(int fd) {
+// Archive paths have no trailing slash, except for the root itself
+static std::string_view archive_key(std::string_view path) {
+    if(path.size() >= 2 && path.substr(path.size() - 2) == "/.") path.remove_suffix(1);
+    if(path.size() > 1 && path.back() == '/') path.remove_suffix(1);
+    return path;
+}
+
+// The archive's counterpart to add_file_headers, with the tags packed alongside the file
+static void add_archived_headers(http::response_headers& headers, const http::archive& site, const http::archive_entry& entry,
+                                 const fs::path& requested_path, bool gzip, bool gzippable) {
+    std::string_view tag = site.bytes(gzip ? entry.gzip_etag : entry.etag);
+    if(!tag.empty()) {
+        headers.insert("ETag", tag);
+        headers.insert("Last-Modified", site.bytes(entry.last_modified));
+    }
+    std::string_view cache_control = http::cache_control_for(requested_path.string());
+    if(!cache_control.empty()) headers.insert("Cache-Control", cache_control);
+    if(gzippable) headers.insert("Vary", "Accept-Encoding");
+}
+
+// Everything comes from the mapped archive: a hash lookup stands in for
+// resolving and opening the file, and bodies (gzipped ahead of time) are
+// gathered straight from the mapping, or sent with sendfile for ranges
+void http::session::serve_archived(const fs::path& requested_path, const http::archive& site) {
+    const http::archive_entry* entry;
+    {
+        http::phase_timer resolving(http::phase::resolve);
+        entry = site.find(archive_key(requested_path.string()));
+    }
+    if(!entry) {
+        send_response(http::serve_404(requested_path));
+        return;
+    }
+    const bool is_file = entry->type == http::archive_entry::file;
+    const std::string_view content_type = site.bytes(entry->content_type);
+    const std::string_view identity = site.bytes(entry->identity);
+    const bool gzippable = entry->gzip.length > 0 && http::worth_compressing(content_type, identity.size());
+    const bool gzip = gzippable && accepts_gzip();
+    const std::string_view tag = site.bytes(entry->etag);
+    const std::string_view range = is_file ? current_request.header(http::field::range) : std::string_view{};
+    const bool partial = !range.empty() && if_range_holds(tag, entry->modified);
+
+    if(!tag.empty() && not_modified(site.bytes(gzip ? entry->gzip_etag : entry->etag), entry->modified)) {
+        http::response unchanged{304, "Not Modified"};
+        add_archived_headers(unchanged.headers, site, *entry, requested_path, gzip, gzippable);
+        http::phase_timer sending(http::phase::send);
+        send_message(build_head(unchanged, std::nullopt), nullptr, false);
+        return;
+    }
+    if(partial) {
+        if(auto ranges = http::parse_range(range, identity.size())) {
+            if(ranges->empty()) {
+                send_response(http::serve_416(identity.size()));
+            } else {
+                http::response part = http::serve_ranges(std::string{content_type}, site.file(entry->identity), *ranges);
+                add_archived_headers(part.headers, site, *entry, requested_path, false, gzippable);
+                transfer(std::move(part));
+            }
+            return;
+        }
+    }
+    http::response full{200, "OK", {{"Content-Type", content_type}}, {}, http::view_source(gzip ? site.bytes(entry->gzip) : identity)};
+    if(is_file) full.headers.set("Accept-Ranges", "bytes");
+    add_archived_headers(full.headers, site, *entry, requested_path, gzip, gzippable);
+    if(gzip) full.headers.set("Content-Encoding", "gzip");
+    transfer(std::move(full));
+}
+
+// Forwards the request upstream, unless its body has already gone on ahead of
+// it, and passes the response back as it arrives, encoded as the upstream chose
+void http::session::serve_proxied(const http::request& req, http::upstream_pool& pool) {
+    std::unique_ptr<http::upstream_exchange> exchange;
+    std::optional<http::response> answer;
+    try {
+        exchange = body && body->proxied ? std::move(body->proxied) : std::make_unique<http::upstream_exchange>(pool, req, peer_address(sockfd));
+        answer = exchange->response();
+    } catch (http::response& failed) {
+        // The request has been read in full, so the connection can carry on
+        send_response(std::move(failed));
+        return;
+    }
+    if(answering_head) {
+        http::phase_timer sending(http::phase::send);
+        send_message(build_head(*answer, exchange->content_length()), nullptr, false);
+    } else {
+        transfer(std::move(*answer));
+    }
+}
+
+void http::session::attach(int fd) {
     sockfd = fd;
-    BOOST_SCOPE_EXIT(&sockfd) {
-        ::shutdown(sockfd, SHUT_RDWR);
-        ::close(sockfd);
-        BOOST_LOG_TRIVIAL(info) << "        closed fd #" << sockfd;
-    } BOOST_SCOPE_EXIT_END
-    data_begin = buffer.begin();
-    data_end = data_begin;
-    BOOST_LOG_TRIVIAL(info) << "Handling new client";
+    buffer = {};
+    parser.reset();
+    parse_error.reset();
+    body.reset();
+}
+
+// Counts the response, and writes its access log line: method path status body-bytes microseconds,
+// where the time runs until the response is handed to send_message
+void http::session::account_for(std::string_view method, std::string_view uri, std::chrono::steady_clock::time_point started) {
+    auto elapsed = std::chrono::steady_clock::now() - started;
+    http::count(http::counter::requests);
+    switch(response_status / 100) {
+        case 2: http::count(http::counter::responses_2xx); break;
+        case 3: http::count(http::counter::responses_3xx); break;
+        case 4: http::count(http::counter::responses_4xx); break;
+        case 5: http::count(http::counter::responses_5xx); break;
+    }
+    http::record(http::phase::request, elapsed);
+    HTTP_ACCESS_LOG() << method << ' ' << uri << ' ' << response_status << ' '
+                      << (response_length ? fmt::to_string(*response_length) : "-") << ' '
+                      << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << "us";
+}
+
+bool http::session::serve_one() {
+    // Everything the request puts in the arena goes before the next one is read
+    http::arena_scope scope{arena};
     try {
-        bool keep_alive = true;
-        do {
-            current_request = recv_request();
-            http::request& req = current_request;
-            keep_alive = current_request.headers["Connection"] != "close";
-            BOOST_LOG_TRIVIAL(info) << req.method << " " << req.uri << " " << req.version;
-            for(auto pair : req.headers) {
-                BOOST_LOG_TRIVIAL(info) << "    " << pair.first << ":" << pair.second;
+        if(!body) {
+            legacy_client = false;
+            persistent = true;
+            answering_head = false;
+            recv_request();
+            request_started = std::chrono::steady_clock::now();
+            const http::request& req = current_request;
+            answering_head = req.method == "HEAD";
+            // HTTP/1.1 connections persist unless closed explicitly, HTTP/1.0 ones only if asked to
+            std::string_view connection = req.header(http::field::connection);
+            legacy_client = req.version == "HTTP/1.0";
+            persistent = legacy_client ? http::has_token(connection, "keep-alive") : !http::has_token(connection, "close");
+            HTTP_LOG(debug) << req.method << " " << req.uri << " " << req.version;
+            for(const auto& [name, value] : req.headers) {
+                HTTP_LOG(trace) << "    " << name << ": " << value;
             }
-            handle_request(req);
-            BOOST_LOG_TRIVIAL(info) << "---------------------------";
-        } while (keep_alive);
-    } catch (const http::response& err) {
-        send_response(err);
+            start_body(req);
+        }
+        // Read in full before anything is answered, so the next request starts where this one ends
+        if(body && !receive_body()) return true;
+        const http::request& req = current_request;
+        handle_request(req);
+        account_for(req.method, req.uri, request_started);
+        body.reset();
+        buffer.consume(parser.head_size());
+        parser.reset();
+        return persistent;
+    } catch (http::response& err) {
+        // Nothing after a malformed request can be trusted to be the next one
+        const auto started = std::chrono::steady_clock::now();
+        persistent = false;
+        send_response(std::move(err));
+        account_for("-", "-", started);
     } catch (const http::premature_close& err) {
-        BOOST_LOG_TRIVIAL(error) << "Client stopped sending prematurely";
+        if(buffer.data().empty()) {
+            HTTP_LOG(debug) << "Client closed the connection between requests";
+        } else {
+            HTTP_LOG(error) << "Client stopped sending prematurely";
+        }
     } catch (const std::system_error& err) {
         if(err.code().value() == EAGAIN) {
-            BOOST_LOG_TRIVIAL(error) << "Read or write timed out";
+            http::count(http::counter::timeouts);
+            HTTP_LOG(debug) << "Read or write timed out";
         } else {
-            BOOST_LOG_TRIVIAL(error) << "System error " << err.code() << ": " << err.what();
+            HTTP_LOG(error) << "System error " << err.code() << ": " << err.what();
         }
     } catch (const std::exception& err) {
-        BOOST_LOG_TRIVIAL(error) << "Something went badly wrong: " << err.what();
+        HTTP_LOG(error) << "Something went badly wrong: " << err.what();
     } catch (...) {
-        BOOST_LOG_TRIVIAL(error) << "Something went extremely wrong";
+        HTTP_LOG(error) << "Something went extremely wrong";
     }
+    // An upload cut short is thrown away
+    body.reset();
+    return false;
 }
 
-namespace fs = boost::filesystem;
+bool http::session::bound_upstream() {
+    if(body || parse_error || http::settings().proxies.empty()) return false;
+    return http::find_upstream(normal_path(current_request.uri).string()) != nullptr;
+}
 
-std::optional<fs::path> chroot_map(fs::path original, fs::path root) {
-    fs::path mapped = root;                    // "./rel_root"
-    mapped /= original;                        // "./rel_root/../../etc/passwd"
-    fs::path canon = fs::canonical(mapped);    // "/etc/passwd"
-    fs::path ceiling = fs::canonical(root);    // "/www/rel_root"
-    auto [first_mismatch, _] = std::mismatch (
-        ceiling.begin(), ceiling.end(),
-        canon.begin(), canon.end()
-    );
-    if(first_mismatch == ceiling.end()) {
-        return mapped;
-    } else {
-        return std::nullopt;
+bool http::session::serve_upstream_bound() {
+    blocking_io = true;
+    bool open = serve_one();
+    blocking_io = false;
+    return open;
+}
+
+void http::session::operator()(int fd) {
+    attach(fd);
+    BOOST_SCOPE_EXIT(&sockfd) {
+        ::shutdown(sockfd, SHUT_RDWR);
+        ::close(sockfd);
+        http::count(http::counter::connections_closed);
+        http::release_connection();
+        HTTP_LOG(debug) << "        closed fd #" << sockfd;
+    } BOOST_SCOPE_EXIT_END
+    HTTP_LOG(debug) << "Handling new client";
+    // Responses to pipelined requests are held back until the buffer runs dry
+    while(serve_one()) {
+        if(!request_buffered()) flush_corked();
+    }
+    try {
+        flush_corked();
+    } catch (const std::system_error& err) {
+        HTTP_LOG(error) << "System error " << err.code() << " while flushing: " << err.what();
     }
 }
 
-void http::session::handle_request(http::request req) {
-    auto requested_path = fs::path{req.uri}.lexically_normal();
-    try {        
-        auto mapped_path = chroot_map(requested_path, "www");
-        BOOST_LOG_TRIVIAL(info) << "* Mapping request to " << *mapped_path;
-        if(mapped_path) {
-            std::fstream input{*mapped_path};
-            if(input.is_open()) {
-                send_response(http::serve_file(requested_path, input));
-            } else if (fs::is_directory(*mapped_path)) {
-                send_response(http::serve_index(requested_path, *mapped_path));
-            } else {
-                send_response(http::serve_404(requested_path));
-            }
-        } else {
+void http::session::handle_request(const http::request& req) {
+    if(req.uri == "/__metrics") {
+        send_response({200, "OK", {{"Content-Type", "text/plain; version=0.0.4; charset=utf-8"}}, http::metrics_text()});
+        return;
+    }
+    if(upstream) {
+        serve_proxied(req, *upstream);
+        return;
+    }
+    if(body && body->upload) {
+        send_response(body->upload->commit() ? http::response{204, "No Content"} : plain_error(201, "Created"));
+        return;
+    }
+    fs::path requested_path = normal_path(req.uri);
+    if(const http::archive* site = http::packed_site()) {
+        serve_archived(requested_path, *site);
+        return;
+    }
+    try {
+        http::path_cache::entry resolved;
+        {
+            http::phase_timer resolving(http::phase::resolve);
+            resolved = http::resolved_paths().resolve(requested_path.string());
+        }
+        HTTP_LOG(debug) << "* Mapping request to " << resolved->mapped;
+        switch(resolved->type) {
+        case http::resolved_path::file:
+            serve_static(requested_path, *resolved);
+            break;
+        case http::resolved_path::directory:
+            send_response(http::serve_index(requested_path, resolved->mapped));
+            break;
+        case http::resolved_path::missing:
+            send_response(http::serve_404(requested_path));
+            break;
+        case http::resolved_path::forbidden:
             send_response({
                 403, "Forbidden",
                 {{"Content-Type", "text/plain; charset=utf-8"}},
                 "403 Forbidden"
             });
+            break;
         }
     } catch (const fs::filesystem_error& err) {
         if(err.code() == boost::system::errc::no_such_file_or_directory) {
-            BOOST_LOG_TRIVIAL(info) << "* No such file or directory (404)";
+            HTTP_LOG(debug) << "* No such file or directory (404)";
             send_response(http::serve_404(requested_path));
         } else {
             throw;
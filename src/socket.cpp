@@ -5,7 +5,6 @@
 #include <sstream>
 #include <algorithm>
 #include <iterator>
-#include <boost/log/trivial.hpp>
 #include <http/error.hpp>
 
 http::socket::socket(int connected) : sockfd(connected), buffer{0}, data_begin(begin(buffer)), data_end(data_begin) {
@@ -39,6 +38,7 @@ void http::socket::send_all(const unsigned char* start, ssize_t size) {
     while(size > 0) {
         ssize_t sent = ::send(sockfd, start, size, 0);
         http::check_error(sent);
+        start += sent;
         size -= sent;
     }
 }
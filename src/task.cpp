@@ -0,0 +1,40 @@
+#include <http/task.hpp>
+#include <new>
+
+http::frame_pool::~frame_pool() {
+    for(free_frame* head : free_lists) {
+        while(head) {
+            free_frame* next = head->next;
+            ::operator delete(head);
+            head = next;
+        }
+    }
+}
+
+http::frame_pool& http::frame_pool::local() {
+    thread_local frame_pool pool;
+    return pool;
+}
+
+void* http::frame_pool::allocate(std::size_t size) {
+    const std::size_t index = (size + granularity - 1) / granularity - 1;
+    if(size == 0 || index >= classes) {
+        return ::operator new(size);
+    }
+    if(free_frame* frame = free_lists[index]) {
+        free_lists[index] = frame->next;
+        free_counts[index]--;
+        return frame;
+    }
+    return ::operator new((index + 1) * granularity);
+}
+
+void http::frame_pool::deallocate(void* frame, std::size_t size) {
+    const std::size_t index = (size + granularity - 1) / granularity - 1;
+    if(size == 0 || index >= classes || free_counts[index] >= max_free) {
+        ::operator delete(frame);
+        return;
+    }
+    free_lists[index] = new(frame) free_frame{free_lists[index]};
+    free_counts[index]++;
+}
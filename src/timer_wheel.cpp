@@ -0,0 +1,136 @@
+#include <http/timer_wheel.hpp>
+#include <http/config.hpp>
+
+void http::timer_wheel::timer::unlink() {
+    prev->next = next;
+    next->prev = prev;
+    prev = next = this;
+}
+
+http::timer_wheel::timer::~timer() {
+    if(wheel) {
+        wheel->cancel(*this);
+    } else {
+        // It may still sit on a list of expired timers that hasn't been fired yet
+        unlink();
+    }
+}
+
+http::timer_wheel::timer_wheel(clock::duration tick, clock::time_point now) : origin(now), tick(tick) {
+}
+
+http::timer_wheel::~timer_wheel() {
+    for(auto& level : wheel) {
+        for(timer& head : level) {
+            while(head.next != &head) {
+                timer& t = *head.next;
+                t.unlink();
+                t.wheel = nullptr;
+            }
+        }
+    }
+}
+
+std::uint64_t http::timer_wheel::ticks_at(clock::time_point t) const {
+    if(t <= origin) return 0;
+    return static_cast<std::uint64_t>((t - origin) / tick);
+}
+
+// The level is the lowest whose slots cover the distance to the expiry; the
+// slot is the expiry's digit at that level, so it comes round (and cascades
+// down) in the very turn the expiry falls in
+void http::timer_wheel::insert(timer& t) {
+    const std::uint64_t max_delta = (std::uint64_t{1} << (slot_bits * levels)) - 1;
+    if(t.expiry <= current) t.expiry = current + 1;
+    if(t.expiry - current > max_delta) t.expiry = current + max_delta;
+    const std::uint64_t delta = t.expiry - current;
+    int level = 0;
+    while(level < levels - 1 && delta >= (std::uint64_t{1} << (slot_bits * (level + 1)))) level++;
+    timer& head = wheel[level][(t.expiry >> (slot_bits * level)) & (slots - 1)];
+    t.prev = head.prev;
+    t.next = &head;
+    head.prev->next = &t;
+    head.prev = &t;
+}
+
+void http::timer_wheel::cascade(int level) {
+    timer& head = wheel[level][(current >> (slot_bits * level)) & (slots - 1)];
+    while(head.next != &head) {
+        timer& t = *head.next;
+        t.unlink();
+        insert(t);
+    }
+}
+
+void http::timer_wheel::step(timer& expired) {
+    current++;
+    for(int level = 1; level < levels; level++) {
+        if(current & ((std::uint64_t{1} << (slot_bits * level)) - 1)) break;
+        cascade(level);
+    }
+    timer& head = wheel[0][current & (slots - 1)];
+    while(head.next != &head) {
+        timer& t = *head.next;
+        t.unlink();
+        t.wheel = nullptr;
+        n_armed--;
+        t.prev = expired.prev;
+        t.next = &expired;
+        expired.prev->next = &t;
+        expired.prev = &t;
+    }
+}
+
+void http::timer_wheel::schedule(timer& t, clock::time_point when) {
+    if(t.wheel) t.wheel->cancel(t);
+    t.expiry = when <= origin ? 0 : static_cast<std::uint64_t>((when - origin + tick - clock::duration{1}) / tick);
+    t.wheel = this;
+    n_armed++;
+    insert(t);
+}
+
+void http::timer_wheel::cancel(timer& t) {
+    if(t.wheel != this) return;
+    t.unlink();
+    t.wheel = nullptr;
+    n_armed--;
+}
+
+std::optional<http::timer_wheel::clock::duration> http::timer_wheel::until_next(clock::time_point now) const {
+    if(n_armed == 0) return std::nullopt;
+    // The next occupied slot in this turn of the first level; failing that,
+    // the start of the next turn, when the level above cascades into it
+    std::uint64_t due = (current | (slots - 1)) + 1;
+    for(std::uint64_t t = current + 1; t < due; t++) {
+        const timer& head = wheel[0][t & (slots - 1)];
+        if(head.next != &head) {
+            due = t;
+            break;
+        }
+    }
+    const clock::time_point at = origin + due * tick;
+    return at > now ? at - now : clock::duration::zero();
+}
+
+void http::connection_timer::update(timer_wheel& wheel, timer_wheel::clock::time_point now, bool partial_head, bool partial_body, bool backed_up, bool progressed) {
+    const http::config& config = http::settings();
+    if(backed_up) {
+        if(waiting != write || progressed || !armed()) {
+            waiting = write;
+            wheel.schedule(*this, now + std::chrono::seconds(config.write_timeout));
+        }
+    } else if(partial_body) {
+        if(waiting != body || progressed || !armed()) {
+            waiting = body;
+            wheel.schedule(*this, now + std::chrono::seconds(config.body_timeout));
+        }
+    } else if(partial_head) {
+        if(waiting != header || !armed()) {
+            waiting = header;
+            wheel.schedule(*this, now + std::chrono::seconds(config.header_timeout));
+        }
+    } else {
+        waiting = idle;
+        wheel.schedule(*this, now + std::chrono::seconds(config.idle_timeout));
+    }
+}
@@ -0,0 +1,910 @@
+#include <http/uring.hpp>
+#include <http/error.hpp>
+#include <http/log.hpp>
+#include <system_error>
+
+#if defined(HTTP_WITH_IO_URING) && __has_include(<linux/io_uring.h>)
+#include <http/session.hpp>
+#include <http/outbox.hpp>
+#include <http/config.hpp>
+#include <http/metrics.hpp>
+#include <http/admission.hpp>
+#include <linux/io_uring.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+    // What a completion is for, kept in the low bits of its user_data. The
+    // rest is the connection it belongs to (or, for release, the file slot).
+    enum op : std::uint64_t { ignored, accept_op, wake_op, recv_op, send_op, read_op, register_op, release_op, timeout_op, poll_op };
+    const std::uint64_t op_bits = 4;
+    const std::uint64_t op_mask = (1 << op_bits) - 1;
+
+    const unsigned ring_entries = 1024;
+    // Registered file table: slot 0 is the listener, the rest go to connections
+    const unsigned fixed_files = 1024;
+    // Provided buffer ring that recvs pick from; a power of two
+    const unsigned recv_buffers = 128;
+    const std::size_t recv_buffer_size = 16 * 1024;
+    const unsigned short recv_group = 0;
+    // Registered buffers that file bodies are read into
+    const unsigned file_buffers = 16;
+    const std::size_t max_file_buffer_size = 256 * 1024;
+    // How far a client may pipeline ahead of reading its responses before it is cut off
+    const std::size_t max_unserved = 1024 * 1024;
+    // The longest the loop sleeps while timers are armed. A timer armed after
+    // the sleep began can come due sooner than it ends, and fires late by up to this.
+    const auto max_timer_sleep = std::chrono::seconds(1);
+}
+
+static int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned n) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, n));
+}
+
+static std::uint64_t tag(const void* target, op kind) {
+    return reinterpret_cast<std::uint64_t>(target) | kind;
+}
+
+// The mapped submission and completion queues of one ring, and the buffers
+// and files registered with it. Each of those is optional: what the kernel
+// refuses is simply done the plain way.
+struct http::uring {
+    int fd = -1;
+    // Which fd (or registered ring index) io_uring_enter is given
+    int enter_fd = -1;
+    unsigned enter_flags = 0;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    unsigned sqe_tail = 0; // ours; published to *sq_tail on submit
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    void* sq_map = MAP_FAILED;
+    std::size_t sq_map_size = 0;
+    void* cq_map = MAP_FAILED;
+    std::size_t cq_map_size = 0;
+    std::size_t sqes_size = 0;
+
+    bool multishot_accept = true;
+    bool multishot_recv = true;
+    bool files_registered = false;
+    std::vector<unsigned> free_slots;
+
+    io_uring_buf_ring* buf_ring = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+    std::size_t buf_ring_size = 0;
+    unsigned short buf_tail = 0;
+    std::unique_ptr<char[]> recv_memory;
+
+    bool buffers_registered = false;
+    std::size_t file_buffer_size = 0;
+    std::unique_ptr<char[]> file_memory;
+    std::vector<int> free_buffers;
+
+    std::uint64_t wake_count;
+
+    __kernel_timespec timeout_spec;
+    bool timeout_armed = false;
+
+    explicit uring(unsigned entries) {
+        io_uring_params params = {};
+        params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        fd = io_uring_setup(entries, &params);
+        if(fd < 0 && errno == EINVAL) {
+            // Kernels before 5.19 know neither flag
+            params = {};
+            fd = io_uring_setup(entries, &params);
+        }
+        http::check_error(fd);
+        enter_fd = fd;
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sq_map = ::mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_map = single_mmap ? sq_map : ::mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if(sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+            int error = errno;
+            release();
+            throw std::system_error(error, std::system_category(), "mmap of io_uring queues");
+        }
+        char* sq = static_cast<char*>(sq_map);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+        unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for(unsigned i = 0; i < sq_entries; i++) sq_array[i] = i;
+        sqe_tail = *sq_tail;
+        char* cq = static_cast<char*>(cq_map);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    ~uring() {
+        release();
+    }
+
+    void release() {
+        if(buf_ring != MAP_FAILED) ::munmap(buf_ring, buf_ring_size);
+        if(sqes != MAP_FAILED) ::munmap(sqes, sqes_size);
+        if(cq_map != MAP_FAILED && cq_map != sq_map) ::munmap(cq_map, cq_map_size);
+        if(sq_map != MAP_FAILED) ::munmap(sq_map, sq_map_size);
+        if(fd >= 0) ::close(fd);
+    }
+
+    // The table starts out sparse except for the listener
+    void register_files(int listenfd) {
+        std::vector<int> table(fixed_files, -1);
+        table[0] = listenfd;
+        if(io_uring_register(fd, IORING_REGISTER_FILES, table.data(), table.size()) < 0) {
+            HTTP_LOG(warning) << "io_uring: no registered files: " << std::strerror(errno);
+            return;
+        }
+        files_registered = true;
+        for(unsigned slot = fixed_files - 1; slot > 0; slot--) free_slots.push_back(slot);
+    }
+
+    void register_buffers() {
+        file_buffer_size = std::min(http::settings().chunk_size, max_file_buffer_size);
+        file_memory.reset(new char[file_buffers * file_buffer_size]);
+        std::vector<iovec> iov;
+        for(unsigned i = 0; i < file_buffers; i++) {
+            iov.push_back({file_memory.get() + i * file_buffer_size, file_buffer_size});
+        }
+        if(io_uring_register(fd, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) < 0) {
+            // Usually RLIMIT_MEMLOCK; plain reads into the same memory still work
+            HTTP_LOG(warning) << "io_uring: no registered buffers: " << std::strerror(errno);
+        } else {
+            buffers_registered = true;
+        }
+        for(int i = file_buffers - 1; i >= 0; i--) free_buffers.push_back(i);
+    }
+
+    void register_buffer_ring() {
+        buf_ring_size = recv_buffers * sizeof(io_uring_buf);
+        void* memory = ::mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED) return;
+        buf_ring = static_cast<io_uring_buf_ring*>(memory);
+        io_uring_buf_reg reg = {};
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(memory);
+        reg.ring_entries = recv_buffers;
+        reg.bgid = recv_group;
+        if(io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            HTTP_LOG(warning) << "io_uring: no provided buffer ring, receiving one connection at a time: " << std::strerror(errno);
+            ::munmap(buf_ring, buf_ring_size);
+            buf_ring = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+            multishot_recv = false;
+            return;
+        }
+        recv_memory.reset(new char[recv_buffers * recv_buffer_size]);
+        for(unsigned short bid = 0; bid < recv_buffers; bid++) recycle(bid);
+    }
+
+    bool provided_buffers() const {
+        return buf_ring != MAP_FAILED;
+    }
+
+    const char* recv_buffer(unsigned short bid) const {
+        return recv_memory.get() + bid * recv_buffer_size;
+    }
+
+    // Hands a provided buffer back to the kernel
+    void recycle(unsigned short bid) {
+        // Not buf_ring->bufs: in C++ the empty struct in __DECLARE_FLEX_ARRAY shifts it by 8 bytes
+        io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(buf_ring);
+        io_uring_buf& slot = bufs[buf_tail & (recv_buffers - 1)];
+        slot.addr = reinterpret_cast<std::uint64_t>(recv_buffer(bid));
+        slot.len = recv_buffer_size;
+        slot.bid = bid;
+        buf_tail++;
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+    }
+
+    // Registered ring fds are per thread, so this is done by the loop itself
+    void register_ring_fd() {
+        io_uring_rsrc_update update = {};
+        update.offset = -1U;
+        update.data = static_cast<std::uint64_t>(fd);
+        if(io_uring_register(fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+            enter_fd = static_cast<int>(update.offset);
+            enter_flags = IORING_ENTER_REGISTERED_RING;
+        }
+    }
+
+    // A zeroed submission entry, submitting what is queued first if the ring is full
+    io_uring_sqe* next_sqe() {
+        while(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            if(submit(0) < 0 && errno != EBUSY && errno != EAGAIN) http::check_error(-1);
+        }
+        io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+        sqe_tail++;
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submits everything queued and, if asked, waits for that many completions
+    int submit(unsigned wait) {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        unsigned pending = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if(pending == 0 && wait == 0) return 0;
+        int n;
+        do {
+            n = io_uring_enter(enter_fd, pending, wait, enter_flags | (wait > 0 ? IORING_ENTER_GETEVENTS : 0));
+        } while(n < 0 && errno == EINTR);
+        return n;
+    }
+};
+
+// A connection driven by the ring. As with the reactor's, bytes are buffered
+// until whole request heads are in, those are served by the ordinary session
+// logic (which takes any body from the buffer as more recvs bring it in), and
+// the responses queue in the outbox until the loop sends them. A request that
+// goes upstream is served on an upstream worker, as far as queueing its
+// response, once nothing the ring does refers to the connection any more.
+// Aligned so that completions can carry four bits of op alongside its address.
+class alignas(16) http::uring_connection : public http::session, public http::connection_timer, public http::upstream_task {
+    http::uring_loop& owner;
+
+    public:
+    http::outbox queued;
+    int fd;
+    int slot = -1;         // in the registered file table, or -1 to use fd
+    int in_flight = 0;     // submissions whose completions still refer to us
+    bool recv_armed = false;
+    bool sending = false;
+    bool sending_file = false;
+    bool closing = false;  // no more requests are to be served
+    bool failed = false;   // hang up without sending the rest
+    bool shut = false;
+    bool progressed = false; // sent something since the deadline last moved
+    bool handing_off = false; // the next request goes upstream, once nothing is in flight
+    bool cancelling = false; // the armed recv has been asked to stop
+    bool polling_upstream = false; // waiting on the upstream for more of a response body
+    // Kept here while a send is in flight
+    std::array<iovec, http::outbox::max_iov> iov;
+    msghdr message;
+    // File bodies pass through a registered buffer, or staging if none is free
+    int file_buffer = -1;
+    std::vector<char> staging;
+    // Plain recvs land here when the kernel has no provided buffer rings
+    std::vector<char> recv_staging;
+
+    using http::session::body_pending;
+    using http::session::body_progress;
+
+    uring_connection(int fd, http::uring_loop& owner) : owner(owner), fd(fd) {
+        attach(fd);
+    }
+
+    void take(const char* bytes, std::size_t n) {
+        std::memcpy(buffer.prepare(n), bytes, n);
+        buffer.commit(n);
+    }
+
+    std::size_t unserved() const {
+        return buffer.data().size();
+    }
+
+    void serve_buffered() {
+        while(!closing && !handing_off && request_buffered()) {
+            if(!body_pending() && bound_upstream()) {
+                handing_off = true;
+                return;
+            }
+            closing = !serve_one();
+            if(body_pending()) return; // until more of it arrives
+            head_finished();
+        }
+    }
+
+    // Gives up on a request head or body that is taking too long, with a 408 if nothing else is queued
+    void time_out_head() {
+        if(!sending && queued.empty() && !closing) time_out();
+        closing = true;
+    }
+
+    protected:
+    std::size_t recv_some(char*, std::size_t) override {
+        return 0;
+    }
+
+    void send_message(std::string_view head, std::shared_ptr<http::body_source> body, bool chunked) override {
+        queued.push(head, std::move(body), chunked);
+    }
+
+    // Bodies come in through the ring's recvs like everything else, so there is never anything to read here,
+    // except on an upstream worker
+    bool recv_body() override {
+        return blocking_io && pull_body(true);
+    }
+
+    void run_upstream() override {
+        closing = !serve_upstream_bound();
+        handing_off = false;
+        head_finished();
+        owner.take_back(*this);
+    }
+};
+
+// Points an operation at a connection's socket, through the file table when it is registered there
+static void target(io_uring_sqe* sqe, const http::uring_connection& conn) {
+    if(conn.slot >= 0) {
+        sqe->fd = conn.slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = conn.fd;
+    }
+}
+
+bool http::uring_available() {
+    static const bool available = [](){
+        io_uring_params params = {};
+        int fd = io_uring_setup(4, &params);
+        if(fd < 0) return false;
+        const unsigned n_ops = 256;
+        std::vector<char> memory(sizeof(io_uring_probe) + n_ops * sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe*>(memory.data());
+        bool supported = io_uring_register(fd, IORING_REGISTER_PROBE, probe, n_ops) >= 0;
+        for(unsigned opcode : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+                               IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_FILES_UPDATE, IORING_OP_ASYNC_CANCEL,
+                               IORING_OP_POLL_ADD}) {
+            supported = supported && opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+        }
+        ::close(fd);
+        return supported;
+    }();
+    return available;
+}
+
+http::uring_loop::uring_loop(int listenfd) : ring(std::make_unique<uring>(ring_entries)), listenfd(listenfd), wakefd(::eventfd(0, EFD_CLOEXEC)), stopping(false) {
+    http::check_error(wakefd);
+    ring->register_files(listenfd);
+    ring->register_buffers();
+    ring->register_buffer_ring();
+    thread = std::thread([this](){ run(); });
+}
+
+http::uring_loop::~uring_loop() {
+    stopping.store(true);
+    std::uint64_t one = 1;
+    ::write(wakefd, &one, sizeof(one));
+    thread.join();
+    {
+        // Connections out on an upstream worker still come back here
+        std::unique_lock<std::mutex> lock(returned_mutex);
+        all_returned.wait(lock, [this](){ return returned.size() == out_on_workers; });
+    }
+    for(auto& [key, conn] : connections) {
+        ::close(conn->fd);
+    }
+    // Tearing the ring down cancels whatever is still in flight, before the buffers it points at go
+    ring.reset();
+    connections.clear();
+    ::close(wakefd);
+}
+
+void http::uring_loop::pin_to_cpu(unsigned cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if(error != 0) {
+        HTTP_LOG(warning) << "Could not pin io_uring loop to CPU " << cpu << ": " << std::strerror(error);
+    }
+}
+
+void http::uring_loop::run() {
+    ring->register_ring_fd();
+    arm_wake();
+    arm_accept();
+    while(!stopping.load()) {
+        arm_timeout();
+        // Everything the last pass queued goes in, and we sleep until something completes
+        int n = ring->submit(1);
+        if(n < 0 && errno != EBUSY && errno != EAGAIN) http::check_error(n);
+        reap();
+        timers.advance(http::timer_wheel::clock::now(), [this](http::timer_wheel::timer& t){
+            expire(static_cast<uring_connection&>(static_cast<http::connection_timer&>(t)));
+        });
+    }
+}
+
+// Makes sure the loop wakes for the next timer due, if any
+void http::uring_loop::arm_timeout() {
+    if(ring->timeout_armed) return;
+    auto wait = timers.until_next(http::timer_wheel::clock::now());
+    if(!wait) return;
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::min<http::timer_wheel::clock::duration>(*wait, max_timer_sleep));
+    ring->timeout_spec.tv_sec = nanoseconds.count() / 1000000000;
+    ring->timeout_spec.tv_nsec = nanoseconds.count() % 1000000000;
+    io_uring_sqe* sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&ring->timeout_spec);
+    sqe->len = 1;
+    sqe->user_data = timeout_op;
+    ring->timeout_armed = true;
+}
+
+void http::uring_loop::expire(uring_connection& conn) {
+    http::count(http::counter::timeouts);
+    HTTP_LOG(debug) << "        fd #" << conn.fd << " timed out";
+    if(conn.waiting_for() == http::connection_timer::header || conn.waiting_for() == http::connection_timer::body) {
+        // Tell the client why, if the socket will take it; the write timeout still applies
+        conn.time_out_head();
+        kick(conn);
+    } else {
+        conn.failed = true;
+    }
+    settle(conn);
+}
+
+void http::uring_loop::reap() {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++) {
+        const io_uring_cqe& cqe = ring->cqes[head & ring->cq_mask];
+        std::uint64_t user_data = cqe.user_data;
+        int res = cqe.res;
+        unsigned flags = cqe.flags;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        complete(user_data, res, flags);
+    }
+}
+
+void http::uring_loop::complete(std::uint64_t user_data, int res, unsigned flags) {
+    const op kind = static_cast<op>(user_data & op_mask);
+    switch(kind) {
+    case ignored:
+        return;
+    case accept_op:
+        on_accept(res, flags);
+        return;
+    case wake_op:
+        if(!stopping.load()) arm_wake();
+        resume_returned();
+        return;
+    case timeout_op:
+        ring->timeout_armed = false;
+        return;
+    case release_op:
+        if(res >= 0) {
+            ring->free_slots.push_back(static_cast<unsigned>(user_data >> op_bits));
+        } else {
+            HTTP_LOG(warning) << "io_uring: could not release file slot: " << std::strerror(-res);
+        }
+        return;
+    default:
+        break;
+    }
+    auto& conn = *reinterpret_cast<uring_connection*>(user_data & ~op_mask);
+    conn.in_flight--;
+    if(kind == recv_op) {
+        on_recv(conn, res, flags);
+    } else if(kind == send_op) {
+        on_send(conn, res);
+    } else if(kind == read_op) {
+        on_read(conn, res);
+    } else if(kind == poll_op) {
+        on_upstream(conn, res);
+    } else if(kind == register_op && res < 0) {
+        // The linked recv is cancelled, and gets rearmed on the plain fd
+        HTTP_LOG(debug) << "io_uring: could not register fd #" << conn.fd << ": " << std::strerror(-res);
+        ring->free_slots.push_back(conn.slot);
+        conn.slot = -1;
+    }
+    settle(conn);
+}
+
+void http::uring_loop::arm_wake() {
+    io_uring_sqe* sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakefd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&ring->wake_count);
+    sqe->len = sizeof(ring->wake_count);
+    sqe->user_data = wake_op;
+}
+
+void http::uring_loop::arm_accept() {
+    io_uring_sqe* sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    if(ring->files_registered) {
+        sqe->fd = 0;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = listenfd;
+    }
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if(ring->multishot_accept) sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = accept_op;
+}
+
+void http::uring_loop::on_accept(int res, unsigned flags) {
+    const bool rearm = !(flags & IORING_CQE_F_MORE);
+    if(res == -EINVAL && ring->multishot_accept) {
+        HTTP_LOG(info) << "io_uring: no multishot accept, accepting one connection per submission";
+        ring->multishot_accept = false;
+    } else if(res < 0) {
+        if(res != -EAGAIN && res != -EINTR && res != -ECONNABORTED) {
+            HTTP_LOG(error) << "accept failed: " << std::strerror(-res);
+        }
+    } else if(!http::admit_connection()) {
+        http::turn_away(res);
+    } else {
+        HTTP_LOG(debug) << "        accepted fd #" << res;
+        http::count(http::counter::connections_accepted);
+        auto owned = std::make_unique<uring_connection>(res, *this);
+        uring_connection& conn = *owned;
+        connections.emplace(&conn, std::move(owned));
+        if(ring->files_registered && !ring->free_slots.empty()) {
+            register_socket(conn);
+        }
+        arm_recv(conn);
+        conn.update(timers, http::timer_wheel::clock::now(), false, false, false, false);
+    }
+    if(rearm && !stopping.load()) arm_accept();
+}
+
+// Puts the socket in the file table, linked ahead of its first recv so both go in one submission
+void http::uring_loop::register_socket(uring_connection& conn) {
+    conn.slot = static_cast<int>(ring->free_slots.back());
+    ring->free_slots.pop_back();
+    io_uring_sqe* sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&conn.fd);
+    sqe->len = 1;
+    sqe->off = static_cast<std::uint64_t>(conn.slot);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe->user_data = tag(&conn, register_op);
+    conn.in_flight++;
+}
+
+void http::uring_loop::arm_recv(uring_connection& conn) {
+    io_uring_sqe* sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    target(sqe, conn);
+    if(ring->provided_buffers()) {
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = recv_group;
+        if(ring->multishot_recv) sqe->ioprio |= IORING_RECV_MULTISHOT;
+    } else {
+        conn.recv_staging.resize(recv_buffer_size);
+        sqe->addr = reinterpret_cast<std::uint64_t>(conn.recv_staging.data());
+        sqe->len = conn.recv_staging.size();
+    }
+    sqe->user_data = tag(&conn, recv_op);
+    conn.recv_armed = true;
+    conn.in_flight++;
+}
+
+void http::uring_loop::on_recv(uring_connection& conn, int res, unsigned flags) {
+    if(flags & IORING_CQE_F_MORE) {
+        conn.in_flight++; // still armed
+    } else {
+        conn.recv_armed = false;
+    }
+    if(res > 0) {
+        http::count(http::counter::bytes_received, res);
+        if(flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            conn.take(ring->recv_buffer(bid), res);
+            ring->recycle(bid);
+        } else {
+            conn.take(conn.recv_staging.data(), res);
+        }
+        conn.serve_buffered();
+        if(conn.unserved() > max_unserved) {
+            HTTP_LOG(warning) << "fd #" << conn.fd << " pipelined too far ahead of its responses";
+            conn.failed = true;
+        }
+    } else if(res == 0) {
+        // Peer half-closed: answer what we already have, then hang up. A request
+        // going upstream is answered first, and the next recv sees the close again.
+        conn.serve_buffered();
+        if(!conn.handing_off) conn.closing = true;
+    } else if(res == -EINVAL && ring->multishot_recv) {
+        HTTP_LOG(info) << "io_uring: no multishot recv, rearming after every read";
+        ring->multishot_recv = false;
+    } else if(res != -ENOBUFS && res != -ECANCELED) {
+        // ENOBUFS only means the provided buffers ran out for a moment
+        conn.failed = true;
+    }
+    kick(conn);
+    // Single-shot reads wait for the responses to drain first, as in the reactor
+    const bool backed_up = !ring->multishot_recv && (conn.sending || conn.polling_upstream);
+    if(!conn.recv_armed && !conn.closing && !conn.failed && !conn.shut && !conn.handing_off && !backed_up) {
+        arm_recv(conn);
+    }
+}
+
+// Starts sending whatever is queued, unless a send (or a wait on the upstream) is already in flight
+void http::uring_loop::kick(uring_connection& conn) {
+    if(conn.sending || conn.polling_upstream || conn.failed || conn.shut) return;
+    while(!conn.queued.empty()) {
+        if(const http::file_body* file = conn.queued.front_file()) {
+            if(file->length == 0) {
+                conn.queued.file_sent(0);
+                continue;
+            }
+            read_file(conn);
+            return;
+        }
+        bool more;
+        int count;
+        try {
+            count = conn.queued.gather(conn.iov, more);
+        } catch (const std::exception& err) {
+            // A body that fails part way (an upstream gone, say) can only be cut off
+            HTTP_LOG(error) << "fd #" << conn.fd << " response body failed: " << err.what();
+            conn.failed = true;
+            return;
+        }
+        if(count == 0 && conn.queued.stalled_on() >= 0) {
+            poll_upstream(conn, conn.queued.stalled_on());
+            return;
+        }
+        if(count == 0) continue;
+        conn.message = {};
+        conn.message.msg_iov = conn.iov.data();
+        conn.message.msg_iovlen = count;
+        io_uring_sqe* sqe = ring->next_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        target(sqe, conn);
+        sqe->addr = reinterpret_cast<std::uint64_t>(&conn.message);
+        sqe->len = 1;
+        // Corked when a file follows, to share a segment with its start
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+        sqe->user_data = tag(&conn, send_op);
+        conn.in_flight++;
+        conn.sending = true;
+        conn.sending_file = false;
+        return;
+    }
+}
+
+// Reads the next piece of a file body into a buffer, with the send of it linked straight after
+void http::uring_loop::read_file(uring_connection& conn) {
+    const http::file_body& file = *conn.queued.front_file();
+    if(conn.file_buffer < 0 && !ring->free_buffers.empty()) {
+        conn.file_buffer = ring->free_buffers.back();
+        ring->free_buffers.pop_back();
+    }
+    char* into;
+    if(conn.file_buffer >= 0) {
+        into = ring->file_memory.get() + conn.file_buffer * ring->file_buffer_size;
+    } else {
+        conn.staging.resize(ring->file_buffer_size);
+        into = conn.staging.data();
+    }
+    const std::size_t n = std::min(file.length, ring->file_buffer_size);
+
+    io_uring_sqe* read = ring->next_sqe();
+    read->opcode = IORING_OP_READ;
+    if(conn.file_buffer >= 0 && ring->buffers_registered) {
+        read->opcode = IORING_OP_READ_FIXED;
+        read->buf_index = static_cast<unsigned short>(conn.file_buffer);
+    }
+    read->fd = file.fd->get();
+    read->addr = reinterpret_cast<std::uint64_t>(into);
+    read->len = n;
+    read->off = file.offset;
+    // A short read breaks the link, cancelling the send; it is then simply retried
+    read->flags |= IOSQE_IO_LINK;
+    read->user_data = tag(&conn, read_op);
+
+    io_uring_sqe* send = ring->next_sqe();
+    send->opcode = IORING_OP_SEND;
+    target(send, conn);
+    send->addr = reinterpret_cast<std::uint64_t>(into);
+    send->len = n;
+    send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (n < file.length ? MSG_MORE : 0);
+    send->user_data = tag(&conn, send_op);
+
+    conn.in_flight += 2;
+    conn.sending = true;
+    conn.sending_file = true;
+}
+
+void http::uring_loop::on_read(uring_connection& conn, int res) {
+    if(res < 0) {
+        HTTP_LOG(error) << "Reading a file body failed: " << std::strerror(-res);
+        conn.failed = true;
+    } else if(res == 0) {
+        HTTP_LOG(error) << "File truncated while sending";
+        conn.failed = true;
+    }
+}
+
+void http::uring_loop::on_send(uring_connection& conn, int res) {
+    conn.sending = false;
+    if(res > 0) {
+        http::count(http::counter::bytes_sent, res);
+        conn.progressed = true;
+        if(conn.sending_file) {
+            conn.queued.file_sent(res);
+        } else {
+            conn.queued.advance(res);
+        }
+    } else if(res < 0 && res != -ECANCELED) {
+        conn.failed = true;
+    }
+    if(conn.file_buffer >= 0 && !conn.queued.front_file()) {
+        ring->free_buffers.push_back(conn.file_buffer);
+        conn.file_buffer = -1;
+    }
+    kick(conn);
+    if(!conn.sending && !conn.polling_upstream && !conn.recv_armed && !conn.closing && !conn.failed && !conn.shut && !conn.handing_off) {
+        arm_recv(conn);
+    }
+}
+
+// Waits for the upstream a response body comes from to send more of it
+void http::uring_loop::poll_upstream(uring_connection& conn, int fd) {
+    io_uring_sqe* sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag(&conn, poll_op);
+    conn.in_flight++;
+    conn.polling_upstream = true;
+}
+
+void http::uring_loop::on_upstream(uring_connection& conn, int res) {
+    conn.polling_upstream = false;
+    if(res < 0 && res != -ECANCELED) {
+        HTTP_LOG(error) << "fd #" << conn.fd << " could not poll its upstream: " << std::strerror(-res);
+        conn.failed = true;
+    }
+    kick(conn);
+    if(!conn.sending && !conn.polling_upstream && !conn.recv_armed && !conn.closing && !conn.failed && !conn.shut && !conn.handing_off) {
+        arm_recv(conn);
+    }
+}
+
+// Asks the kernel to stop an operation in flight, whose completion then says so with ECANCELED
+static void cancel(http::uring& ring, const http::uring_connection& conn, op kind) {
+    io_uring_sqe* sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag(&conn, kind);
+    sqe->user_data = ignored;
+}
+
+// Stops a (multishot) recv
+void http::uring_loop::cancel_recv(uring_connection& conn) {
+    cancel(*ring, conn, recv_op);
+    conn.cancelling = true;
+}
+
+void http::uring_loop::hand_off(uring_connection& conn) {
+    timers.cancel(conn);
+    conn.cancelling = false;
+    out_on_workers++;
+    http::post_upstream(conn);
+}
+
+void http::uring_loop::take_back(uring_connection& conn) {
+    {
+        std::lock_guard<std::mutex> lock(returned_mutex);
+        returned.push_back(&conn);
+    }
+    all_returned.notify_all();
+    std::uint64_t one = 1;
+    http::check_error(::write(wakefd, &one, sizeof(one)));
+}
+
+void http::uring_loop::resume_returned() {
+    std::vector<uring_connection*> back;
+    {
+        std::lock_guard<std::mutex> lock(returned_mutex);
+        back.swap(returned);
+    }
+    for(uring_connection* conn : back) {
+        out_on_workers--;
+        // Whatever of a pipelined batch the worker left
+        conn->serve_buffered();
+        kick(*conn);
+        if(!conn->recv_armed && !conn->closing && !conn->failed && !conn->handing_off) {
+            arm_recv(*conn);
+        }
+        settle(*conn);
+    }
+}
+
+void http::uring_loop::settle(uring_connection& conn) {
+    if(conn.handing_off && !conn.shut && !conn.failed && !conn.sending && conn.queued.empty()) {
+        if(conn.recv_armed) {
+            if(!conn.cancelling) cancel_recv(conn);
+        } else if(conn.in_flight == 0) {
+            hand_off(conn);
+            return;
+        }
+    }
+    const bool finished = conn.closing && !conn.sending && conn.queued.empty();
+    if(!conn.shut && (conn.failed || finished)) {
+        // Wakes up the armed recv (with 0), and fails any send still in flight
+        ::shutdown(conn.fd, SHUT_RDWR);
+        if(conn.polling_upstream) cancel(*ring, conn, poll_op);
+        conn.shut = true;
+        timers.cancel(conn);
+    }
+    if(!conn.shut) {
+        const bool backed_up = conn.sending || !conn.queued.empty();
+        conn.update(timers, http::timer_wheel::clock::now(), conn.unserved() > 0, conn.body_pending(), backed_up,
+                    conn.progressed || conn.body_progress);
+        conn.progressed = false;
+        conn.body_progress = false;
+    }
+    if(!conn.shut || conn.in_flight > 0) return;
+    ::close(conn.fd);
+    if(conn.slot >= 0) {
+        static const int no_file = -1;
+        io_uring_sqe* sqe = ring->next_sqe();
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<std::uint64_t>(&no_file);
+        sqe->len = 1;
+        sqe->off = static_cast<std::uint64_t>(conn.slot);
+        sqe->user_data = (static_cast<std::uint64_t>(conn.slot) << op_bits) | release_op;
+    }
+    if(conn.file_buffer >= 0) ring->free_buffers.push_back(conn.file_buffer);
+    http::count(http::counter::connections_closed);
+    http::release_connection();
+    HTTP_LOG(debug) << "        closed fd #" << conn.fd;
+    connections.erase(&conn);
+}
+
+#else
+
+struct http::uring {};
+class http::uring_connection {};
+
+bool http::uring_available() {
+    return false;
+}
+
+http::uring_loop::uring_loop(int) : listenfd(-1), wakefd(-1), stopping(false) {
+    throw std::system_error(ENOSYS, std::system_category(), "built without io_uring");
+}
+
+http::uring_loop::~uring_loop() = default;
+
+void http::uring_loop::pin_to_cpu(unsigned) {
+}
+
+#endif
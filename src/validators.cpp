@@ -0,0 +1,38 @@
+#include <http/validators.hpp>
+#include <iterator>
+#include <fmt/format.h>
+
+std::pmr::string http::entity_tag(const struct stat& info, std::pmr::memory_resource* memory) {
+    std::pmr::string tag{memory};
+    fmt::format_to(std::back_inserter(tag), "\"{:x}-{:x}-{:x}.{:x}\"",
+        info.st_ino,
+        info.st_size,
+        info.st_mtim.tv_sec,
+        info.st_mtim.tv_nsec
+    );
+    return tag;
+}
+
+std::pmr::string http::encoded_tag(std::string_view tag, std::string_view encoding, std::pmr::memory_resource* memory) {
+    // Inside the closing quote
+    std::pmr::string encoded{memory};
+    fmt::format_to(std::back_inserter(encoded), "{}-{}\"", tag.substr(0, tag.size() - 1), encoding);
+    return encoded;
+}
+
+static std::string_view opaque(std::string_view tag) {
+    if(tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+    return tag;
+}
+
+bool http::tag_list_matches(std::string_view header, std::string_view tag) {
+    while(!header.empty()) {
+        std::size_t comma = header.find(',');
+        std::string_view candidate = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
+        while(!candidate.empty() && (candidate.front() == ' ' || candidate.front() == '\t')) candidate.remove_prefix(1);
+        while(!candidate.empty() && (candidate.back() == ' ' || candidate.back() == '\t')) candidate.remove_suffix(1);
+        if(candidate == "*" || opaque(candidate) == opaque(tag)) return true;
+    }
+    return false;
+}
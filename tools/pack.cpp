@@ -0,0 +1,197 @@
+// Packs a document root into a single archive for a.out --archive=FILE: every
+// file, and every directory's listing page, with its MIME type, validators and
+// (where it comes out smaller) a gzipped copy, behind a hash index of request
+// paths. The archive is written next to its destination and renamed into
+// place, so a server starting up never maps half of one.
+// Usage: pack [--root=www] [--out=www.pack] [--gzip-level=1-9]
+#include <http/archive.hpp>
+#include <http/compression.hpp>
+#include <http/http_date.hpp>
+#include <http/index.hpp>
+#include <http/mime.hpp>
+#include <http/response.hpp>
+#include <http/validators.hpp>
+#include <boost/filesystem.hpp>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fmt/format.h>
+
+namespace fs = boost::filesystem;
+
+namespace {
+    struct options {
+        std::string root = "www";
+        std::string out = "www.pack";
+        int gzip_level = 9; // packing happens once, so spend the time
+    };
+
+    std::string read_file(const fs::path& p) {
+        std::ifstream file{p.string(), std::ios::binary};
+        if(!file) throw std::runtime_error("Can't read " + p.string());
+        return {std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    }
+
+    std::string gzip(const std::string& bytes, int level) {
+        auto source = http::gzip_source(http::memory_source(bytes), level);
+        std::string out;
+        char chunk[64 * 1024];
+        while(std::size_t n = source->read(chunk, sizeof(chunk))) {
+            out.append(chunk, n);
+        }
+        return out;
+    }
+
+    std::size_t align(std::size_t offset, std::size_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // Strings and bodies are appended to one blob area as entries are packed,
+    // with offsets from its start; they are moved past the header, slots and
+    // entries once the number of entries is known
+    class packer {
+        options opts;
+        fs::path root;
+        std::vector<http::archive_entry> entries;
+        std::string blobs;
+        std::size_t identity_bytes = 0;
+        std::size_t gzip_bytes = 0;
+
+        http::archive_span add(std::string_view bytes) {
+            http::archive_span span{blobs.size(), bytes.size()};
+            blobs += bytes;
+            return span;
+        }
+
+        void pack(const std::string& request_path, const fs::path& p) {
+            struct stat info;
+            if(::stat(p.c_str(), &info) != 0) return; // vanished, or a dangling link
+            http::archive_entry entry{};
+            std::string body;
+            std::string_view content_type;
+            if(S_ISDIR(info.st_mode)) {
+                entry.type = http::archive_entry::directory;
+                content_type = "text/html; charset=utf-8";
+                body = http::render_index(request_path, p);
+            } else if(S_ISREG(info.st_mode)) {
+                entry.type = http::archive_entry::file;
+                content_type = http::get_content_type(request_path);
+                body = read_file(p);
+                std::pmr::string tag = http::entity_tag(info);
+                entry.etag = add(tag);
+                entry.gzip_etag = add(http::encoded_tag(tag, "gzip"));
+                entry.last_modified = add(http::format_http_date(info.st_mtime));
+            } else {
+                return;
+            }
+            entry.path = add(request_path);
+            entry.modified = info.st_mtime;
+            entry.content_type = add(content_type);
+            entry.identity = add(body);
+            identity_bytes += body.size();
+            if(http::compressible(content_type) && !body.empty()) {
+                std::string compressed = gzip(body, opts.gzip_level);
+                if(compressed.size() < body.size()) {
+                    entry.gzip = add(compressed);
+                    gzip_bytes += compressed.size();
+                }
+            }
+            entries.push_back(entry);
+        }
+
+        public:
+        explicit packer(options opts) : opts(std::move(opts)), root(fs::canonical(this->opts.root)) {}
+
+        void walk() {
+            // Sorted, so the same tree always packs to the same bytes
+            std::vector<std::pair<std::string, fs::path>> found{{"/", root}};
+            for(fs::recursive_directory_iterator it{root}, end; it != end; ++it) {
+                fs::path p = it->path();
+                // Like the server, nothing that leads outside the root; symlinked directories aren't followed
+                boost::system::error_code error;
+                fs::path target = fs::canonical(p, error);
+                std::string relative = p.lexically_relative(root).generic_string();
+                if(error || target.string().compare(0, root.string().size() + 1, root.string() + "/") != 0
+                   || (fs::is_symlink(p) && fs::is_directory(p))) {
+                    std::cerr << "Skipping " << relative << "\n";
+                    continue;
+                }
+                found.emplace_back("/" + relative, p);
+            }
+            std::sort(found.begin(), found.end());
+            for(const auto& [request_path, p] : found) {
+                pack(request_path, p);
+            }
+        }
+
+        void write() {
+            http::archive_header header{};
+            std::copy(std::begin(http::archive_magic), std::end(http::archive_magic), header.magic);
+            header.version = http::archive_version;
+            header.entry_count = static_cast<std::uint32_t>(entries.size());
+            header.slot_count = 1;
+            while(header.slot_count < 2 * (entries.size() + 1)) header.slot_count *= 2;
+            header.slots_offset = sizeof(header);
+            header.entries_offset = align(header.slots_offset + header.slot_count * sizeof(std::uint32_t), alignof(http::archive_entry));
+            const std::uint64_t blobs_offset = header.entries_offset + entries.size() * sizeof(http::archive_entry);
+
+            std::vector<std::uint32_t> slots(header.slot_count);
+            for(std::size_t i = 0; i < entries.size(); i++) {
+                http::archive_entry& entry = entries[i];
+                std::string_view path{blobs.data() + entry.path.offset, entry.path.length};
+                std::uint64_t slot = http::archive_hash(path) & (header.slot_count - 1);
+                while(slots[slot] != 0) slot = (slot + 1) & (header.slot_count - 1);
+                slots[slot] = static_cast<std::uint32_t>(i + 1);
+                for(http::archive_span* span : {&entry.path, &entry.content_type, &entry.etag, &entry.gzip_etag,
+                                                &entry.last_modified, &entry.identity, &entry.gzip}) {
+                    span->offset += blobs_offset;
+                }
+            }
+
+            const std::string temporary = opts.out + ".tmp";
+            {
+                std::ofstream out{temporary, std::ios::binary | std::ios::trunc};
+                out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                out.write(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(std::uint32_t));
+                std::string padding(header.entries_offset - header.slots_offset - slots.size() * sizeof(std::uint32_t), '\0');
+                out.write(padding.data(), padding.size());
+                out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(http::archive_entry));
+                out.write(blobs.data(), blobs.size());
+                out.close();
+                if(!out) throw std::runtime_error("Can't write " + temporary);
+            }
+            if(std::rename(temporary.c_str(), opts.out.c_str()) != 0) {
+                throw std::runtime_error("Can't rename " + temporary + " to " + opts.out);
+            }
+            fmt::print("Packed {} entries from {} into {}: {} bytes, {} gzipped, {} total\n",
+                       entries.size(), root.string(), opts.out, identity_bytes, gzip_bytes, blobs_offset + blobs.size());
+        }
+    };
+}
+
+int main(int argc, char** argv) {
+    options opts;
+    try {
+        for(int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            std::string name = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            if(name == "--root" && !value.empty()) opts.root = value;
+            else if(name == "--out" && !value.empty()) opts.out = value;
+            else if(name == "--gzip-level" && std::stoi(value) >= 1 && std::stoi(value) <= 9) opts.gzip_level = std::stoi(value);
+            else throw std::invalid_argument("Bad option " + arg);
+        }
+        packer p{opts};
+        p.walk();
+        p.write();
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+}